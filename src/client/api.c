@@ -1,23 +1,267 @@
 #include "api.h"
 
 #include "src/common/constants.h"
+#include "src/common/hash.h"
+#include "src/common/io.h"
 #include "src/common/protocol.h"
+#include "src/common/ring.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+// A session's pipes stay open from connect to disconnect. Over a socket, all
+// three are the connection. Responses are read by a receiver thread, which
+// completes the future of each request, and notifications by another; over
+// a socket one thread reads both, as they share the connection
+struct KvsClient
+{
+  int req_fd;
+  int resp_fd;
+  int notif_fd;
+  int socket;       // connected with kvs_client_connect_socket
+  RingSession *shm; // rings of a session from kvs_client_connect_shm
+  char *paths[3];   // FIFOs to remove once the session ends
+
+  pthread_t notification_thread;
+  pthread_t response_thread;
+  int response_thread_started;
+
+  // Requests are encoded and written one at a time
+  pthread_mutex_t send_lock;
+  Frame request;
+  uint32_t last_request_id;
+
+  // Requests in flight, in the slot request_id % KVS_MAX_IN_FLIGHT until
+  // their response arrives
+  pthread_mutex_t lock;
+  pthread_cond_t slot_free;
+  KvsFuture *slots[KVS_MAX_IN_FLIGHT];
+  int closed; // no more responses will arrive
+
+  atomic_int disconnecting; // EOF is expected
+  int exit_on_close;        // the process exits if the server ends the session
+
+  KvsNotifyCallback on_notify;
+  void *notify_arg;
+  struct NearCache *cache; // set by kvs_client_enable_cache
+
+  Frame scratch; // buffer the next response is read into
+};
+
+struct KvsFuture
+{
+  uint32_t request_id;
+  uint8_t op_code;
+  size_t num_keys;
+
+  pthread_mutex_t lock;
+  pthread_cond_t completed;
+  int done;
+  int status; // 0 if the request succeeded, 1 otherwise
+  KvsFutureCallback callback;
+  void *callback_arg;
+
+  Frame response;
+  const char **values; // READ, pointing into response
+  int *flags;          // DELETE, SUBSCRIBE_MANY, UNSUBSCRIBE_MANY
+};
+
+// *Near cache
+#define CACHE_MAX_BUCKETS (1 << 16)
+
+// Values of keys read through kvs_client_get, kept for as long as the session
+// is subscribed to them. Entries are found through a hash table and kept in
+// a list from the most to the least recently used, the one evicted first
+typedef struct CacheEntry
+{
+  char *key;
+  char *value;   // NULL if the key does not exist
+  size_t size;   // bytes counted against the cache's limit
+  int fetching;  // its READ is in flight
+  int notified;  // a notification arrived while fetching, newer than the READ
+  int stale;     // to be read again, as a notification could not be applied
+  int evicting;  // no longer counted, removed once its UNSUBSCRIBE is sent
+  long long fetched_ms;
+  struct CacheEntry *next; // in the same bucket
+  struct CacheEntry *newer;
+  struct CacheEntry *older;
+} CacheEntry;
+
+typedef struct NearCache
+{
+  pthread_mutex_t lock;
+  pthread_cond_t settled; // signaled when an entry is fetched or removed
+  CacheEntry **buckets;
+  size_t num_buckets; // a power of 2
+  CacheEntry *newest;
+  CacheEntry *oldest;
+  size_t entries;
+  size_t bytes;
+  size_t max_entries;
+  size_t max_bytes;
+  unsigned int max_age_ms;
+} NearCache;
+
+static long long now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static size_t cache_bucket(NearCache *cache, const char *key)
+{
+  return hash_string(key) & (cache->num_buckets - 1);
+}
+
+static CacheEntry **cache_find(NearCache *cache, const char *key)
+{
+  CacheEntry **entry = &cache->buckets[cache_bucket(cache, key)];
+  while (*entry != NULL && strcmp((*entry)->key, key) != 0)
+  {
+    entry = &(*entry)->next;
+  }
+  return entry;
+}
+
+// Moves an entry to the front of the list, as the most recently used
+static void cache_touch(NearCache *cache, CacheEntry *entry)
+{
+  if (cache->newest == entry)
+  {
+    return;
+  }
+  entry->newer->older = entry->older;
+  *(entry->older != NULL ? &entry->older->newer : &cache->oldest) = entry->newer;
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  cache->newest->newer = entry;
+  cache->newest = entry;
+}
+
+// Adds an entry for a key, as the most recently used
+static CacheEntry *cache_add(NearCache *cache, const char *key)
+{
+  CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+  if (entry == NULL || (entry->key = strdup(key)) == NULL)
+  {
+    free(entry);
+    return NULL;
+  }
+  CacheEntry **bucket = &cache->buckets[cache_bucket(cache, key)];
+  entry->next = *bucket;
+  *bucket = entry;
+  entry->older = cache->newest;
+  *(cache->newest != NULL ? &cache->newest->newer : &cache->oldest) = entry;
+  cache->newest = entry;
+
+  entry->size = sizeof(CacheEntry) + strlen(key) + 1;
+  cache->entries++;
+  cache->bytes += entry->size;
+  return entry;
+}
+
+// Replaces the value of an entry, keeping the byte count in step
+// @return 0 on success, 1 if the copy could not be allocated
+static int cache_set(NearCache *cache, CacheEntry *entry, const char *value)
+{
+  char *copy = NULL;
+  if (value != NULL && (copy = strdup(value)) == NULL)
+  {
+    return 1;
+  }
+  cache->bytes -= entry->size;
+  free(entry->value);
+  entry->value = copy;
+  entry->size = sizeof(CacheEntry) + strlen(entry->key) + 1 + (copy != NULL ? strlen(copy) + 1 : 0);
+  cache->bytes += entry->size;
+  return 0;
+}
 
-// int req_pipe_fd = -1;
-// int resp_pipe_fd = -1;
-// int notif_pipe_fd = -1;
+// Stops counting an entry against the limits, before it is removed
+static void cache_release(NearCache *cache, CacheEntry *entry)
+{
+  cache->entries--;
+  cache->bytes -= entry->size;
+}
+
+// Takes an entry out of the cache and frees it
+static void cache_remove(NearCache *cache, CacheEntry *entry)
+{
+  *cache_find(cache, entry->key) = entry->next;
+  *(entry->newer != NULL ? &entry->newer->older : &cache->newest) = entry->older;
+  *(entry->older != NULL ? &entry->older->newer : &cache->oldest) = entry->newer;
+  free(entry->key);
+  free(entry->value);
+  free(entry);
+}
+
+// Marks the least recently used entries for eviction while the cache is
+// over its limits, leaving out those being fetched
+// @return Number of entries marked, whose subscriptions are to be dropped
+static size_t cache_evict(NearCache *cache, CacheEntry *evicted[], size_t max_evicted)
+{
+  size_t count = 0;
+  for (CacheEntry *entry = cache->oldest;
+       entry != NULL && count < max_evicted &&
+       (cache->entries > cache->max_entries || cache->bytes > cache->max_bytes);
+       entry = entry->newer)
+  {
+    if (!entry->fetching && !entry->evicting)
+    {
+      cache_release(cache, entry);
+      entry->evicting = 1;
+      evicted[count++] = entry;
+    }
+  }
+  return count;
+}
+
+// Updates the entry of a notified key, if it is cached. Called on the
+// notification thread, so entries over the limits are only evicted by the
+// next kvs_client_get. value is NULL if the key was deleted
+static void cache_notify(NearCache *cache, const char *key, const char *value)
+{
+  pthread_mutex_lock(&cache->lock);
+  CacheEntry *entry = *cache_find(cache, key);
+  if (entry != NULL && !entry->evicting)
+  {
+    if (cache_set(cache, entry, value) != 0)
+    {
+      entry->stale = 1;
+    }
+    else
+    {
+      entry->stale = 0;
+      entry->fetched_ms = now_ms();
+      entry->notified = entry->fetching;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
 
-const char *saved_server_pipe_path = NULL;
-const char *saved_req_pipe_path = NULL;
-const char *saved_resp_pipe_path = NULL;
-const char *saved_notif_pipe_path = NULL;
+static void cache_free(NearCache *cache)
+{
+  while (cache->oldest != NULL)
+  {
+    cache_remove(cache, cache->oldest);
+  }
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->settled);
+  free(cache);
+}
 
 // Helper function to safely delete existing pipes
 int remove_if_exists(char *pipe_path)
@@ -57,439 +301,1544 @@ int create_pipe(char *pipe_path)
 
 // Helper function to print message in console
 // Server returned <response-code> for operation: <connect|disconnect|subscribe|unsubscribe>
-int log_message(char op_code, char op_status)
+int log_message(int op_code, int op_status)
 {
   char *operation;
 
-  // OP_CODE=1 - CONNECT
-  // OP_CODE=2 - DISCONNECT
-  // OP_CODE=3 - SUBSCRIBE
-  // OP_CODE=4 - UNSUBSCRIBE
-
   switch (op_code)
   {
-  case '1':
+  case OP_CODE_CONNECT:
     operation = "CONNECT";
     break;
-  case '2':
+  case OP_CODE_DISCONNECT:
     operation = "DISCONNECT";
     break;
-  case '3':
+  case OP_CODE_SUBSCRIBE:
     operation = "SUBSCRIBE";
     break;
-  case '4':
+  case OP_CODE_UNSUBSCRIBE:
     operation = "UNSUBSCRIBE";
     break;
+  case OP_CODE_SUBSCRIBE_MANY:
+    operation = "SUBSCRIBE_MANY";
+    break;
+  case OP_CODE_UNSUBSCRIBE_MANY:
+    operation = "UNSUBSCRIBE_MANY";
+    break;
+  case OP_CODE_CHANGES:
+    operation = "CHANGES";
+    break;
+  case OP_CODE_SCAN:
+    operation = "SCAN";
+    break;
+  case OP_CODE_READ:
+    operation = "READ";
+    break;
+  case OP_CODE_WRITE:
+    operation = "WRITE";
+    break;
+  case OP_CODE_DELETE:
+    operation = "DELETE";
+    break;
   default:
-    printf("Raw response: '%c' - '%c'\n", op_code, op_status);
+    printf("Raw response: '%d' - '%d'\n", op_code, op_status);
     operation = "UNKNOWN";
     break;
   }
 
-  printf("Server returned %c for operation: %s\n", op_status, operation);
+  printf("Server returned %d for operation: %s\n", op_status, operation);
   return 0;
 }
 
-// *Helpers to handle client-server communication
-// Helper function to send requests to the server
-// Utility function for padding strings to MAX_STRING_SIZE
-// Safely pad a string to a fixed size, ensuring null termination
-// Safely pad a string to a fixed size, ensuring null termination
-void pad_string(char *dest, const char *src, size_t max_size)
+static KvsClient *client_new(void)
 {
-  if (!dest || !src || max_size == 0)
+  KvsClient *client = calloc(1, sizeof(KvsClient));
+  if (client == NULL)
   {
-    return;
+    perror("Failed to allocate session");
+    return NULL;
   }
+  client->req_fd = client->resp_fd = client->notif_fd = -1;
+  pthread_mutex_init(&client->send_lock, NULL);
+  pthread_mutex_init(&client->lock, NULL);
+  pthread_cond_init(&client->slot_free, NULL);
+  return client;
+}
 
-  size_t len = strlen(src);
-  if (len >= max_size)
+static void client_free(KvsClient *client)
+{
+  for (int i = 0; i < 3; i++)
   {
-    len = max_size - 1; // Leave room for null terminator
+    free(client->paths[i]);
   }
-
-  memcpy(dest, src, len);
-  memset(dest + len, ' ', max_size - len); // Pad with spaces instead of nulls
+  if (client->cache != NULL)
+  {
+    cache_free(client->cache);
+  }
+  frame_free(&client->request);
+  frame_free(&client->scratch);
+  pthread_mutex_destroy(&client->send_lock);
+  pthread_mutex_destroy(&client->lock);
+  pthread_cond_destroy(&client->slot_free);
+  free(client);
 }
 
-// Helper function to send requests to the server
-int send_request(int op_code, const char *key)
+// *Futures
+static KvsFuture *future_new(uint32_t request_id, int op_code, size_t num_keys)
 {
-  // Validate inputs
-  if (op_code < 0)
+  KvsFuture *future = calloc(1, sizeof(KvsFuture));
+  if (future == NULL)
   {
-    fprintf(stderr, "Invalid op_code: %d\n", op_code);
-    return 1;
+    perror("Failed to allocate request");
+    return NULL;
   }
+  future->request_id = request_id;
+  future->op_code = (uint8_t)op_code;
+  future->num_keys = num_keys;
+  pthread_mutex_init(&future->lock, NULL);
+  pthread_cond_init(&future->completed, NULL);
+  return future;
+}
 
-  if ((op_code == OP_CODE_SUBSCRIBE || op_code == OP_CODE_UNSUBSCRIBE) && !key)
+// Marks a future as done and runs its callback, if it has one yet
+static void future_finish(KvsFuture *future, int status)
+{
+  pthread_mutex_lock(&future->lock);
+  future->status = status;
+  future->done = 1;
+  KvsFutureCallback callback = future->callback;
+  void *arg = future->callback_arg;
+  pthread_cond_broadcast(&future->completed);
+  pthread_mutex_unlock(&future->lock);
+
+  // Past this point the future may belong to the callback
+  if (callback != NULL)
   {
-    fprintf(stderr, "Key required for subscribe/unsubscribe operations\n");
-    return 1;
+    callback(future, arg);
   }
+}
 
-  // Determine pipe path
-  const char *pipe_path = (op_code == OP_CODE_CONNECT)
-                              ? saved_server_pipe_path
-                              : saved_req_pipe_path;
-
-  // Prepare buffer
-  const size_t max_buffer_size = MAX_STRING_SIZE * 3 + 2;
-  char buffer[max_buffer_size];
-  memset(buffer, ' ', max_buffer_size); // Initialize with spaces
-
-  buffer[0] = '0' + op_code;
-  size_t offset = 1; // Start after op_code
-
-  // Build message based on operation type
-  switch (op_code)
+// Decodes the per-key results of a READ, DELETE, SUBSCRIBE_MANY or
+// UNSUBSCRIBE_MANY response, in place
+// @return 0 on success, 1 if the response is malformed
+static int decode_results(KvsFuture *future)
+{
+  int per_key = future->op_code == OP_CODE_READ || future->op_code == OP_CODE_DELETE ||
+                future->op_code == OP_CODE_SUBSCRIBE_MANY ||
+                future->op_code == OP_CODE_UNSUBSCRIBE_MANY;
+  if (!per_key)
   {
-  case OP_CODE_CONNECT:
-    pad_string(buffer + offset, saved_req_pipe_path, MAX_STRING_SIZE);
-    offset += MAX_STRING_SIZE;
-    pad_string(buffer + offset, saved_resp_pipe_path, MAX_STRING_SIZE);
-    offset += MAX_STRING_SIZE;
-    pad_string(buffer + offset, saved_notif_pipe_path, MAX_STRING_SIZE);
-    offset += MAX_STRING_SIZE;
-    break;
-
-  case OP_CODE_SUBSCRIBE:
-  case OP_CODE_UNSUBSCRIBE:
-    pad_string(buffer + offset, key, MAX_STRING_SIZE);
-    offset += MAX_STRING_SIZE;
-    break;
-
-  case OP_CODE_DISCONNECT:
-    break;
+    return 0;
+  }
 
-  default:
-    fprintf(stderr, "Unsupported op_code: %d\n", op_code);
+  uint64_t num_results;
+  if (frame_get_u64(&future->response, &num_results) != 0 || num_results != future->num_keys)
+  {
     return 1;
   }
 
-  // Check if pipe exists (if not is because server closed)
-  if (check_pipe_path(pipe_path) != 0)
+  if (future->op_code == OP_CODE_READ)
   {
-    fprintf(stderr, "Pipe not found (closed by server) : %s\n", pipe_path);
-    exit(1);
+    future->values = calloc(future->num_keys, sizeof(char *));
+    if (future->values == NULL && future->num_keys > 0)
+    {
+      return 1;
+    }
+    for (size_t i = 0; i < future->num_keys; i++)
+    {
+      uint64_t found;
+      const char *value;
+      if (frame_get_u64(&future->response, &found) != 0 ||
+          frame_get_string(&future->response, &value, NULL) != 0)
+      {
+        return 1;
+      }
+      future->values[i] = found ? value : NULL;
+    }
+    return 0;
   }
 
-  // Open and write to pipe
-  int pipe_fd = open(pipe_path, O_WRONLY);
-  if (pipe_fd == -1)
+  future->flags = calloc(future->num_keys, sizeof(int));
+  if (future->flags == NULL && future->num_keys > 0)
   {
-    perror("Failed to open pipe");
     return 1;
   }
-
-  ssize_t bytes_written = write(pipe_fd, buffer, offset);
-  int result = 0;
-
-  if (bytes_written < 0 || (size_t)bytes_written != offset)
+  for (size_t i = 0; i < future->num_keys; i++)
   {
-    perror("Failed to write complete request");
-    result = 1;
+    uint64_t result;
+    if (frame_get_u64(&future->response, &result) != 0)
+    {
+      return 1;
+    }
+    future->flags[i] = result != 0;
   }
-  else
+  return 0;
+}
+
+// Completes the future of a response, swapping buffers instead of copying
+// the payload
+static void deliver_response(KvsClient *client, Frame *frame)
+{
+  FrameHeader *header = frame_header(frame);
+  size_t slot = header->request_id % KVS_MAX_IN_FLIGHT;
+
+  pthread_mutex_lock(&client->lock);
+  KvsFuture *future = client->slots[slot];
+  if (future == NULL || future->request_id != header->request_id ||
+      future->op_code != header->op_code)
   {
-    // printf("Request sent to server\n");
-    // Print raw request with all characters (including spaces)
-    // printf("Raw request: '%s\n'", buffer);
+    pthread_mutex_unlock(&client->lock);
+    fprintf(stderr, "Unexpected response received\n");
+    return;
   }
+  client->slots[slot] = NULL;
+  pthread_cond_broadcast(&client->slot_free);
+  pthread_mutex_unlock(&client->lock);
 
-  close(pipe_fd);
+  Frame response = future->response;
+  future->response = *frame;
+  *frame = response;
 
-  return result;
+  int status = header->status != 0;
+  if (status == 0 && decode_results(future) != 0)
+  {
+    fprintf(stderr, "Invalid response received\n");
+    status = 1;
+  }
+  future_finish(future, status);
 }
 
-// Helper function to receive responses from the server
-// Server always return 2 characters response code (OP_CODE + OP_STATUS)
-int receive_response()
+// Fails every request in flight once the session is over
+static void connection_lost(KvsClient *client, const char *message)
 {
-  char res_op_code;
-  char res_op_status;
+  KvsFuture *lost[KVS_MAX_IN_FLIGHT];
+  size_t num_lost = 0;
 
-  if (check_pipe_path(saved_resp_pipe_path) != 0)
+  pthread_mutex_lock(&client->lock);
+  if (client->closed)
   {
-    fprintf(stderr, "Pipe not found (closed by server) : %s\n", saved_resp_pipe_path);
-    exit(1);
+    pthread_mutex_unlock(&client->lock);
+    return;
   }
-
-  // Open the receive server response to connection request
-  // printf("Open the receive server response to connection request\n");
-  int resp_pipe_fd = open(saved_resp_pipe_path, O_RDONLY);
-  if (resp_pipe_fd < 0)
+  client->closed = 1;
+  for (size_t i = 0; i < KVS_MAX_IN_FLIGHT; i++)
   {
-    perror("Failed to open response pipe");
-    return 1;
+    if (client->slots[i] != NULL)
+    {
+      lost[num_lost++] = client->slots[i];
+      client->slots[i] = NULL;
+    }
   }
+  pthread_cond_broadcast(&client->slot_free);
+  pthread_mutex_unlock(&client->lock);
 
-  // Response buffer for OP_CODE and OP_STATUS (2 characters + null terminator)
-  char response_buffer[3] = "";
-  ssize_t bytes_read = read(resp_pipe_fd, response_buffer, 2); // Expect 2 bytes
-  if (bytes_read < 0)
+  if (!atomic_load(&client->disconnecting))
   {
-    perror("Failed to read response");
-    close(resp_pipe_fd);
-    return 1;
+    fprintf(stderr, "%s\n", message);
+    if (client->exit_on_close)
+    {
+      exit(1);
+    }
   }
-  else if (bytes_read < 2)
+  for (size_t i = 0; i < num_lost; i++)
   {
-    fprintf(stderr, "Incomplete response received. Expected 2 bytes.\n");
-    close(resp_pipe_fd);
-    return 1;
+    future_finish(lost[i], 1);
   }
+}
 
-  close(resp_pipe_fd);
+int kvs_future_wait(KvsFuture *future)
+{
+  pthread_mutex_lock(&future->lock);
+  while (!future->done)
+  {
+    pthread_cond_wait(&future->completed, &future->lock);
+  }
+  int status = future->status;
+  pthread_mutex_unlock(&future->lock);
+  return status;
+}
 
-  // Null-terminate the response to ensure safety
-  response_buffer[2] = '\0';
+void kvs_future_then(KvsFuture *future, KvsFutureCallback callback, void *arg)
+{
+  pthread_mutex_lock(&future->lock);
+  int done = future->done;
+  future->callback = callback;
+  future->callback_arg = arg;
+  pthread_mutex_unlock(&future->lock);
 
-  // Check the response from the server
-  // printf("Check the response from the server\n");
-  // printf("Raw response: %s\n", response_buffer);
+  if (done)
+  {
+    callback(future, arg);
+  }
+}
 
-  // First character is OP_CODE
-  res_op_code = response_buffer[0];
-  // Second character is OP_STATUS
-  res_op_status = response_buffer[1];
+const char *kvs_future_value(KvsFuture *future, size_t index)
+{
+  return future->values != NULL && index < future->num_keys ? future->values[index] : NULL;
+}
 
-  // printf("OP_CODE: %c\n", res_op_code);
-  // printf("OP_STATUS: %c\n", res_op_status);
+int kvs_future_flag(KvsFuture *future, size_t index)
+{
+  return future->flags != NULL && index < future->num_keys ? future->flags[index] : 0;
+}
 
-  // Log the response
-  if (log_message(res_op_code, res_op_status) != 0)
+void kvs_future_free(KvsFuture *future)
+{
+  if (future == NULL)
   {
-    perror("Failed to log server response message");
-    return 1;
+    return;
   }
-
-  return 0;
+  frame_free(&future->response);
+  free(future->values);
+  free(future->flags);
+  pthread_mutex_destroy(&future->lock);
+  pthread_cond_destroy(&future->completed);
+  free(future);
 }
 
-void trim_char(char *str)
+// *Helpers to handle client-server communication
+// Waits until a ring holds a frame: spins for a while, then sleeps on it,
+// waking up now and then to notice a server that died
+// @return 1 once there is a frame, 0 if the session was closed
+static int wait_ring(KvsClient *client, Ring *ring)
 {
-  size_t str_value = strlen(str);
-  while (str_value > 0 && str[str_value - 1] == ' ')
+  while (ring_empty(ring) && !ring_spin(ring))
   {
-    str_value--;
-    str[str_value] = '\0';
+    struct pollfd server = {client->req_fd, 0, 0};
+    if (atomic_load(&client->shm->closed) || poll(&server, 1, 0) != 0)
+    {
+      return 0;
+    }
+    if (ring_prepare_sleep(ring))
+    {
+      ring_sleep(ring, 100);
+    }
   }
+  return 1;
 }
 
-// Thread function to handle with notifications from the server
-void parse_notification(char *message, char *key, char *value)
+// Same as frame_recv, for a ring: 0 means the session was closed. A server
+// that found the ring full waits for room: a session worker parks the session
+// until its socket rings, a notification dispatcher sleeps on the ring
+static int ring_receive(KvsClient *client, Ring *ring, Frame *frame)
 {
+  int result = wait_ring(client, ring) ? ring_get(ring, frame) : 0;
+  if (result == 1 && ring_room_needed(ring))
+  {
+    if (ring == &client->shm->responses)
+    {
+      return write(client->req_fd, "", 1) == 1 ? 1 : 0;
+    }
+    ring_wake_room(ring);
+  }
+  return result;
+}
 
-  // Debug message
-  // printf("Raw message received: '%s'\n", message);
-
-  // Copia os 40 primeiros caracteres para a chave.
-  strncpy(key, message, MAX_STRING_SIZE);
-  key[MAX_STRING_SIZE] = '\0'; // Garante a terminação.
-
-  // Trim key
-  trim_char(key);
+// Thread function to read responses from the response pipe, or ring
+static void *response_handler(void *arg)
+{
+  KvsClient *client = arg;
 
-  // Copia os próximos 40 caracteres para o valor.
-  strncpy(value, message + MAX_STRING_SIZE, MAX_STRING_SIZE);
-  value[MAX_STRING_SIZE] = '\0'; // Garante a terminação.
+  while (1)
+  {
+    int result = client->shm == NULL
+                     ? frame_recv(client->resp_fd, &client->scratch, NULL)
+                     : ring_receive(client, &client->shm->responses, &client->scratch);
+    if (result != 1)
+    {
+      connection_lost(client, result == 0 ? "Response pipe closed by server"
+                                          : "Failed to read response");
+      return NULL;
+    }
 
-  // Trim value
-  trim_char(value);
+    deliver_response(client, &client->scratch);
+  }
 }
 
-void *notification_handler(void *arg)
+// Thread function to handle with notifications from the server, and over a
+// socket with every response too
+static void *notification_handler(void *arg)
 {
+  KvsClient *client = arg;
+  Frame notification = {0};
+
   while (1)
   {
-    char buffer[2 * (MAX_STRING_SIZE + 1)] = {0};
+    int result = client->shm == NULL
+                     ? frame_recv(client->notif_fd, &notification, NULL)
+                     : ring_receive(client, &client->shm->notifications, &notification);
+    if (result != 1)
+    {
+      frame_free(&notification);
+      // EOF: O servidor fechou o pipe. Once DISCONNECT is sent, its response
+      // may still be on the way through the response pipe
+      if (client->socket || !atomic_load(&client->disconnecting))
+      {
+        connection_lost(client, result == 0 ? "Notification pipe closed by server"
+                                            : "Failed to read from notification pipe");
+      }
+      return NULL;
+    }
 
-    if (check_pipe_path(saved_notif_pipe_path) != 0)
+    if (frame_header(&notification)->op_code != OP_CODE_NOTIFY && client->socket)
     {
-      fprintf(stderr, "Pipe not found (closed by server) : %s\n", saved_notif_pipe_path);
-      exit(1);
+      deliver_response(client, &notification);
+      continue;
     }
 
-    // printf("Waiting for notification...\n");
-    int notif_pipe_fd = open(saved_notif_pipe_path, O_RDONLY);
-    if (notif_pipe_fd == -1)
+    // Separa chave e valor: a frame carries every change that was pending
+    uint64_t count;
+    if (frame_header(&notification)->op_code != OP_CODE_NOTIFY ||
+        frame_get_u64(&notification, &count) != 0)
     {
-      perror("Failed to open notification pipe");
-      return NULL;
+      fprintf(stderr, "Invalid notification received\n");
+      continue;
     }
 
-    ssize_t bytes_read = read(notif_pipe_fd, buffer, sizeof(buffer) - 1);
-    if (bytes_read <= 0)
+    pthread_mutex_lock(&client->lock);
+    KvsNotifyCallback on_notify = client->on_notify;
+    void *notify_arg = client->notify_arg;
+    NearCache *cache = client->cache;
+    pthread_mutex_unlock(&client->lock);
+
+    for (uint64_t i = 0; i < count; i++)
     {
-      if (bytes_read == 0)
+      uint64_t deleted;
+      const char *key;
+      const char *value;
+      if (frame_get_u64(&notification, &deleted) != 0 ||
+          frame_get_string(&notification, &key, NULL) != 0 ||
+          frame_get_string(&notification, &value, NULL) != 0)
       {
-        // EOF: O servidor fechou o pipe.
-        perror("Notification pipe closed by server.\n");
+        fprintf(stderr, "Invalid notification received\n");
+        break;
       }
-      else
+      if (deleted)
       {
-        perror("Failed to read from notification pipe");
+        value = NULL;
       }
-      close(notif_pipe_fd);
-      return NULL;
-    }
-
-    // Garante que o buffer seja sempre terminado.
-    buffer[bytes_read] = '\0';
 
-    // Separa chave e valor.
-    char key[MAX_STRING_SIZE + 1] = {0};
-    char value[MAX_STRING_SIZE + 1] = {0};
-    parse_notification(buffer, key, value);
-
-    // Exibe a notificação formatada.
-    // printf("\n------- NOTIFICATION -------\n");
-    // printf("Key: '%s'\n", key);
-    // printf("Value: '%s'\n", value);
-    // printf("---------------------------\n\n");
-
-    // <chave>,<valor>)
-    printf("(%s,%s)\n", key, value);
-
-    close(notif_pipe_fd);
+      if (cache != NULL)
+      {
+        cache_notify(cache, key, value);
+      }
+      if (on_notify != NULL)
+      {
+        on_notify(key, value, notify_arg);
+      }
+    }
   }
-
-  return NULL;
 }
 
-int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path, char const *notif_pipe_path, char const *server_pipe_path)
+// Writes a request to the request ring and rings the server's socket if it
+// sleeps. While the ring is full, it sleeps until the server takes a request
+// out, and the response thread keeps draining the responses the server may
+// be waiting on
+static int send_ring_request(KvsClient *client, Frame *request)
 {
-  // create pipes and connect
-  // printf("Connecting to server\n");
-
-  // check if pipes already exist
-  // printf("Check if pipes already exist\n");
-  if (remove_if_exists(req_pipe_path) != 0 || remove_if_exists(resp_pipe_path) != 0 || remove_if_exists(notif_pipe_path) != 0)
+  int result;
+  while ((result = ring_put_or_wait(&client->shm->requests, request)) == 1)
   {
-    return 1;
+    if (atomic_load(&client->shm->closed))
+    {
+      return 1;
+    }
+    ring_wait_room(&client->shm->requests, 100);
   }
 
-  // open pipes using mkfifo
-  // printf("Create pipes using mkfifo\n");
-  if (create_pipe(req_pipe_path) != 0 || create_pipe(resp_pipe_path) != 0 || create_pipe(notif_pipe_path) != 0)
+  if (result != 0 ||
+      (ring_wake_needed(&client->shm->requests) && write(client->req_fd, "", 1) != 1))
   {
     return 1;
   }
+  return 0;
+}
 
-  // printf("Save file paths\n");
-  saved_server_pipe_path = server_pipe_path;
-  saved_req_pipe_path = req_pipe_path;
-  saved_resp_pipe_path = resp_pipe_path;
-  saved_notif_pipe_path = notif_pipe_path;
+// Starts encoding a request in client->request, taking the send lock and
+// waiting for the slot of its id to be free
+// @return The future of the request, NULL if it could not be started
+static KvsFuture *start_request(KvsClient *client, int op_code, size_t num_keys)
+{
+  pthread_mutex_lock(&client->send_lock);
+  uint32_t request_id = client->last_request_id + 1;
 
-  // Send connection request to server by server pipe (already initialized)
-  // printf("Send connection request to server by server pipe\n");
-  if (send_request(OP_CODE_CONNECT, NULL) != 0)
+  pthread_mutex_lock(&client->lock);
+  while (client->slots[request_id % KVS_MAX_IN_FLIGHT] != NULL && !client->closed)
   {
-    perror("Failed to send connection request");
-    return 1;
+    pthread_cond_wait(&client->slot_free, &client->lock);
   }
+  int closed = client->closed;
+  pthread_mutex_unlock(&client->lock);
 
-  if (receive_response() != 0)
+  KvsFuture *future = closed ? NULL : future_new(request_id, op_code, num_keys);
+  if (future == NULL || frame_init(&client->request, (uint8_t)op_code, request_id) != 0)
   {
-    perror("Failed to receive response");
-    return 1;
+    fprintf(stderr, closed ? "Session is closed\n" : "Failed to allocate request\n");
+    kvs_future_free(future);
+    pthread_mutex_unlock(&client->send_lock);
+    return NULL;
   }
+  client->last_request_id = request_id;
+  return future;
+}
 
-  // Open the notification pipe for reading
-  // printf("Open the notification pipe for reading\n");
-  pthread_t *notification_thread;
-  if (pthread_create(&notification_thread, NULL, notification_handler, NULL) != 0)
+// Sends the request started by start_request and releases the send lock. The
+// future is put in its slot first, as over a socket its response may be read
+// right away
+// @param encoded 0 if the request could not be encoded
+// @return The future, failed if the request could not be sent, or NULL if it
+// could not be encoded
+static KvsFuture *send_request(KvsClient *client, KvsFuture *future, int encoded)
+{
+  if (!encoded)
   {
-    perror("Failed to create notification thread");
-    return 1;
+    fprintf(stderr, "Request too large\n");
+    pthread_mutex_unlock(&client->send_lock);
+    kvs_future_free(future);
+    return NULL;
   }
 
-  // printf("Pipes defined successfully\n");
-  return 0;
-}
-
-int kvs_disconnect()
-{
+  size_t slot = future->request_id % KVS_MAX_IN_FLIGHT;
+  pthread_mutex_lock(&client->lock);
+  client->slots[slot] = future;
+  pthread_mutex_unlock(&client->lock);
 
-  if (send_request(OP_CODE_DISCONNECT, NULL) != 0)
+  int result = client->shm != NULL ? send_ring_request(client, &client->request)
+                                   : frame_send(client->req_fd, &client->request);
+  pthread_mutex_unlock(&client->send_lock);
+  if (result == 0)
   {
-    perror("Failed to send disconnect request");
-    return 1;
+    return future;
   }
 
-  // Check the server's response
-  // printf("Check the response from the server\n");
-  if (receive_response() != 0)
+  // Unless the session was lost meanwhile, which failed the future already
+  pthread_mutex_lock(&client->lock);
+  int in_flight = client->slots[slot] == future;
+  if (in_flight)
   {
-    perror("Failed to receive response");
-    return 1;
+    client->slots[slot] = NULL;
+    pthread_cond_broadcast(&client->slot_free);
   }
+  pthread_mutex_unlock(&client->lock);
+  if (in_flight)
+  {
+    fprintf(stderr, "Request pipe closed by server\n");
+    future_finish(future, 1);
+  }
+  return future;
+}
 
-  // Unlink (delete) the client's named pipes
-  // printf("Deleting client named pipes\n");
-  if (unlink(saved_req_pipe_path) < 0)
+// Sends a request with a list of keys, and values if not NULL
+static KvsFuture *send_keys_request(KvsClient *client, int op_code, size_t num_keys,
+                                    const char *const keys[], const char *const values[])
+{
+  if (num_keys > MAX_SESSION_KEYS)
   {
-    perror("Failed to delete request pipe");
-    return 1;
+    fprintf(stderr, "Too many keys in request\n");
+    return NULL;
   }
 
-  if (unlink(saved_resp_pipe_path) < 0)
+  KvsFuture *future = start_request(client, op_code, num_keys);
+  if (future == NULL)
   {
-    perror("Failed to delete response pipe");
-    return 1;
+    return NULL;
+  }
+  int encoded = frame_put_u64(&client->request, num_keys) == 0;
+  for (size_t i = 0; i < num_keys && encoded; i++)
+  {
+    encoded = frame_put_string(&client->request, keys[i], strlen(keys[i])) == 0 &&
+              (values == NULL ||
+               frame_put_string(&client->request, values[i], strlen(values[i])) == 0);
   }
+  return send_request(client, future, encoded);
+}
 
-  if (unlink(saved_notif_pipe_path) < 0)
+// *Sessions
+// Opens the session's pipes once, right after CONNECT, in the same order as
+// the server opens its ends; they stay open until the session ends
+static int open_pipes(KvsClient *client)
+{
+  client->req_fd = open(client->paths[0], O_WRONLY);
+  client->resp_fd = client->req_fd == -1 ? -1 : open(client->paths[1], O_RDONLY);
+  client->notif_fd = client->resp_fd == -1 ? -1 : open(client->paths[2], O_RDONLY);
+  if (client->notif_fd == -1)
   {
-    perror("Failed to delete notification pipe");
+    perror("Failed to open pipes");
     return 1;
   }
 
-  // Reset saved paths
-  saved_req_pipe_path = NULL;
-  saved_resp_pipe_path = NULL;
-  saved_notif_pipe_path = NULL;
-
-  // printf("Successfully disconnected and cleaned up\n");
   return 0;
 }
 
-int kvs_subscribe(const char *key)
+// Closes the session's pipes, removes its FIFOs and unmaps its rings
+static void close_session(KvsClient *client)
 {
-  if (send_request(OP_CODE_SUBSCRIBE, key) != 0)
+  if (client->req_fd != -1)
   {
-    perror("Failed to send connection request");
-    return 1;
+    close(client->req_fd);
+  }
+  if (!client->socket && client->shm == NULL)
+  {
+    if (client->resp_fd != -1)
+    {
+      close(client->resp_fd);
+    }
+    if (client->notif_fd != -1)
+    {
+      close(client->notif_fd);
+    }
   }
+  client->req_fd = client->resp_fd = client->notif_fd = -1;
 
-  if (receive_response() != 0)
+  // Unless the server already did
+  for (int i = 0; i < 3; i++)
   {
-    perror("Failed to receive response");
-    return 1;
+    if (client->paths[i] != NULL && unlink(client->paths[i]) < 0 && errno != ENOENT)
+    {
+      perror("Failed to delete pipe");
+    }
   }
 
-  return 0;
+  if (client->shm != NULL)
+  {
+    munmap(client->shm, sizeof(RingSession));
+    client->shm = NULL;
+  }
 }
 
-int kvs_unsubscribe(const char *key)
+// Reads the response to CONNECT, before the receiver threads are started
+// @return The status of the response, -1 if none was received
+static int receive_connect_response(KvsClient *client, int fd)
 {
-  if (send_request(OP_CODE_UNSUBSCRIBE, key) != 0)
+  if (frame_recv(fd, &client->scratch, NULL) != 1 ||
+      frame_header(&client->scratch)->op_code != OP_CODE_CONNECT)
   {
-    perror("Failed to send connection request");
-    return 1;
-  };
-
-  if (receive_response() != 0)
-  {
-    perror("Failed to receive response");
-    return 1;
+    return -1;
   }
+  return frame_header(&client->scratch)->status;
+}
 
+// Creates the session's FIFOs and asks the server for a session through its
+// pipe
+// @return Same as receive_connect_response
+static int connect_pipes(KvsClient *client, char const *req_pipe_path, char const *resp_pipe_path,
+                         char const *notif_pipe_path, char const *server_pipe_path)
+{
+  // check if pipes already exist
+  if (remove_if_exists((char *)req_pipe_path) != 0 || remove_if_exists((char *)resp_pipe_path) != 0 ||
+      remove_if_exists((char *)notif_pipe_path) != 0)
+  {
+    return -1;
+  }
+
+  // open pipes using mkfifo
+  if (create_pipe((char *)req_pipe_path) != 0 || create_pipe((char *)resp_pipe_path) != 0 ||
+      create_pipe((char *)notif_pipe_path) != 0)
+  {
+    return -1;
+  }
+
+  if ((client->paths[0] = strdup(req_pipe_path)) == NULL ||
+      (client->paths[1] = strdup(resp_pipe_path)) == NULL ||
+      (client->paths[2] = strdup(notif_pipe_path)) == NULL ||
+      frame_init(&client->request, OP_CODE_CONNECT, ++client->last_request_id) != 0 ||
+      frame_put_string(&client->request, req_pipe_path, strlen(req_pipe_path)) != 0 ||
+      frame_put_string(&client->request, resp_pipe_path, strlen(resp_pipe_path)) != 0 ||
+      frame_put_string(&client->request, notif_pipe_path, strlen(notif_pipe_path)) != 0)
+  {
+    perror("Failed to send connection request");
+    return -1;
+  }
+
+  // Check if pipe exists (if not is because server closed)
+  if (check_pipe_path((char *)server_pipe_path) != 0)
+  {
+    fprintf(stderr, "Pipe not found (closed by server) : %s\n", server_pipe_path);
+    return -1;
+  }
+
+  // A CONNECT fits in PIPE_BUF, so it is not interleaved with other clients'
+  int pipe_fd = open(server_pipe_path, O_WRONLY);
+  if (pipe_fd == -1)
+  {
+    perror("Failed to open pipe");
+    return -1;
+  }
+  int result = frame_send(pipe_fd, &client->request);
+  close(pipe_fd);
+  if (result != 0)
+  {
+    perror("Failed to write complete request");
+    return -1;
+  }
+
+  if (open_pipes(client) != 0)
+  {
+    return -1;
+  }
+  return receive_connect_response(client, client->resp_fd);
+}
+
+// Connects to the server's socket
+static int open_server_socket(char const *server_socket_path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(server_socket_path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", server_socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, server_socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    perror("Failed to connect to server socket");
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// The server closes the connection if it has no session for the client
+// @return Same as receive_connect_response
+static int connect_socket(KvsClient *client, char const *server_socket_path)
+{
+  int fd = open_server_socket(server_socket_path);
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  client->socket = 1;
+  client->req_fd = client->resp_fd = client->notif_fd = fd;
+  if (frame_init(&client->request, OP_CODE_CONNECT, ++client->last_request_id) != 0 ||
+      frame_send(fd, &client->request) != 0)
+  {
+    return -1;
+  }
+  return receive_connect_response(client, fd);
+}
+
+// Moves the session to rings in shared memory, named after the process and
+// the session and unlinked once the server has mapped them
+// @return Same as receive_connect_response
+static int connect_shm(KvsClient *client, char const *server_socket_path)
+{
+  static atomic_uint sessions = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/kvs_%ld_%u", (long)getpid(), atomic_fetch_add(&sessions, 1));
+  int shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm_fd == -1)
+  {
+    perror("Failed to create shared memory");
+    return -1;
+  }
+  void *region = MAP_FAILED;
+  if (ftruncate(shm_fd, sizeof(RingSession)) == 0)
+  {
+    region = mmap(NULL, sizeof(RingSession), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  }
+  close(shm_fd);
+
+  int fd = region == MAP_FAILED ? -1 : open_server_socket(server_socket_path);
+  if (fd == -1)
+  {
+    perror("Failed to set up shared memory session");
+    shm_unlink(name);
+    if (region != MAP_FAILED)
+    {
+      munmap(region, sizeof(RingSession));
+    }
+    return -1;
+  }
+  client->shm = region;
+  client->req_fd = fd;
+
+  // The server sleeps until the first request rings its socket
+  atomic_store(&client->shm->requests.waiting, 1);
+
+  // CONNECT and its response go through the socket, before the rings are used
+  int status = -1;
+  if (frame_init(&client->request, OP_CODE_CONNECT, ++client->last_request_id) == 0 &&
+      frame_put_string(&client->request, name, strlen(name)) == 0 &&
+      frame_send(fd, &client->request) == 0)
+  {
+    status = receive_connect_response(client, fd);
+  }
+  shm_unlink(name);
+  return status;
+}
+
+// Starts the receiver threads of an accepted session, or cleans up after a
+// refused one
+// @param status Result of the connect_* function.
+// @return 0 if the session is established, 1 otherwise.
+static int establish_session(KvsClient *client, int status)
+{
+  if (status == 0)
+  {
+    // Requests are written whole, with blocking writes: responses are read
+    // meanwhile by their own thread, so the server is never blocked on them
+    if (pthread_create(&client->notification_thread, NULL, notification_handler, client) != 0)
+    {
+      perror("Failed to create notification thread");
+      status = -1;
+    }
+    else if (!client->socket &&
+             pthread_create(&client->response_thread, NULL, response_handler, client) != 0)
+    {
+      // The session is up: the server cleans it up once the client is gone
+      perror("Failed to create response thread");
+      exit(1);
+    }
+    client->response_thread_started = !client->socket && status == 0;
+  }
+
+  // Refused, e.g. because the server is at its session limit
+  if (status != 0)
+  {
+    close_session(client);
+    return 1;
+  }
+  return 0;
+}
+
+// Ends a session and frees it, once the server answered DISCONNECT
+static int end_session(KvsClient *client, int log)
+{
+  atomic_store(&client->disconnecting, 1);
+  KvsFuture *future = start_request(client, OP_CODE_DISCONNECT, 0);
+  if (future == NULL || (future = send_request(client, future, 1)) == NULL)
+  {
+    perror("Failed to send disconnect request");
+    return 1;
+  }
+
+  // Check the server's response
+  int failed = kvs_future_wait(future);
+  if (log && future->response.data != NULL)
+  {
+    log_message(OP_CODE_DISCONNECT, frame_header(&future->response)->status);
+  }
+  kvs_future_free(future);
+  if (failed)
+  {
+    perror("Failed to receive response");
+    return 1;
+  }
+
+  // The server closes the session's pipes once it ends the session
+  pthread_join(client->notification_thread, NULL);
+  if (client->response_thread_started)
+  {
+    pthread_join(client->response_thread, NULL);
+  }
+  close_session(client);
+  client_free(client);
   return 0;
 }
 
+KvsClient *kvs_client_connect(char const *req_pipe_path, char const *resp_pipe_path,
+                              char const *notif_pipe_path, char const *server_pipe_path)
+{
+  KvsClient *client = client_new();
+  if (client == NULL ||
+      establish_session(client, connect_pipes(client, req_pipe_path, resp_pipe_path,
+                                              notif_pipe_path, server_pipe_path)) != 0)
+  {
+    if (client != NULL)
+    {
+      client_free(client);
+    }
+    return NULL;
+  }
+  return client;
+}
+
+KvsClient *kvs_client_connect_socket(char const *server_socket_path)
+{
+  KvsClient *client = client_new();
+  if (client == NULL ||
+      establish_session(client, connect_socket(client, server_socket_path)) != 0)
+  {
+    if (client != NULL)
+    {
+      client_free(client);
+    }
+    return NULL;
+  }
+  return client;
+}
+
+KvsClient *kvs_client_connect_shm(char const *server_socket_path)
+{
+  KvsClient *client = client_new();
+  if (client == NULL || establish_session(client, connect_shm(client, server_socket_path)) != 0)
+  {
+    if (client != NULL)
+    {
+      client_free(client);
+    }
+    return NULL;
+  }
+  return client;
+}
+
+int kvs_client_disconnect(KvsClient *client)
+{
+  return end_session(client, 0);
+}
+
+void kvs_client_on_notify(KvsClient *client, KvsNotifyCallback callback, void *arg)
+{
+  pthread_mutex_lock(&client->lock);
+  client->on_notify = callback;
+  client->notify_arg = arg;
+  pthread_mutex_unlock(&client->lock);
+}
+
+// *Requests of a session
+KvsFuture *kvs_client_read_async(KvsClient *client, size_t num_keys, const char *const keys[])
+{
+  return send_keys_request(client, OP_CODE_READ, num_keys, keys, NULL);
+}
+
+KvsFuture *kvs_client_write_async(KvsClient *client, size_t num_pairs, const char *const keys[],
+                                  const char *const values[])
+{
+  return send_keys_request(client, OP_CODE_WRITE, num_pairs, keys, values);
+}
+
+KvsFuture *kvs_client_delete_async(KvsClient *client, size_t num_keys, const char *const keys[])
+{
+  return send_keys_request(client, OP_CODE_DELETE, num_keys, keys, NULL);
+}
+
+KvsFuture *kvs_client_subscribe_async(KvsClient *client, size_t num_keys, const char *const keys[])
+{
+  return send_keys_request(client, OP_CODE_SUBSCRIBE_MANY, num_keys, keys, NULL);
+}
+
+KvsFuture *kvs_client_unsubscribe_async(KvsClient *client, size_t num_keys,
+                                        const char *const keys[])
+{
+  return send_keys_request(client, OP_CODE_UNSUBSCRIBE_MANY, num_keys, keys, NULL);
+}
+
+// Waits for a request and copies out its per-key results, then frees it
+// @param values Set to copies of the values of a READ (may be NULL).
+// @param flags Set to the flags of the other requests (may be NULL).
+// @return 0 if the request succeeded, 1 otherwise
+static int collect(KvsFuture *future, const char *operation, char *values[], int flags[])
+{
+  if (future == NULL)
+  {
+    return 1;
+  }
+  if (kvs_future_wait(future) != 0)
+  {
+    fprintf(stderr, "Invalid %s response received.\n", operation);
+    kvs_future_free(future);
+    return 1;
+  }
+
+  for (size_t i = 0; i < future->num_keys; i++)
+  {
+    if (values != NULL)
+    {
+      const char *value = kvs_future_value(future, i);
+      values[i] = value != NULL ? strdup(value) : NULL;
+    }
+    if (flags != NULL)
+    {
+      flags[i] = kvs_future_flag(future, i);
+    }
+  }
+  kvs_future_free(future);
+  return 0;
+}
+
+int kvs_client_read(KvsClient *client, size_t num_keys, const char *const keys[], char *values[])
+{
+  return collect(kvs_client_read_async(client, num_keys, keys), "read", values, NULL);
+}
+
+int kvs_client_write(KvsClient *client, size_t num_pairs, const char *const keys[],
+                     const char *const values[])
+{
+  return collect(kvs_client_write_async(client, num_pairs, keys, values), "write", NULL, NULL);
+}
+
+int kvs_client_delete(KvsClient *client, size_t num_keys, const char *const keys[], int deleted[])
+{
+  return collect(kvs_client_delete_async(client, num_keys, keys), "delete", NULL, deleted);
+}
+
+int kvs_client_subscribe(KvsClient *client, size_t num_keys, const char *const keys[],
+                         int failed[])
+{
+  return collect(kvs_client_subscribe_async(client, num_keys, keys), "subscription", NULL, failed);
+}
+
+int kvs_client_unsubscribe(KvsClient *client, size_t num_keys, const char *const keys[],
+                           int failed[])
+{
+  return collect(kvs_client_unsubscribe_async(client, num_keys, keys), "subscription", NULL,
+                 failed);
+}
+
+// *Near cache of a session
+int kvs_client_enable_cache(KvsClient *client, size_t max_entries, size_t max_bytes,
+                            unsigned int max_age_ms)
+{
+  if (client->cache != NULL || max_entries == 0)
+  {
+    fprintf(stderr, "Invalid cache configuration\n");
+    return 1;
+  }
+
+  NearCache *cache = calloc(1, sizeof(NearCache));
+  size_t num_buckets = 1;
+  while (num_buckets < max_entries && num_buckets < CACHE_MAX_BUCKETS)
+  {
+    num_buckets *= 2;
+  }
+  if (cache == NULL || (cache->buckets = calloc(num_buckets, sizeof(CacheEntry *))) == NULL)
+  {
+    perror("Failed to allocate cache");
+    free(cache);
+    return 1;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->settled, NULL);
+  cache->num_buckets = num_buckets;
+  cache->max_entries = max_entries;
+  cache->max_bytes = max_bytes > 0 ? max_bytes : SIZE_MAX;
+  cache->max_age_ms = max_age_ms;
+
+  pthread_mutex_lock(&client->lock);
+  client->cache = cache;
+  pthread_mutex_unlock(&client->lock);
+  return 0;
+}
+
+static void free_future(KvsFuture *future, void *arg)
+{
+  (void)arg;
+  kvs_future_free(future);
+}
+
+// Unsubscribes from the keys of entries marked for eviction, without waiting
+// for the response, then removes the entries. A kvs_client_get of one of the
+// keys waits meanwhile, so its SUBSCRIBE is sent after the UNSUBSCRIBE
+static void cache_unsubscribe(KvsClient *client, CacheEntry *evicted[], size_t count)
+{
+  NearCache *cache = client->cache;
+  const char *keys[MAX_SESSION_KEYS];
+  for (size_t i = 0; i < count; i++)
+  {
+    keys[i] = evicted[i]->key;
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+  KvsFuture *future = kvs_client_unsubscribe_async(client, count, keys);
+  if (future != NULL)
+  {
+    kvs_future_then(future, free_future, NULL);
+  }
+  pthread_mutex_lock(&cache->lock);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    cache_remove(cache, evicted[i]);
+  }
+  pthread_cond_broadcast(&cache->settled);
+}
+
+// @return 1 if a cached value can be returned without reading it again
+static int cache_fresh(NearCache *cache, CacheEntry *entry)
+{
+  return !entry->stale &&
+         (cache->max_age_ms == 0 || now_ms() - entry->fetched_ms < cache->max_age_ms);
+}
+
+int kvs_client_get(KvsClient *client, const char *key, char **value)
+{
+  // Prefix patterns are not keys: they are read through
+  NearCache *cache = client->cache;
+  size_t len = strlen(key);
+  if (cache == NULL || (len > 0 && key[len - 1] == '*'))
+  {
+    return kvs_client_read(client, 1, &key, value);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  CacheEntry *entry;
+  while ((entry = *cache_find(cache, key)) != NULL && (entry->fetching || entry->evicting))
+  {
+    pthread_cond_wait(&cache->settled, &cache->lock);
+  }
+
+  if (entry != NULL && cache_fresh(cache, entry))
+  {
+    cache_touch(cache, entry);
+    *value = entry->value != NULL ? strdup(entry->value) : NULL;
+    int failed = entry->value != NULL && *value == NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return failed;
+  }
+
+  // A new entry is subscribed before it is read: the server handles the
+  // session's requests in order, so every change after the READ is notified
+  int subscribe = entry == NULL;
+  if (subscribe && (entry = cache_add(cache, key)) == NULL)
+  {
+    pthread_mutex_unlock(&cache->lock);
+    return kvs_client_read(client, 1, &key, value);
+  }
+  entry->fetching = 1;
+  entry->notified = 0;
+  pthread_mutex_unlock(&cache->lock);
+
+  KvsFuture *subscription = subscribe ? kvs_client_subscribe_async(client, 1, &key) : NULL;
+  KvsFuture *read = kvs_client_read_async(client, 1, &key);
+  int subscribed = !subscribe || (subscription != NULL && kvs_future_wait(subscription) == 0 &&
+                                  kvs_future_flag(subscription, 0) == 0);
+  int failed = read == NULL || kvs_future_wait(read) != 0;
+  kvs_future_free(subscription);
+
+  pthread_mutex_lock(&cache->lock);
+  entry->fetching = 0;
+
+  // Unless a notification brought a newer value while the READ was in flight
+  if (!failed && subscribed && !entry->notified)
+  {
+    failed = cache_set(cache, entry, kvs_future_value(read, 0)) != 0;
+  }
+  if (!failed && subscribed)
+  {
+    entry->stale = 0;
+    entry->fetched_ms = now_ms();
+    *value = entry->value != NULL ? strdup(entry->value) : NULL;
+    failed = entry->value != NULL && *value == NULL;
+  }
+  else if (!failed)
+  {
+    // Not subscribed, so the value cannot be kept
+    const char *read_value = kvs_future_value(read, 0);
+    *value = read_value != NULL ? strdup(read_value) : NULL;
+    failed = read_value != NULL && *value == NULL;
+  }
+  kvs_future_free(read);
+
+  CacheEntry *evicted[MAX_SESSION_KEYS];
+  size_t count;
+  if (!subscribed || (failed && subscribe))
+  {
+    cache_release(cache, entry);
+    if (subscribed)
+    {
+      entry->evicting = 1;
+      cache_unsubscribe(client, &entry, 1);
+    }
+    else
+    {
+      cache_remove(cache, entry);
+      pthread_cond_broadcast(&cache->settled);
+    }
+  }
+  else
+  {
+    pthread_cond_broadcast(&cache->settled);
+  }
+  while ((count = cache_evict(cache, evicted, MAX_SESSION_KEYS)) > 0)
+  {
+    cache_unsubscribe(client, evicted, count);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return failed;
+}
+
+// *The process's default session
+static KvsClient *session = NULL;
+
+// Requests sent with the kvs_*_send functions, until they are received
+static KvsFuture *sent[KVS_MAX_IN_FLIGHT];
+
+// <chave>,<valor>)
+static void print_notification(const char *key, const char *value, void *arg)
+{
+  (void)arg;
+  printf("(%s,%s)\n", key, value == NULL ? "DELETED" : value);
+}
+
+// Logs the outcome of a request of the default session, as the requests
+// that manage it always did
+// @return 0 if a response was received, 1 otherwise
+static int log_response(KvsFuture *future)
+{
+  if (future == NULL)
+  {
+    return 1;
+  }
+  kvs_future_wait(future);
+  if (future->response.data == NULL)
+  {
+    return 1;
+  }
+  FrameHeader *header = frame_header(&future->response);
+  log_message(header->op_code, header->status);
+  return 0;
+}
+
+// Makes a client the default session, or frees it if it was refused
+static int use_session(KvsClient *client, int status)
+{
+  if (status >= 0)
+  {
+    log_message(OP_CODE_CONNECT, status);
+  }
+  if (establish_session(client, status) != 0)
+  {
+    client_free(client);
+    return 1;
+  }
+
+  session = client;
+  session->exit_on_close = 1;
+  kvs_client_on_notify(session, print_notification, NULL);
+  return 0;
+}
+
+int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path, char const *notif_pipe_path, char const *server_pipe_path)
+{
+  KvsClient *client = client_new();
+  return client == NULL ||
+         use_session(client, connect_pipes(client, req_pipe_path, resp_pipe_path,
+                                           notif_pipe_path, server_pipe_path));
+}
+
+int kvs_connect_socket(char const *server_socket_path)
+{
+  KvsClient *client = client_new();
+  return client == NULL || use_session(client, connect_socket(client, server_socket_path));
+}
+
+int kvs_connect_shm(char const *server_socket_path)
+{
+  KvsClient *client = client_new();
+  return client == NULL || use_session(client, connect_shm(client, server_socket_path));
+}
+
+int kvs_disconnect()
+{
+  if (session == NULL || end_session(session, 1) != 0)
+  {
+    return 1;
+  }
+
+  session = NULL;
+  return 0;
+}
+
+// Sends SUBSCRIBE or UNSUBSCRIBE for one key
+static int change_subscription(int op_code, const char *key)
+{
+  KvsFuture *future = start_request(session, op_code, 0);
+  if (future == NULL)
+  {
+    return 1;
+  }
+  future = send_request(session, future,
+                        frame_put_string(&session->request, key, strlen(key)) == 0);
+
+  int result = log_response(future);
+  kvs_future_free(future);
+  if (result != 0)
+  {
+    perror("Failed to receive response");
+  }
+  return result;
+}
+
+int kvs_subscribe(const char *key)
+{
+  return change_subscription(OP_CODE_SUBSCRIBE, key);
+}
+
+int kvs_unsubscribe(const char *key)
+{
+  return change_subscription(OP_CODE_UNSUBSCRIBE, key);
+}
+
+int kvs_scan(KvsScanCursor *position, size_t count)
+{
+  const char *last_key = position->key != NULL ? position->key : "";
+  KvsFuture *future = start_request(session, OP_CODE_SCAN, 0);
+  if (future == NULL ||
+      (future = send_request(session, future,
+                             frame_put_u64(&session->request, position->cursor) == 0 &&
+                                 frame_put_string(&session->request, last_key,
+                                                  strlen(last_key)) == 0 &&
+                                 frame_put_u64(&session->request, count) == 0)) == NULL)
+  {
+    perror("Failed to send scan request");
+    return 1;
+  }
+
+  // Next cursor, key to resume after and number of pairs, then each key and
+  // value
+  Frame *response = &future->response;
+  uint64_t next_cursor;
+  const char *next_key;
+  size_t next_len;
+  uint64_t num_pairs;
+  int result = kvs_future_wait(future) != 0 ||
+               frame_get_u64(response, &next_cursor) != 0 ||
+               frame_get_string(response, &next_key, &next_len) != 0 ||
+               frame_get_u64(response, &num_pairs) != 0;
+  if (result == 0)
+  {
+    char *key = next_len > 0 ? strdup(next_key) : NULL;
+    if (next_len > 0 && key == NULL)
+    {
+      perror("Failed to allocate scan cursor");
+      kvs_future_free(future);
+      return 1;
+    }
+    free(position->key);
+    position->cursor = next_cursor;
+    position->key = key;
+  }
+  for (uint64_t i = 0; i < num_pairs && result == 0; i++)
+  {
+    const char *key;
+    const char *value;
+    result = frame_get_string(response, &key, NULL) != 0 ||
+             frame_get_string(response, &value, NULL) != 0;
+    if (result == 0)
+    {
+      printf("(%s, %s)\n", key, value);
+    }
+  }
+  if (result != 0)
+  {
+    fprintf(stderr, "Invalid scan response received.\n");
+  }
+
+  kvs_future_free(future);
+  return result;
+}
+
+int kvs_changes(uint64_t from, size_t count, uint64_t *next)
+{
+  KvsFuture *future = start_request(session, OP_CODE_CHANGES, 0);
+  if (future == NULL ||
+      (future = send_request(session, future,
+                             frame_put_u64(&session->request, from) == 0 &&
+                                 frame_put_u64(&session->request, count) == 0)) == NULL)
+  {
+    perror("Failed to send changes request");
+    return 1;
+  }
+
+  Frame *response = &future->response;
+  uint64_t oldest;
+  uint64_t resume;
+  uint64_t num_changes;
+  if (kvs_future_wait(future) != 0 || frame_get_u64(response, &oldest) != 0 ||
+      frame_get_u64(response, &resume) != 0 || frame_get_u64(response, &num_changes) != 0)
+  {
+    fprintf(stderr, "Invalid changes response received.\n");
+    kvs_future_free(future);
+    return 1;
+  }
+
+  // The server only retains so many changes; sequence numbers start at 1
+  if (from < oldest && from > 0)
+  {
+    fprintf(stderr, "Changes %lu to %lu are no longer retained\n", from, oldest - 1);
+  }
+
+  int result = 0;
+  for (uint64_t i = 0; i < num_changes && result == 0; i++)
+  {
+    uint64_t sequence;
+    uint64_t deleted;
+    const char *key;
+    const char *value;
+    result = frame_get_u64(response, &sequence) != 0 || frame_get_u64(response, &deleted) != 0 ||
+             frame_get_string(response, &key, NULL) != 0 ||
+             frame_get_string(response, &value, NULL) != 0;
+    if (result == 0)
+    {
+      printf("%lu (%s, %s)\n", sequence, key, deleted ? "DELETED" : value);
+    }
+  }
+  if (result != 0)
+  {
+    fprintf(stderr, "Invalid changes response received.\n");
+  }
+
+  // Past any changes the server dropped meanwhile, so the caller sees the gap
+  *next = resume;
+  kvs_future_free(future);
+  return result;
+}
+
+// Keeps a request sent with a kvs_*_send function until it is received
+static int keep_sent(KvsFuture *future, uint32_t *request_id)
+{
+  if (future == NULL)
+  {
+    return 1;
+  }
+  sent[future->request_id % KVS_MAX_IN_FLIGHT] = future;
+  *request_id = future->request_id;
+  return 0;
+}
+
+// @return The request sent with a kvs_*_send function, if it is in flight
+static KvsFuture *take_sent(uint32_t request_id)
+{
+  KvsFuture *future = sent[request_id % KVS_MAX_IN_FLIGHT];
+  if (future == NULL || future->request_id != request_id)
+  {
+    fprintf(stderr, "No request %u in flight\n", request_id);
+    return NULL;
+  }
+  sent[request_id % KVS_MAX_IN_FLIGHT] = NULL;
+  return future;
+}
+
+// The slot of the next request must not hold one that was not received yet
+static int sent_slot_free(void)
+{
+  if (sent[(session->last_request_id + 1) % KVS_MAX_IN_FLIGHT] != NULL)
+  {
+    fprintf(stderr, "Too many requests in flight\n");
+    return 0;
+  }
+  return 1;
+}
+
+int kvs_read_send(size_t num_keys, const char *const keys[], uint32_t *request_id)
+{
+  if (!sent_slot_free() || keep_sent(kvs_client_read_async(session, num_keys, keys), request_id) != 0)
+  {
+    perror("Failed to send read request");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_read_receive(uint32_t request_id, size_t num_keys, char *values[])
+{
+  KvsFuture *future = take_sent(request_id);
+  if (future != NULL && future->num_keys != num_keys)
+  {
+    fprintf(stderr, "Invalid read response received.\n");
+    kvs_future_free(future);
+    return 1;
+  }
+  return collect(future, "read", values, NULL);
+}
+
+int kvs_read(size_t num_keys, const char *const keys[], char *values[])
+{
+  return kvs_client_read(session, num_keys, keys, values);
+}
+
+int kvs_write_send(size_t num_pairs, const char *const keys[], const char *const values[],
+                   uint32_t *request_id)
+{
+  if (!sent_slot_free() ||
+      keep_sent(kvs_client_write_async(session, num_pairs, keys, values), request_id) != 0)
+  {
+    perror("Failed to send write request");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_write_receive(uint32_t request_id)
+{
+  KvsFuture *future = take_sent(request_id);
+  int failed = future == NULL || kvs_future_wait(future) != 0;
+  kvs_future_free(future);
+  if (failed)
+  {
+    fprintf(stderr, "Write failed\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int kvs_write(size_t num_pairs, const char *const keys[], const char *const values[])
+{
+  return kvs_client_write(session, num_pairs, keys, values);
+}
+
+int kvs_delete_send(size_t num_keys, const char *const keys[], uint32_t *request_id)
+{
+  if (!sent_slot_free() ||
+      keep_sent(kvs_client_delete_async(session, num_keys, keys), request_id) != 0)
+  {
+    perror("Failed to send delete request");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_delete_receive(uint32_t request_id, size_t num_keys, int deleted[])
+{
+  KvsFuture *future = take_sent(request_id);
+  if (future != NULL && future->num_keys != num_keys)
+  {
+    fprintf(stderr, "Invalid delete response received.\n");
+    kvs_future_free(future);
+    return 1;
+  }
+  return collect(future, "delete", NULL, deleted);
+}
+
+int kvs_delete(size_t num_keys, const char *const keys[], int deleted[])
+{
+  return kvs_client_delete(session, num_keys, keys, deleted);
+}
+
+// Subscribes to, or unsubscribes from, several keys in one request
+static int change_subscriptions(int op_code, size_t num_keys, const char *const keys[],
+                                int failed[])
+{
+  KvsFuture *future = send_keys_request(session, op_code, num_keys, keys, NULL);
+  if (future == NULL)
+  {
+    perror("Failed to send subscription request");
+    return 1;
+  }
+
+  log_response(future);
+  return collect(future, "subscription", NULL, failed);
+}
+
+int kvs_subscribe_many(size_t num_keys, const char *const keys[], int failed[])
+{
+  return change_subscriptions(OP_CODE_SUBSCRIBE_MANY, num_keys, keys, failed);
+}
+
+int kvs_unsubscribe_many(size_t num_keys, const char *const keys[], int failed[])
+{
+  return change_subscriptions(OP_CODE_UNSUBSCRIBE_MANY, num_keys, keys, failed);
+}
+
 // void sigusr1(int signal)
 // {
 // printf("Received SIGUSR1\n");
@@ -512,4 +1861,4 @@ int kvs_unsubscribe(const char *key)
 //   saved_notif_pipe_path = NULL;
 
 // printf("Successfully disconnected all clients\n");
-// }
\ No newline at end of file
+// }
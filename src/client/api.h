@@ -2,6 +2,7 @@
 #define CLIENT_API_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -9,6 +10,15 @@
 
 #include "src/common/constants.h"
 
+/// Maximum number of requests a session can have in flight. Past it, a new
+/// request waits until the response of the oldest one in its slot arrives.
+#define KVS_MAX_IN_FLIGHT 64
+
+// The kvs_* functions below work on the process's default session, the one
+// the client program uses: notifications are printed, and the process exits
+// if the server ends the session. The kvs_client_* functions at the end work
+// on sessions of their own, any number of them per process.
+
 /// Connects to a kvs server.
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
@@ -16,15 +26,29 @@
 /// @param server_pipe_path Path to the name pipe where the server is listening.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
+/// Connects to a kvs server started with --socket. Requests, responses and
+/// notifications all go through one Unix socket connection, so no FIFOs are
+/// created and either side sees the other's death as soon as it happens.
+/// @param server_socket_path Path to the server's socket.
+/// @return 0 if the connection was established successfully, 1 otherwise.
+int kvs_connect_socket(char const *server_socket_path);
+/// Connects to a kvs server started with --socket, moving the session to
+/// rings in shared memory: requests, responses and notifications are copied
+/// through memory and system calls are only made to wake a side that went to
+/// sleep. Only for clients on the same host as the server.
+/// @param server_socket_path Path to the server's socket.
+/// @return 0 if the connection was established successfully, 1 otherwise.
+int kvs_connect_shm(char const *server_socket_path);
 /// Disconnects from an KVS server.
 /// @return 0 in case of success, 1 otherwise.
 int kvs_disconnect(void);
 
-/// Requests a subscription for a key
-/// @param key Key to be subscribed
-/// @return 1 if the key was subscribed successfully (key existing), 0
-/// otherwise.
-
+/// Requests a subscription for a key, which need not exist yet, or for every
+/// key starting with a prefix if it ends with '*' (as in "order:*"). The
+/// server's status is printed: 0 if the session is subscribed, including if
+/// it already was.
+/// @param key Key or prefix pattern to be subscribed
+/// @return 0 if the server answered the request, 1 otherwise.
 int kvs_subscribe(const char *key);
 
 /// Remove a subscription for a key
@@ -34,4 +58,236 @@ int kvs_subscribe(const char *key);
 
 int kvs_unsubscribe(const char *key);
 
+/// Subscribes to several keys or prefix patterns in one request. Sessions
+/// have no limit on their number of subscriptions.
+/// @param num_keys Number of keys (up to MAX_SESSION_KEYS).
+/// @param keys Keys or patterns to subscribe.
+/// @param failed Set to 1 for each key that could not be subscribed, 0 if it
+/// is subscribed (including keys that already were).
+/// @return 0 if the request succeeded, 1 otherwise.
+int kvs_subscribe_many(size_t num_keys, const char *const keys[], int failed[]);
+
+/// Unsubscribes from several keys or prefix patterns in one request.
+/// @param num_keys Number of keys (up to MAX_SESSION_KEYS).
+/// @param keys Keys or patterns to unsubscribe.
+/// @param failed Set to 1 for each key that was not subscribed, 0 otherwise.
+/// @return 0 if the request succeeded, 1 otherwise.
+int kvs_unsubscribe_many(size_t num_keys, const char *const keys[], int failed[]);
+
+/// Position of a scan: where the server is to resume it, after the last key
+/// it returned. {0, NULL} starts a scan, and it is back to {0, NULL} once
+/// every pair was returned.
+typedef struct KvsScanCursor
+{
+  uint64_t cursor;
+  char *key;
+} KvsScanCursor;
+
+/// Reads one page of the server's key value pairs and prints them as
+/// "(key, value)" lines, like SHOW. Pairs present for the whole scan are
+/// returned exactly once, whatever else is written or deleted meanwhile.
+/// @param position Position to start from, updated to that of the next page.
+/// Its key is allocated by kvs_scan, and freed once the scan is over (free it
+/// if the scan is abandoned).
+/// @param count Maximum number of pairs in the page (up to MAX_SCAN_COUNT).
+/// @return 0 if the page was read successfully, 1 otherwise.
+int kvs_scan(KvsScanCursor *position, size_t count);
+
+/// Reads a batch of the server's change log and prints it as
+/// "<sequence> (key, value)" lines, with DELETED as the value of deletes.
+/// Unlike notifications, changes made while the client was away can be read,
+/// as long as the server still retains them.
+/// @param from Sequence number of the first change wanted, 1 for the oldest.
+/// @param count Maximum number of changes (up to MAX_CHANGES_COUNT).
+/// @param next Set to the sequence number to continue from, as sent by the
+/// server: past the changes read, or once every change was read, the one the
+/// next change will get (not past from).
+/// @return 0 if the batch was read successfully, 1 otherwise.
+int kvs_changes(uint64_t from, size_t count, uint64_t *next);
+
+/// Reads values from the server, like a READ command of a job.
+/// @param num_keys Number of keys to read (up to MAX_SESSION_KEYS).
+/// @param keys Keys to read.
+/// @param values Filled with copies of the values, NULL for keys that do not
+/// exist (to be freed by the caller).
+/// @return 0 if the keys were read successfully, 1 otherwise.
+int kvs_read(size_t num_keys, const char *const keys[], char *values[]);
+
+/// Writes key value pairs to the server, like a WRITE command of a job.
+/// Subscribers of the keys are notified.
+/// @param num_pairs Number of pairs to write (up to MAX_SESSION_KEYS).
+/// @param keys Keys to write.
+/// @param values Values to write.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_write(size_t num_pairs, const char *const keys[], const char *const values[]);
+
+/// Deletes keys from the server, like a DELETE command of a job.
+/// Subscribers of the deleted keys are notified.
+/// @param num_keys Number of keys to delete (up to MAX_SESSION_KEYS).
+/// @param keys Keys to delete.
+/// @param deleted Set to 1 for each key that existed, 0 otherwise.
+/// @return 0 if the request succeeded, 1 otherwise.
+int kvs_delete(size_t num_keys, const char *const keys[], int deleted[]);
+
+// Pipelined requests: each *_send call returns as soon as the request is
+// written, with the id to pass to the matching *_receive call. Up to
+// KVS_MAX_IN_FLIGHT requests can be in flight; the server handles them in
+// order, and responses may be received in any order.
+
+/// Sends a READ without waiting for its response.
+/// @param num_keys Number of keys to read (up to MAX_SESSION_KEYS).
+/// @param keys Keys to read.
+/// @param request_id Set to the id of the request.
+/// @return 0 if the request was sent, 1 otherwise.
+int kvs_read_send(size_t num_keys, const char *const keys[], uint32_t *request_id);
+
+/// Waits for the response of a READ sent with kvs_read_send.
+/// @param request_id Id of the request.
+/// @param num_keys Number of keys of the request.
+/// @param values Same as in kvs_read.
+/// @return 0 if the keys were read successfully, 1 otherwise.
+int kvs_read_receive(uint32_t request_id, size_t num_keys, char *values[]);
+
+/// Sends a WRITE without waiting for its response.
+/// @param request_id Set to the id of the request.
+/// @return 0 if the request was sent, 1 otherwise.
+int kvs_write_send(size_t num_pairs, const char *const keys[], const char *const values[],
+                   uint32_t *request_id);
+
+/// Waits for the response of a WRITE sent with kvs_write_send.
+/// @param request_id Id of the request.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_write_receive(uint32_t request_id);
+
+/// Sends a DELETE without waiting for its response.
+/// @param request_id Set to the id of the request.
+/// @return 0 if the request was sent, 1 otherwise.
+int kvs_delete_send(size_t num_keys, const char *const keys[], uint32_t *request_id);
+
+/// Waits for the response of a DELETE sent with kvs_delete_send.
+/// @param request_id Id of the request.
+/// @param num_keys Number of keys of the request.
+/// @param deleted Same as in kvs_delete.
+/// @return 0 if the request succeeded, 1 otherwise.
+int kvs_delete_receive(uint32_t request_id, size_t num_keys, int deleted[]);
+
+// Sessions: each KvsClient is a session of its own, with its own pipes,
+// socket or rings. Every function can be called from any thread: requests of
+// one session are written one at a time and pipelined, and a receiver thread
+// matches each response to its request. Requests return a KvsFuture at once,
+// to be waited on or given a callback.
+
+typedef struct KvsClient KvsClient;
+typedef struct KvsFuture KvsFuture;
+
+/// Called for each change of a subscribed key, on the session's notification
+/// thread. key and value are only valid until it returns.
+/// @param value New value, or NULL if the key was deleted.
+typedef void (*KvsNotifyCallback)(const char *key, const char *value, void *arg);
+
+/// Called once a request completes, on the session's receiver thread, or
+/// right away if it already had. It owns the future, and frees it with
+/// kvs_future_free. It must not wait on a request of the same session.
+typedef void (*KvsFutureCallback)(KvsFuture *future, void *arg);
+
+/// Same as kvs_connect, for a new session.
+/// @return The session, NULL if the connection could not be established.
+KvsClient *kvs_client_connect(char const *req_pipe_path, char const *resp_pipe_path,
+                              char const *notif_pipe_path, char const *server_pipe_path);
+
+/// Same as kvs_connect_socket, for a new session.
+/// @return The session, NULL if the connection could not be established.
+KvsClient *kvs_client_connect_socket(char const *server_socket_path);
+
+/// Same as kvs_connect_shm, for a new session.
+/// @return The session, NULL if the connection could not be established.
+KvsClient *kvs_client_connect_shm(char const *server_socket_path);
+
+/// Disconnects a session and frees it. Requests still in flight fail; no
+/// other thread may use the session once this is called.
+/// @return 0 in case of success, 1 otherwise.
+int kvs_client_disconnect(KvsClient *client);
+
+/// Sets the function notifications of a session are passed to. Until one is
+/// set, they are dropped.
+/// @param callback Function to call, NULL to drop notifications.
+/// @param arg Passed to callback.
+void kvs_client_on_notify(KvsClient *client, KvsNotifyCallback callback, void *arg);
+
+/// Sends a READ. Once it completes, kvs_future_value gives each value.
+/// @return The request, NULL if it could not be sent.
+KvsFuture *kvs_client_read_async(KvsClient *client, size_t num_keys, const char *const keys[]);
+
+/// Sends a WRITE.
+/// @return The request, NULL if it could not be sent.
+KvsFuture *kvs_client_write_async(KvsClient *client, size_t num_pairs, const char *const keys[],
+                                  const char *const values[]);
+
+/// Sends a DELETE. Once it completes, kvs_future_flag is 1 for each key that
+/// existed.
+/// @return The request, NULL if it could not be sent.
+KvsFuture *kvs_client_delete_async(KvsClient *client, size_t num_keys, const char *const keys[]);
+
+/// Subscribes to keys or prefix patterns. Once it completes, kvs_future_flag
+/// is 1 for each key that could not be subscribed.
+/// @return The request, NULL if it could not be sent.
+KvsFuture *kvs_client_subscribe_async(KvsClient *client, size_t num_keys, const char *const keys[]);
+
+/// Unsubscribes from keys or prefix patterns. Once it completes,
+/// kvs_future_flag is 1 for each key that was not subscribed.
+/// @return The request, NULL if it could not be sent.
+KvsFuture *kvs_client_unsubscribe_async(KvsClient *client, size_t num_keys,
+                                        const char *const keys[]);
+
+/// Waits for a request to complete. It fails if the server refused it or the
+/// session ended first.
+/// @return 0 if the request succeeded, 1 otherwise.
+int kvs_future_wait(KvsFuture *future);
+
+/// Calls a function once a request completes, instead of waiting for it. The
+/// future must not be used by the caller afterwards.
+void kvs_future_then(KvsFuture *future, KvsFutureCallback callback, void *arg);
+
+/// @return Value of a key of a completed READ, NULL if it does not exist.
+/// Valid until the future is freed.
+const char *kvs_future_value(KvsFuture *future, size_t index);
+
+/// @return Result for a key of a completed DELETE, SUBSCRIBE or UNSUBSCRIBE.
+int kvs_future_flag(KvsFuture *future, size_t index);
+
+/// Frees a completed request.
+void kvs_future_free(KvsFuture *future);
+
+/// Synchronous versions of the requests above, same as kvs_read,
+/// kvs_write, kvs_delete and kvs_subscribe_many for a session.
+int kvs_client_read(KvsClient *client, size_t num_keys, const char *const keys[], char *values[]);
+int kvs_client_write(KvsClient *client, size_t num_pairs, const char *const keys[],
+                     const char *const values[]);
+int kvs_client_delete(KvsClient *client, size_t num_keys, const char *const keys[], int deleted[]);
+int kvs_client_subscribe(KvsClient *client, size_t num_keys, const char *const keys[],
+                         int failed[]);
+int kvs_client_unsubscribe(KvsClient *client, size_t num_keys, const char *const keys[],
+                           int failed[]);
+
+/// Turns on a near cache for a session, so kvs_client_get of a key it holds
+/// needs no request. A key read through the cache is subscribed to, and its
+/// entry is updated by each notification, until the least recently used
+/// entries are evicted to stay within the limits. Notifications the server
+/// drops on overflow can leave an entry stale: max_age_ms bounds how long.
+/// The notification callback is still passed the notifications of cached
+/// keys, and the session's own subscriptions must not overlap them.
+/// @param max_entries Maximum number of keys held.
+/// @param max_bytes Maximum size of the entries, 0 for no limit.
+/// @param max_age_ms Time after which an entry is read again, 0 for none.
+/// @return 0 if the cache was enabled, 1 otherwise.
+int kvs_client_enable_cache(KvsClient *client, size_t max_entries, size_t max_bytes,
+                            unsigned int max_age_ms);
+
+/// Reads the value of a key, from the session's near cache if it holds it,
+/// or from the server otherwise. Without a cache, same as kvs_client_read.
+/// @param value Set to a copy of the value, NULL if the key does not exist
+/// (to be freed by the caller).
+/// @return 0 if the key was read successfully, 1 otherwise.
+int kvs_client_get(KvsClient *client, const char *key, char **value);
+
 #endif // CLIENT_API_H
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,9 +13,9 @@
 
 int main(int argc, char *argv[])
 {
-  if (argc < 3)
+  if (argc < 3 || (argc > 3 && strcmp(argv[3], "--socket") != 0 && strcmp(argv[3], "--shm") != 0))
   {
-    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n",
+    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path> [--socket|--shm]\n",
             argv[0]);
     return 1;
   }
@@ -24,7 +25,13 @@ int main(int argc, char *argv[])
   char notif_pipe_path[256] = "/tmp/notif";
   char server_pipe_path[256] = "/tmp/server_";
 
-  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  char data_keys[MAX_SESSION_KEYS][MAX_STRING_SIZE];
+  char data_values[MAX_SESSION_KEYS][MAX_STRING_SIZE];
+  const char *key_ptrs[MAX_SESSION_KEYS];
+  const char *value_ptrs[MAX_SESSION_KEYS];
+  char *read_values[MAX_SESSION_KEYS];
+  int deleted[MAX_SESSION_KEYS];
+  int failed[MAX_SESSION_KEYS];
   unsigned int delay_ms;
   size_t num;
 
@@ -33,8 +40,26 @@ int main(int argc, char *argv[])
   strncat(notif_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
   strncat(server_pipe_path, argv[2], strlen(argv[2]) * sizeof(char));
 
-  // TODO open pipes
-  if (kvs_connect(req_pipe_path, resp_pipe_path, notif_pipe_path, server_pipe_path) != 0)
+  // Writes to a closed request pipe fail with EPIPE and are reported instead
+  signal(SIGPIPE, SIG_IGN);
+
+  // With --socket or --shm, connect to the server's socket next to its pipe
+  char server_socket_path[sizeof(server_pipe_path) + sizeof(".sock")];
+  snprintf(server_socket_path, sizeof(server_socket_path), "%s.sock", server_pipe_path);
+  int connect_status;
+  if (argc == 3)
+  {
+    connect_status = kvs_connect(req_pipe_path, resp_pipe_path, notif_pipe_path, server_pipe_path);
+  }
+  else if (strcmp(argv[3], "--shm") == 0)
+  {
+    connect_status = kvs_connect_shm(server_socket_path);
+  }
+  else
+  {
+    connect_status = kvs_connect_socket(server_socket_path);
+  }
+  if (connect_status != 0)
   {
     fprintf(stderr, "Failed to connect to the server\n");
     return 1;
@@ -57,35 +82,200 @@ int main(int argc, char *argv[])
       return 0;
 
     case CMD_SUBSCRIBE:
-      num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+      num = parse_list(STDIN_FILENO, data_keys, MAX_SESSION_KEYS, MAX_STRING_SIZE);
       if (num == 0)
       {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_subscribe(keys[0]))
+      if (num == 1)
+      {
+        if (kvs_subscribe(data_keys[0]))
+        {
+          fprintf(stderr, "Command subscribe failed\n");
+        }
+        break;
+      }
+
+      // Several keys go in one request
+      for (size_t i = 0; i < num; i++)
+      {
+        key_ptrs[i] = data_keys[i];
+      }
+      if (kvs_subscribe_many(num, key_ptrs, failed))
       {
         fprintf(stderr, "Command subscribe failed\n");
+        break;
+      }
+      for (size_t i = 0; i < num; i++)
+      {
+        if (failed[i])
+        {
+          fprintf(stderr, "Failed to subscribe %s\n", data_keys[i]);
+        }
       }
 
       break;
 
     case CMD_UNSUBSCRIBE:
-      num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+      num = parse_list(STDIN_FILENO, data_keys, MAX_SESSION_KEYS, MAX_STRING_SIZE);
       if (num == 0)
       {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_unsubscribe(keys[0]))
+      if (num == 1)
+      {
+        if (kvs_unsubscribe(data_keys[0]))
+        {
+          fprintf(stderr, "Command subscribe failed\n");
+        }
+        break;
+      }
+
+      // Several keys go in one request
+      for (size_t i = 0; i < num; i++)
+      {
+        key_ptrs[i] = data_keys[i];
+      }
+      if (kvs_unsubscribe_many(num, key_ptrs, failed))
       {
         fprintf(stderr, "Command subscribe failed\n");
+        break;
+      }
+      for (size_t i = 0; i < num; i++)
+      {
+        if (failed[i])
+        {
+          fprintf(stderr, "Failed to unsubscribe %s\n", data_keys[i]);
+        }
       }
 
       break;
 
+    case CMD_SHOW:
+    {
+      // Page through the whole table with SCAN
+      KvsScanCursor position = {0, NULL};
+      do
+      {
+        if (kvs_scan(&position, MAX_SCAN_COUNT))
+        {
+          fprintf(stderr, "Command show failed\n");
+          break;
+        }
+      } while (position.cursor != 0);
+      free(position.key);
+      break;
+    }
+
+    case CMD_READ:
+      num = parse_list(STDIN_FILENO, data_keys, MAX_SESSION_KEYS, MAX_STRING_SIZE);
+      if (num == 0)
+      {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      for (size_t i = 0; i < num; i++)
+      {
+        key_ptrs[i] = data_keys[i];
+      }
+      if (kvs_read(num, key_ptrs, read_values))
+      {
+        fprintf(stderr, "Command read failed\n");
+        break;
+      }
+
+      // Same output as a READ of a job
+      printf("[");
+      for (size_t i = 0; i < num; i++)
+      {
+        printf("(%s,%s)", data_keys[i], read_values[i] != NULL ? read_values[i] : "KVSERROR");
+        free(read_values[i]);
+      }
+      printf("]\n");
+      break;
+
+    case CMD_WRITE:
+      num = parse_pairs(STDIN_FILENO, data_keys, data_values, MAX_SESSION_KEYS, MAX_STRING_SIZE);
+      if (num == 0)
+      {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      for (size_t i = 0; i < num; i++)
+      {
+        key_ptrs[i] = data_keys[i];
+        value_ptrs[i] = data_values[i];
+      }
+      if (kvs_write(num, key_ptrs, value_ptrs))
+      {
+        fprintf(stderr, "Command write failed\n");
+      }
+      break;
+
+    case CMD_DELETE:
+      num = parse_list(STDIN_FILENO, data_keys, MAX_SESSION_KEYS, MAX_STRING_SIZE);
+      if (num == 0)
+      {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      for (size_t i = 0; i < num; i++)
+      {
+        key_ptrs[i] = data_keys[i];
+      }
+      if (kvs_delete(num, key_ptrs, deleted))
+      {
+        fprintf(stderr, "Command delete failed\n");
+        break;
+      }
+
+      // Same output as a DELETE of a job: only the missing keys
+      int missing = 0;
+      for (size_t i = 0; i < num; i++)
+      {
+        if (!deleted[i])
+        {
+          printf("%s(%s,KVSMISSING)", missing++ == 0 ? "[" : "", data_keys[i]);
+        }
+      }
+      if (missing > 0)
+      {
+        printf("]\n");
+      }
+      break;
+
+    case CMD_CHANGES:
+    {
+      unsigned int from;
+      if (parse_changes(STDIN_FILENO, &from) == -1)
+      {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      // Read the change log in batches until caught up
+      uint64_t sequence = from;
+      uint64_t next;
+      int failed_changes;
+      while ((failed_changes = kvs_changes(sequence, MAX_CHANGES_COUNT, &next)) == 0 &&
+             next > sequence)
+      {
+        sequence = next;
+      }
+      if (failed_changes)
+      {
+        fprintf(stderr, "Command changes failed\n");
+      }
+      break;
+    }
+
     case CMD_DELAY:
       if (parse_delay(STDIN_FILENO, &delay_ms) == -1)
       {
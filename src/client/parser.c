@@ -100,13 +100,47 @@ enum Command get_next(int fd) {
 
   switch (buf[0]) {
   case 'S':
-    if (read(fd, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+    if (read(fd, buf + 1, 1) != 1) {
+      return CMD_INVALID;
+    }
+
+    if (buf[1] == 'H') {
+      if (read(fd, buf + 2, 2) != 2 || strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_SHOW;
+    }
+
+    if (read(fd, buf + 2, 8) != 8 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
     return CMD_SUBSCRIBE;
 
+  case 'R':
+    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_READ;
+
+  case 'W':
+    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "WRITE ", 6) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_WRITE;
+
   case 'U':
     if (read(fd, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
       cleanup(fd);
@@ -117,6 +151,13 @@ enum Command get_next(int fd) {
 
   case 'D':
     if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
+      if (strncmp(buf, "DELETE", 6) == 0) {
+        if (read(fd, buf + 6, 1) != 1 || buf[6] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_DELETE;
+      }
       if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
         cleanup(fd);
         return CMD_INVALID;
@@ -130,6 +171,14 @@ enum Command get_next(int fd) {
 
     return CMD_DELAY;
 
+  case 'C':
+    if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "CHANGES ", 8) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_CHANGES;
+
   case '#':
     cleanup(fd);
     return CMD_EMPTY;
@@ -182,6 +231,57 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   return num_keys;
 }
 
+size_t parse_pairs(int fd, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+                   size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  char value[max_string_size];
+  while (num_pairs < max_pairs) {
+    if (read_string(fd, key, max_string_size - 1) != 0 ||
+        read_string(fd, value, max_string_size - 1) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+
+    strcpy(keys[num_pairs], key);
+    strcpy(values[num_pairs++], value);
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs && ch != ']') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
 int parse_delay(int fd, unsigned int *delay) {
   char ch;
 
@@ -192,3 +292,14 @@ int parse_delay(int fd, unsigned int *delay) {
 
   return 0;
 }
+
+int parse_changes(int fd, unsigned int *from) {
+  char ch;
+
+  if (read_uint(fd, from, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return -1;
+  }
+
+  return 0;
+}
@@ -10,6 +10,11 @@ enum Command {
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
+  CMD_SHOW,
+  CMD_READ,
+  CMD_WRITE,
+  CMD_DELETE,
+  CMD_CHANGES,
   CMD_EMPTY,
   CMD_INVALID,
   EOC // End of commands
@@ -31,6 +36,18 @@ enum Command get_next(int fd);
 size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
                   size_t max_string_size);
 
+// Parses a list of pairs, as in "[(key,value)(key2,value2)]"
+// @param fd File descriptor to read from.
+// @param keys Array to store the keys
+// @param values Array to store the values
+// @param max_pairs Maximum number of pairs it will write.
+// @param max_string_size Maximum string size allowed.
+// @return 0 if the command was not parsed successfully, otherwise return the
+//          of pairs parsed
+size_t parse_pairs(int fd, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+                   size_t max_string_size);
+
 // Parses a DELAY command.
 // @param fd File descriptor to read from.
 // @param delay Pointer to the variable to store the wait delay in.
@@ -40,4 +57,10 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 // error.
 int parse_delay(int fd, unsigned int *delay);
 
+// Parses a CHANGES command.
+// @param fd File descriptor to read from.
+// @param from Pointer to the variable to store the sequence number in.
+// @return 0 if the command was parsed successfully, -1 otherwise.
+int parse_changes(int fd, unsigned int *from);
+
 #endif // KVS_PARSER_H
@@ -4,4 +4,7 @@
 #define STATE_ACCESS_DELAY_US   // delay a aplicar no server
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
-#define MAX_NUMBER_SUB 10
\ No newline at end of file
+#define MAX_SCAN_COUNT 25 // max pares por pagina de SCAN (limita o tempo com o
+                          // lock da tabela e os arrays da pagina no servidor)
+#define MAX_SESSION_KEYS 256 // max chaves por READ/WRITE/DELETE de uma sessao
+#define MAX_CHANGES_COUNT 1024 // max alteracoes por resposta de CHANGES
@@ -0,0 +1,19 @@
+#ifndef COMMON_HASH_H
+#define COMMON_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// FNV-1a of a string, good enough to spread keys and file names over the
+/// buckets of a hash table.
+/// @return Hash of the string, to be reduced modulo the number of buckets.
+static inline size_t hash_string(const char *s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s != '\0'; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  return (size_t)h;
+}
+
+#endif // COMMON_HASH_H
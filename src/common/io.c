@@ -2,9 +2,11 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -16,7 +18,7 @@ int read_all(int fd, void *buffer, size_t size, int *intr) {
   }
   size_t bytes_read = 0;
   while (bytes_read < size) {
-    ssize_t result = read(fd, buffer + bytes_read, size - bytes_read);
+    ssize_t result = read(fd, (char *)buffer + bytes_read, size - bytes_read);
     if (result == -1) {
       if (errno == EINTR) {
         if (intr != NULL) {
@@ -56,7 +58,8 @@ int read_string(int fd, char *str) {
 int write_all(int fd, const void *buffer, size_t size) {
   size_t bytes_written = 0;
   while (bytes_written < size) {
-    ssize_t result = write(fd, buffer + bytes_written, size - bytes_written);
+    ssize_t result =
+        write(fd, (const char *)buffer + bytes_written, size - bytes_written);
     if (result == -1) {
       if (errno == EINTR) {
         // error for broken PIPE (error associated with writting to the closed
@@ -71,6 +74,46 @@ int write_all(int fd, const void *buffer, size_t size) {
   return 1;
 }
 
+static long long now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int write_all_within(int fd, const void *buffer, size_t size, int timeout_ms) {
+  long long deadline = now_ms() + timeout_ms;
+  int is_socket = 1;
+  size_t bytes_written = 0;
+  while (bytes_written < size) {
+    // send never blocks nor raises SIGPIPE, but only works on sockets
+    ssize_t result =
+        is_socket ? send(fd, (const char *)buffer + bytes_written,
+                         size - bytes_written, MSG_DONTWAIT | MSG_NOSIGNAL)
+                  : write(fd, (const char *)buffer + bytes_written,
+                          size - bytes_written);
+    if (result == -1 && errno == ENOTSOCK) {
+      is_socket = 0;
+      continue;
+    }
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      long long remaining = deadline - now_ms();
+      struct pollfd reader = {fd, POLLOUT, 0};
+      if (remaining <= 0 || poll(&reader, 1, (int)remaining) == 0) {
+        return 0;
+      }
+      continue;
+    }
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    bytes_written += (size_t)result;
+  }
+  return 1;
+}
+
 static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
@@ -24,6 +24,16 @@ int read_string(int fd, char *str);
 /// @return On success, returns 1, on error, returns -1
 int write_all(int fd, const void *buffer, size_t size);
 
+/// Writes a given number of bytes to a file descriptor without blocking for
+/// more than timeout_ms in total. The descriptor must be a socket or opened
+/// with O_NONBLOCK.
+/// @param fd File descriptor to write to.
+/// @param buffer Buffer to write from.
+/// @param size Number of bytes to write.
+/// @param timeout_ms Longest time to wait for the reader to make room.
+/// @return On success, returns 1, on timeout, returns 0, on error, returns -1
+int write_all_within(int fd, const void *buffer, size_t size, int timeout_ms);
+
 void delay(unsigned int time_ms);
 
 #endif // COMMON_IO_H
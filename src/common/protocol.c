@@ -0,0 +1,211 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/common/io.h"
+
+#define FRAME_INITIAL_CAPACITY 256
+
+// Makes room for extra bytes at the end of the frame
+static int frame_reserve(Frame *frame, size_t extra) {
+  size_t needed = frame->size + extra;
+  if (needed > sizeof(FrameHeader) + MAX_FRAME_PAYLOAD) {
+    return 1;
+  }
+  if (needed <= frame->capacity) {
+    return 0;
+  }
+
+  size_t capacity =
+      frame->capacity > 0 ? frame->capacity : FRAME_INITIAL_CAPACITY;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  char *data = realloc(frame->data, capacity);
+  if (data == NULL) {
+    return 1;
+  }
+  frame->data = data;
+  frame->capacity = capacity;
+  return 0;
+}
+
+int frame_init(Frame *frame, uint8_t op_code, uint32_t request_id) {
+  frame->size = 0;
+  frame->read_pos = 0;
+  if (frame_reserve(frame, sizeof(FrameHeader))) {
+    return 1;
+  }
+
+  FrameHeader *header = (FrameHeader *)frame->data;
+  memset(header, 0, sizeof(FrameHeader));
+  header->version = PROTOCOL_VERSION;
+  header->op_code = op_code;
+  header->request_id = request_id;
+  frame->size = sizeof(FrameHeader);
+  return 0;
+}
+
+void frame_free(Frame *frame) {
+  free(frame->data);
+  memset(frame, 0, sizeof(Frame));
+}
+
+FrameHeader *frame_header(Frame *frame) { return (FrameHeader *)frame->data; }
+
+int frame_put_u64(Frame *frame, uint64_t value) {
+  if (frame_reserve(frame, sizeof(value))) {
+    return 1;
+  }
+  memcpy(frame->data + frame->size, &value, sizeof(value));
+  frame->size += sizeof(value);
+  return 0;
+}
+
+int frame_put_string(Frame *frame, const char *str, size_t len) {
+  uint32_t wire_len = (uint32_t)len;
+  if (len > MAX_FRAME_PAYLOAD ||
+      frame_reserve(frame, sizeof(wire_len) + len + 1)) {
+    return 1;
+  }
+  memcpy(frame->data + frame->size, &wire_len, sizeof(wire_len));
+  frame->size += sizeof(wire_len);
+  memcpy(frame->data + frame->size, str, len);
+  frame->size += len;
+  frame->data[frame->size++] = '\0';
+  return 0;
+}
+
+// Returns the next n payload bytes, or NULL if the payload is shorter
+static const char *frame_take(Frame *frame, size_t n) {
+  size_t payload_size = frame->size - sizeof(FrameHeader);
+  if (n > payload_size - frame->read_pos) {
+    return NULL;
+  }
+  const char *bytes = frame->data + sizeof(FrameHeader) + frame->read_pos;
+  frame->read_pos += n;
+  return bytes;
+}
+
+int frame_get_u64(Frame *frame, uint64_t *value) {
+  const char *bytes = frame_take(frame, sizeof(*value));
+  if (bytes == NULL) {
+    return 1;
+  }
+  memcpy(value, bytes, sizeof(*value));
+  return 0;
+}
+
+int frame_get_string(Frame *frame, const char **str, size_t *len) {
+  uint32_t wire_len;
+  const char *bytes = frame_take(frame, sizeof(wire_len));
+  if (bytes == NULL) {
+    return 1;
+  }
+  memcpy(&wire_len, bytes, sizeof(wire_len));
+
+  bytes = frame_take(frame, (size_t)wire_len + 1);
+  if (bytes == NULL || bytes[wire_len] != '\0') {
+    return 1;
+  }
+  *str = bytes;
+  if (len != NULL) {
+    *len = wire_len;
+  }
+  return 0;
+}
+
+void frame_seal(Frame *frame) {
+  frame_header(frame)->payload_len =
+      (uint32_t)(frame->size - sizeof(FrameHeader));
+}
+
+int frame_prepare(Frame *frame, const FrameHeader *header) {
+  frame->size = 0;
+  frame->read_pos = 0;
+  if (frame_reserve(frame, sizeof(*header) + header->payload_len)) {
+    return 1;
+  }
+  memcpy(frame->data, header, sizeof(*header));
+  frame->size = sizeof(*header) + header->payload_len;
+  return 0;
+}
+
+int frame_send(int fd, Frame *frame) {
+  frame_seal(frame);
+  return write_all(fd, frame->data, frame->size) == 1 ? 0 : 1;
+}
+
+int frame_send_within(int fd, Frame *frame, int timeout_ms) {
+  frame_seal(frame);
+  int result = write_all_within(fd, frame->data, frame->size, timeout_ms);
+  return result == 1 ? 0 : result == 0 ? 1 : -1;
+}
+
+int frame_recv(int fd, Frame *frame, int *intr) {
+  FrameHeader header;
+  int result = read_all(fd, &header, sizeof(header), intr);
+  if (result != 1) {
+    return result;
+  }
+  if (header.version != PROTOCOL_VERSION ||
+      header.payload_len > MAX_FRAME_PAYLOAD) {
+    return -1;
+  }
+
+  if (frame_prepare(frame, &header) != 0) {
+    return -1;
+  }
+
+  result = read_all(fd, frame->data + sizeof(header), header.payload_len, intr);
+  return result == 0 ? -1 : result; // EOF in the middle of a frame
+}
+
+int frame_recv_some(int fd, Frame *frame, size_t *received) {
+  if (*received == 0) {
+    frame->size = 0;
+    frame->read_pos = 0;
+    if (frame_reserve(frame, sizeof(FrameHeader))) {
+      return -1;
+    }
+  }
+
+  while (1) {
+    // The header first, then the payload it announces
+    size_t wanted =
+        *received < sizeof(FrameHeader) ? sizeof(FrameHeader) : frame->size;
+    if (*received == wanted) {
+      *received = 0;
+      return 1;
+    }
+
+    ssize_t result = read(fd, frame->data + *received, wanted - *received);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 2;
+      }
+      perror("Failed to read from pipe");
+      return -1;
+    } else if (result == 0) {
+      return *received == 0 ? 0 : -1; // EOF in the middle of a frame
+    }
+
+    *received += (size_t)result;
+    if (*received == sizeof(FrameHeader)) {
+      FrameHeader header;
+      memcpy(&header, frame->data, sizeof(header));
+      if (header.version != PROTOCOL_VERSION ||
+          header.payload_len > MAX_FRAME_PAYLOAD ||
+          frame_prepare(frame, &header) != 0) {
+        return -1;
+      }
+    }
+  }
+}
@@ -1,6 +1,9 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a
 // mensagem recebida no server usam estes opcodes tambem nos clientes quando
@@ -10,8 +13,152 @@ enum
   OP_CODE_CONNECT = 1,
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
-  OP_CODE_UNSUBSCRIBE = 4
+  OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_SCAN = 5,
+  OP_CODE_NOTIFY = 6, // server -> client, on the notification pipe
+  OP_CODE_READ = 7,
+  OP_CODE_WRITE = 8,
+  OP_CODE_DELETE = 9,
+  OP_CODE_SUBSCRIBE_MANY = 10,
+  OP_CODE_UNSUBSCRIBE_MANY = 11,
+  OP_CODE_CHANGES = 12
   // TODO mais opcodes para cada operacao
 };
 
+// Every message is a frame: a fixed header followed by payload_len bytes of
+// payload. Both ends run on the same host, so fields are in host byte order.
+//
+// Payloads are sequences of fields:
+//   u64     8 bytes
+//   string  u32 length, the bytes, then a '\0' that is not counted in the
+//           length, so decoded strings can be used in place
+//
+//   CONNECT      req path, resp path, notif path (strings); over the socket,
+//                where the connection is the session, empty or the name of a
+//                shared memory region holding the session's rings (ring.h)
+//   SUBSCRIBE    key
+//   UNSUBSCRIBE  key
+//   SCAN         cursor (u64), key to resume after (string), count (u64)
+//   DISCONNECT   -
+//   NOTIFY       n (u64), then per change whether it deletes the key (u64),
+//                key and value (empty for deletes), oldest change first
+//   READ         n (u64), n keys
+//   WRITE        n (u64), n pairs of key and value
+//   DELETE       n (u64), n keys
+//   SUBSCRIBE_MANY    n (u64), n keys
+//   UNSUBSCRIBE_MANY  n (u64), n keys
+//   CHANGES      sequence number of the first change wanted (u64), count (u64)
+//
+// Over the socket transport, NOTIFY frames are interleaved with responses on
+// the same connection.
+//
+// A session may have many requests in flight: the server handles them in
+// order, and responses echo the request's op_code and request_id and carry
+// the result in status. Responses with a payload:
+//   SCAN         next cursor (u64), key to resume after (string), n (u64),
+//                n pairs of key and value
+//   READ         n (u64), then per key whether it exists (u64) and its value
+//                (empty if it does not)
+//   DELETE       n (u64), then per key whether it existed (u64)
+//   SUBSCRIBE_MANY, UNSUBSCRIBE_MANY
+//                n (u64), then per key 0 if it succeeded, 1 otherwise (u64)
+//   CHANGES      oldest sequence number retained (u64), sequence number to
+//                continue from (u64), n (u64, at least 1 unless caught up),
+//                then per change its sequence number (u64), whether it
+//                deletes the key (u64), key and value (empty for deletes)
+#define PROTOCOL_VERSION 1
+#define MAX_FRAME_PAYLOAD (1 << 20)
+
+typedef struct {
+  uint8_t version;
+  uint8_t op_code;
+  uint8_t status; // 0 on success, responses only
+  uint8_t reserved;
+  uint32_t request_id;
+  uint32_t payload_len;
+} FrameHeader;
+
+/// A frame being encoded or decoded. The buffer holds the header followed by
+/// the payload and is reused by later frames, so a zeroed Frame can be used
+/// for a whole session and released with frame_free.
+typedef struct {
+  char *data;
+  size_t size;     // bytes in use, header included
+  size_t capacity; // bytes allocated
+  size_t read_pos; // next payload byte to decode
+} Frame;
+
+/// Starts encoding a new frame, discarding the previous one.
+/// @param frame Frame to reuse.
+/// @param op_code Operation of the frame.
+/// @param request_id Identifier echoed back in the response.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int frame_init(Frame *frame, uint8_t op_code, uint32_t request_id);
+
+/// Frees the frame's buffer.
+/// @param frame Frame to release.
+void frame_free(Frame *frame);
+
+/// @param frame Frame previously initialized or received.
+/// @return The header of the frame.
+FrameHeader *frame_header(Frame *frame);
+
+/// Appends a u64 field to the payload.
+/// @return 0 on success, 1 if the frame is too large.
+int frame_put_u64(Frame *frame, uint64_t value);
+
+/// Appends a string field to the payload.
+/// @param str Bytes of the string, not necessarily null terminated.
+/// @param len Number of bytes.
+/// @return 0 on success, 1 if the frame is too large.
+int frame_put_string(Frame *frame, const char *str, size_t len);
+
+/// Reads the next u64 field of the payload.
+/// @return 0 on success, 1 if the payload is malformed.
+int frame_get_u64(Frame *frame, uint64_t *value);
+
+/// Reads the next string field of the payload without copying it.
+/// @param str Set to the null terminated string, inside the frame's buffer.
+/// @param len Set to the length of the string, may be NULL.
+/// @return 0 on success, 1 if the payload is malformed.
+int frame_get_string(Frame *frame, const char **str, size_t *len);
+
+/// Fills in the payload length of the header. Done by frame_send, only needed
+/// before writing frame->data some other way.
+/// @param frame Frame whose payload is complete.
+void frame_seal(Frame *frame);
+
+/// Starts receiving a frame: copies in its header and makes room for its
+/// payload, which the caller then reads into frame->data after the header.
+/// @param header Header of the frame, already validated.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int frame_prepare(Frame *frame, const FrameHeader *header);
+
+/// Writes a whole frame to a file descriptor. Frames of up to PIPE_BUF bytes
+/// are written atomically to a pipe.
+/// @return 0 on success, 1 on error.
+int frame_send(int fd, Frame *frame);
+
+/// Writes a whole frame to a socket or non-blocking file descriptor, giving
+/// the reader up to timeout_ms to make room for it.
+/// @return 0 on success, 1 on timeout, -1 on error.
+int frame_send_within(int fd, Frame *frame, int timeout_ms);
+
+/// Reads a whole frame from a file descriptor into a reusable frame.
+/// @param intr Same as in read_all.
+/// @return 1 on success, 0 on end of file, -1 on error or if the frame is
+/// malformed.
+int frame_recv(int fd, Frame *frame, int *intr);
+
+/// Reads what a non-blocking file descriptor holds of a frame, so a frame
+/// that arrives in pieces is put together over several calls instead of
+/// waiting for the rest of it.
+/// @param frame Frame being received, kept between calls.
+/// @param received Bytes of the frame received so far, 0 to start a new one.
+/// Back to 0 once the frame is complete.
+/// @return 1 once the frame is complete, 2 if the rest of it has not arrived
+/// yet, 0 on end of file before a new frame, -1 on error or if the frame is
+/// malformed.
+int frame_recv_some(int fd, Frame *frame, size_t *received);
+
 #endif // COMMON_PROTOCOL_H
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE // syscall, for futexes
+#include "ring.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK ((uint64_t)RING_CAPACITY - 1)
+
+// Copies n bytes into the ring at position pos, wrapping around its end
+static void ring_write(Ring *ring, uint64_t pos, const char *src, size_t n) {
+  size_t offset = (size_t)(pos & RING_MASK);
+  size_t first = n < RING_CAPACITY - offset ? n : RING_CAPACITY - offset;
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, src + first, n - first);
+}
+
+// Copies n bytes out of the ring from position pos, wrapping around its end
+static void ring_read(Ring *ring, uint64_t pos, char *dest, size_t n) {
+  size_t offset = (size_t)(pos & RING_MASK);
+  size_t first = n < RING_CAPACITY - offset ? n : RING_CAPACITY - offset;
+  memcpy(dest, ring->data + offset, first);
+  memcpy(dest + first, ring->data, n - first);
+}
+
+int ring_put(Ring *ring, Frame *frame) {
+  frame_seal(frame);
+  if (frame->size > RING_CAPACITY) {
+    return -1;
+  }
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (RING_CAPACITY - (head - tail) < frame->size) {
+    return 1;
+  }
+
+  ring_write(ring, head, frame->data, frame->size);
+  atomic_store_explicit(&ring->head, head + frame->size, memory_order_release);
+  return 0;
+}
+
+int ring_put_or_wait(Ring *ring, Frame *frame) {
+  int result = ring_put(ring, frame);
+  if (result != 1) {
+    return result;
+  }
+
+  // Sequentially consistent like ring_prepare_sleep: either the consumer
+  // sees room_wanted after taking a frame out, or the room is seen here
+  atomic_store(&ring->room_wanted, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  result = ring_put(ring, frame);
+  if (result != 1) {
+    atomic_store(&ring->room_wanted, 0);
+  }
+  return result;
+}
+
+int ring_get(Ring *ring, Frame *frame) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail) {
+    return 0;
+  }
+
+  // Frames are published whole, so a short one means a corrupted ring
+  FrameHeader header;
+  if (head - tail < sizeof(header)) {
+    return -1;
+  }
+  ring_read(ring, tail, (char *)&header, sizeof(header));
+  if (header.version != PROTOCOL_VERSION ||
+      header.payload_len > MAX_FRAME_PAYLOAD ||
+      head - tail < sizeof(header) + header.payload_len ||
+      frame_prepare(frame, &header) != 0) {
+    return -1;
+  }
+
+  ring_read(ring, tail + sizeof(header), frame->data + sizeof(header),
+            header.payload_len);
+  atomic_store_explicit(&ring->tail, tail + frame->size, memory_order_release);
+  return 1;
+}
+
+int ring_empty(Ring *ring) {
+  return atomic_load(&ring->head) == atomic_load(&ring->tail);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+int ring_spin(Ring *ring) {
+  // With a single CPU the other side cannot run while this one spins
+  static _Atomic int cpus = 0;
+  if (cpus == 0) {
+    cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (cpus < 2) {
+    return !ring_empty(ring);
+  }
+
+  uint64_t deadline = now_ns() + RING_SPIN_NS;
+  do {
+    // Only look at the clock every so often
+    for (int i = 0; i < 64; i++) {
+      if (!ring_empty(ring)) {
+        return 1;
+      }
+    }
+  } while (now_ns() < deadline);
+  return 0;
+}
+
+int ring_prepare_sleep(Ring *ring) {
+  // Sequentially consistent: either the producer sees waiting after
+  // publishing its frame, or the frame is seen here
+  atomic_store(&ring->waiting, 1);
+  if (!ring_empty(ring)) {
+    atomic_store(&ring->waiting, 0);
+    return 0;
+  }
+  return 1;
+}
+
+int ring_wake_needed(Ring *ring) {
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&ring->waiting, memory_order_relaxed) &&
+         atomic_exchange(&ring->waiting, 0) == 1;
+}
+
+void ring_sleep(Ring *ring, int timeout_ms) {
+  struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  // Returns at once if the producer cleared waiting in the meantime
+  syscall(SYS_futex, (uint32_t *)&ring->waiting, FUTEX_WAIT, 1, &timeout,
+          NULL, 0);
+}
+
+void ring_wake(Ring *ring) {
+  atomic_store(&ring->waiting, 0);
+  syscall(SYS_futex, (uint32_t *)&ring->waiting, FUTEX_WAKE, INT_MAX, NULL,
+          NULL, 0);
+}
+
+int ring_room_needed(Ring *ring) {
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(&ring->room_wanted, memory_order_relaxed) &&
+         atomic_exchange(&ring->room_wanted, 0) == 1;
+}
+
+void ring_wait_room(Ring *ring, int timeout_ms) {
+  struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  // Returns at once if the consumer cleared room_wanted in the meantime
+  syscall(SYS_futex, (uint32_t *)&ring->room_wanted, FUTEX_WAIT, 1, &timeout,
+          NULL, 0);
+}
+
+void ring_wake_room(Ring *ring) {
+  syscall(SYS_futex, (uint32_t *)&ring->room_wanted, FUTEX_WAKE, INT_MAX,
+          NULL, NULL, 0);
+}
@@ -0,0 +1,95 @@
+#ifndef COMMON_RING_H
+#define COMMON_RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Bytes of frames a ring holds. A power of two large enough for the largest
+// frame, so every frame fits once the consumer catches up
+#define RING_CAPACITY (2u << 20)
+
+// How long a side spins on an empty ring before it goes to sleep
+#define RING_SPIN_NS 50000
+
+/// Single-producer, single-consumer queue of frames in shared memory. The
+/// producer only writes head and the consumer only writes tail; both count
+/// bytes since the ring was created, so head - tail is the number of bytes in
+/// the ring. waiting is set by a consumer about to sleep and cleared by the
+/// producer that wakes it, and doubles as a futex word. room_wanted is the
+/// same for a producer that found the ring full, cleared by the consumer.
+typedef struct {
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) _Atomic uint32_t waiting;
+  _Alignas(64) _Atomic uint32_t room_wanted;
+  _Alignas(64) char data[RING_CAPACITY];
+} Ring;
+
+/// Memory shared by a client and the server for one session. The client
+/// creates it and hands its name over in CONNECT.
+typedef struct {
+  Ring requests;      // client -> server
+  Ring responses;     // server -> client
+  Ring notifications; // server -> client
+  _Atomic uint32_t closed; // set by the server when the session ends
+} RingSession;
+
+/// Appends a frame to the ring, without blocking.
+/// @return 0 on success, 1 if the ring is full for now, -1 if the frame is
+/// larger than the ring.
+int ring_put(Ring *ring, Frame *frame);
+
+/// Same as ring_put, except that if the ring is full the consumer is asked to
+/// signal once it makes room (see ring_room_needed), so the producer can wait
+/// for that instead of polling.
+/// @return 0 on success, 1 if the ring is full and the signal will come, -1
+/// if the frame is larger than the ring.
+int ring_put_or_wait(Ring *ring, Frame *frame);
+
+/// Takes the next frame out of the ring, without blocking.
+/// @return 1 on success, 0 if the ring is empty, -1 if the frame is malformed.
+int ring_get(Ring *ring, Frame *frame);
+
+/// @return 1 if the ring holds no frame, 0 otherwise.
+int ring_empty(Ring *ring);
+
+/// Spins for up to RING_SPIN_NS while the ring is empty.
+/// @return 1 if the ring is not empty, 0 otherwise.
+int ring_spin(Ring *ring);
+
+/// Marks the consumer as waiting, after checking one last time that the ring
+/// is empty. Once it returns 1 the producer wakes the consumer on its next
+/// frame.
+/// @return 1 if the consumer may sleep, 0 if a frame arrived meanwhile.
+int ring_prepare_sleep(Ring *ring);
+
+/// Called by the producer after ring_put.
+/// @return 1 if the consumer was waiting and must be woken, 0 otherwise.
+int ring_wake_needed(Ring *ring);
+
+/// Sleeps on the ring's futex after ring_prepare_sleep returned 1.
+/// @param timeout_ms Longest time to sleep, so the caller can check whether
+/// the other side is still there.
+void ring_sleep(Ring *ring, int timeout_ms);
+
+/// Wakes a consumer sleeping in ring_sleep. Also used to wake it when the
+/// session is closed.
+void ring_wake(Ring *ring);
+
+/// Called by the consumer after ring_get.
+/// @return 1 if the producer waits for room and must be signalled, 0
+/// otherwise.
+int ring_room_needed(Ring *ring);
+
+/// Sleeps on the ring's room futex after ring_put_or_wait returned 1.
+/// @param timeout_ms Longest time to sleep, so the caller can check whether
+/// the other side is still there.
+void ring_wait_room(Ring *ring, int timeout_ms);
+
+/// Wakes a producer sleeping in ring_wait_room, once ring_room_needed
+/// returned 1.
+void ring_wake_room(Ring *ring);
+
+#endif // COMMON_RING_H
@@ -0,0 +1,82 @@
+#include "batch.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define INDEX_SIZE (2 * MAX_BATCH_KEYS)
+
+static size_t hash_key(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key != '\0'; key++) {
+    h ^= (unsigned char)*key;
+    h *= 16777619u;
+  }
+  return h % INDEX_SIZE;
+}
+
+// Finds the entry of a key, creating it if needed.
+// @param created Set to 1 if the entry did not exist.
+// @return Index of the entry.
+static size_t find_entry(WriteBatch *batch, const char *key, int *created) {
+  size_t slot = hash_key(key);
+  while (batch->index[slot] != -1) {
+    size_t entry = (size_t)batch->index[slot];
+    if (strcmp(batch->entries[entry].key, key) == 0) {
+      *created = 0;
+      return entry;
+    }
+    slot = (slot + 1) % INDEX_SIZE;
+  }
+
+  size_t entry = batch->num_entries++;
+  strcpy(batch->entries[entry].key, key);
+  batch->index[slot] = (int)entry;
+  *created = 1;
+  return entry;
+}
+
+void batch_clear(WriteBatch *batch) {
+  batch->num_entries = 0;
+  batch->num_deletes = 0;
+  batch->num_commands = 0;
+  memset(batch->index, -1, sizeof(batch->index));
+}
+
+int batch_has_room(const WriteBatch *batch, size_t num_keys) {
+  return batch->num_entries + num_keys <= MAX_BATCH_KEYS &&
+         batch->num_deletes + num_keys <= MAX_BATCH_KEYS;
+}
+
+void batch_add_write(WriteBatch *batch, size_t num_pairs,
+                     char keys[][MAX_STRING_SIZE],
+                     char values[][MAX_STRING_SIZE]) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    int created;
+    BatchEntry *entry = &batch->entries[find_entry(batch, keys[i], &created)];
+    strcpy(entry->value, values[i]);
+    entry->deleted = 0;
+  }
+  batch->num_commands++;
+}
+
+void batch_add_delete(WriteBatch *batch, size_t num_keys,
+                      char keys[][MAX_STRING_SIZE]) {
+  for (size_t i = 0; i < num_keys; i++) {
+    int created;
+    size_t index = find_entry(batch, keys[i], &created);
+    BatchEntry *entry = &batch->entries[index];
+
+    BatchDelete *delete = &batch->deletes[batch->num_deletes++];
+    delete->entry = index;
+    delete->command = batch->num_commands;
+    if (created) {
+      delete->state = BATCH_KEY_UNKNOWN;
+    } else {
+      delete->state = entry->deleted ? BATCH_KEY_MISSING : BATCH_KEY_PRESENT;
+    }
+
+    entry->value[0] = '\0';
+    entry->deleted = 1;
+  }
+  batch->num_commands++;
+}
@@ -0,0 +1,69 @@
+#ifndef KVS_BATCH_H
+#define KVS_BATCH_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+#define MAX_BATCH_KEYS 1024
+
+/// Whether a key existed in the table when a DELETE of the batch removed it.
+enum BatchKeyState {
+  BATCH_KEY_UNKNOWN, // first mutation of the key, resolved against the table
+  BATCH_KEY_PRESENT,
+  BATCH_KEY_MISSING
+};
+
+/// Final state of a key after all the combined mutations.
+typedef struct BatchEntry {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  int deleted;
+} BatchEntry;
+
+/// A key of a DELETE command, kept so the KVSMISSING output is the same as if
+/// the commands had been run one by one.
+typedef struct BatchDelete {
+  size_t entry;   // index of the key in entries
+  size_t command; // DELETE command the key belongs to
+  enum BatchKeyState state;
+} BatchDelete;
+
+/// Consecutive WRITE/DELETE commands of a job, merged per key so they can be
+/// applied under a single lock acquisition (the last writer of a key wins).
+typedef struct WriteBatch {
+  size_t num_entries;
+  BatchEntry entries[MAX_BATCH_KEYS];
+  int index[2 * MAX_BATCH_KEYS]; // open addressing on the keys, -1 if empty
+  size_t num_deletes;
+  BatchDelete deletes[MAX_BATCH_KEYS];
+  size_t num_commands;
+} WriteBatch;
+
+/// Empties a batch.
+/// @param batch Batch to be cleared.
+void batch_clear(WriteBatch *batch);
+
+/// Checks if a command with the given number of keys fits in the batch.
+/// @param batch The batch.
+/// @param num_keys Number of keys of the command.
+/// @return 1 if it fits, 0 if the batch must be applied first.
+int batch_has_room(const WriteBatch *batch, size_t num_keys);
+
+/// Adds a WRITE command to the batch. The batch must have room for it.
+/// @param batch The batch.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+void batch_add_write(WriteBatch *batch, size_t num_pairs,
+                     char keys[][MAX_STRING_SIZE],
+                     char values[][MAX_STRING_SIZE]);
+
+/// Adds a DELETE command to the batch. The batch must have room for it.
+/// @param batch The batch.
+/// @param num_keys Number of keys being deleted.
+/// @param keys Array of keys' strings.
+void batch_add_delete(WriteBatch *batch, size_t num_keys,
+                      char keys[][MAX_STRING_SIZE]);
+
+#endif // KVS_BATCH_H
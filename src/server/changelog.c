@@ -0,0 +1,135 @@
+#include "changelog.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHANGELOG_MASK ((uint64_t)CHANGELOG_CAPACITY - 1)
+
+static struct {
+  char *data;        // CHANGELOG_CAPACITY bytes, circular
+  uint64_t *offsets; // position of change seq at seq % CHANGELOG_MAX_CHANGES
+  uint64_t head;     // position where the next change goes
+  uint64_t tail;     // position of the oldest change
+  uint64_t oldest;   // sequence number of the oldest change
+  uint64_t next;     // sequence number of the next change
+  pthread_mutex_t lock;
+} changelog = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Positions only grow: the byte at position pos is at pos & CHANGELOG_MASK
+static void log_write(uint64_t pos, const void *src, size_t n) {
+  size_t offset = (size_t)(pos & CHANGELOG_MASK);
+  size_t first = n < CHANGELOG_CAPACITY - offset ? n : CHANGELOG_CAPACITY - offset;
+  memcpy(changelog.data + offset, src, first);
+  memcpy(changelog.data, (const char *)src + first, n - first);
+}
+
+static void log_read(uint64_t pos, char *dest, size_t n) {
+  size_t offset = (size_t)(pos & CHANGELOG_MASK);
+  size_t first = n < CHANGELOG_CAPACITY - offset ? n : CHANGELOG_CAPACITY - offset;
+  memcpy(dest, changelog.data + offset, first);
+  memcpy(dest + first, changelog.data, n - first);
+}
+
+// Position where a retained change ends, which is where the next one starts
+static uint64_t change_end(uint64_t seq) {
+  return seq + 1 < changelog.next
+             ? changelog.offsets[(seq + 1) % CHANGELOG_MAX_CHANGES]
+             : changelog.head;
+}
+
+int changelog_init() {
+  changelog.data = malloc(CHANGELOG_CAPACITY);
+  changelog.offsets = malloc(CHANGELOG_MAX_CHANGES * sizeof(uint64_t));
+  if (changelog.data == NULL || changelog.offsets == NULL) {
+    changelog_terminate();
+    return 1;
+  }
+  changelog.head = 0;
+  changelog.tail = 0;
+  changelog.oldest = 1;
+  changelog.next = 1;
+  return 0;
+}
+
+void changelog_terminate() {
+  free(changelog.data);
+  free(changelog.offsets);
+  changelog.data = NULL;
+  changelog.offsets = NULL;
+}
+
+uint64_t changelog_append(const char *key, const char *value) {
+  ChangeHeader header = {0, (uint32_t)strlen(key),
+                         value != NULL ? (uint32_t)strlen(value) : CHANGE_DELETED};
+  size_t size = sizeof(header) + header.key_len + 1;
+  if (value != NULL) {
+    size += header.value_len + 1;
+  }
+  if (changelog.data == NULL || size > CHANGELOG_CAPACITY) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&changelog.lock);
+  // Make room by dropping the oldest changes
+  while (changelog.head - changelog.tail + size > CHANGELOG_CAPACITY ||
+         changelog.next - changelog.oldest == CHANGELOG_MAX_CHANGES) {
+    changelog.tail = change_end(changelog.oldest);
+    changelog.oldest++;
+  }
+
+  header.seq = changelog.next++;
+  uint64_t pos = changelog.head;
+  changelog.offsets[header.seq % CHANGELOG_MAX_CHANGES] = pos;
+  log_write(pos, &header, sizeof(header));
+  pos += sizeof(header);
+  log_write(pos, key, header.key_len + 1);
+  pos += header.key_len + 1;
+  if (value != NULL) {
+    log_write(pos, value, header.value_len + 1);
+    pos += header.value_len + 1;
+  }
+  changelog.head = pos;
+  pthread_mutex_unlock(&changelog.lock);
+  return header.seq;
+}
+
+int changelog_read(uint64_t from, size_t max_changes, char **buf, size_t *size,
+                   size_t *count, uint64_t *oldest, uint64_t *next) {
+  pthread_mutex_lock(&changelog.lock);
+  *oldest = changelog.oldest;
+  if (from < changelog.oldest) {
+    from = changelog.oldest;
+  }
+  uint64_t start = from < changelog.next
+                       ? changelog.offsets[from % CHANGELOG_MAX_CHANGES]
+                       : changelog.head;
+
+  // A change larger than the buffer would never be read, holding back every
+  // consumer, so the buffer grows to fit it
+  if (max_changes > 0 && from < changelog.next &&
+      change_end(from) - start > *size) {
+    size_t needed = (size_t)(change_end(from) - start);
+    char *grown = realloc(*buf, needed);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&changelog.lock);
+      return 1;
+    }
+    *buf = grown;
+    *size = needed;
+  }
+
+  // Changes are contiguous, so find where the last one that fits ends and
+  // copy them all at once
+  *count = 0;
+  uint64_t end = start;
+  while (*count < max_changes && from + *count < changelog.next &&
+         change_end(from + *count) - start <= *size) {
+    end = change_end(from + *count);
+    (*count)++;
+  }
+  *next = *count > 0 ? from + *count : changelog.next;
+  log_read(start, *buf, (size_t)(end - start));
+  pthread_mutex_unlock(&changelog.lock);
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef KVS_CHANGELOG_H
+#define KVS_CHANGELOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANGELOG_CAPACITY (1 << 24)    // bytes of changes retained
+#define CHANGELOG_MAX_CHANGES (1 << 18) // changes retained
+#define CHANGE_DELETED UINT32_MAX       // value_len of a delete
+
+/// Ordered log of every change applied to the table, so consumers that were
+/// away (unlike subscribers, who are only told about changes while they are
+/// connected) can catch up from the last change they saw. Each change gets
+/// the next sequence number, starting at 1. Changes are kept back to back in
+/// a circular buffer, and the oldest ones are dropped once it is full, so a
+/// consumer that falls too far behind sees a gap in the sequence numbers.
+
+/// Header of a change in the log, followed by the key and then the value,
+/// each ending in a '\0' that is not counted in its length. A delete has
+/// value_len CHANGE_DELETED and no value.
+typedef struct {
+  uint64_t seq;
+  uint32_t key_len;
+  uint32_t value_len;
+} ChangeHeader;
+
+/// Allocates the log.
+/// @return 0 if the log was initialized successfully, 1 otherwise.
+int changelog_init();
+
+/// Frees the log.
+void changelog_terminate();
+
+/// Appends a change. Called with the table write lock held, so changes are
+/// numbered in the order they are applied; only copies bytes.
+/// @param key Key that changed.
+/// @param value New value, or NULL if the key was deleted.
+/// @return Sequence number of the change, 0 if it is too large to be kept.
+uint64_t changelog_append(const char *key, const char *value);
+
+/// Copies consecutive changes out of the log, as a header followed by the
+/// key and value of each.
+/// @param from Sequence number of the first change wanted. Changes that were
+/// dropped are skipped: the copy starts at the oldest one retained.
+/// @param max_changes Maximum number of changes to copy.
+/// @param buf Buffer to copy them to, reallocated if the first change does
+/// not fit in it, so at least one is copied whenever there is one.
+/// @param size Size of *buf, updated if it grows: only whole changes are
+/// copied.
+/// @param count Set to the number of changes copied.
+/// @param oldest Set to the sequence number of the oldest change retained.
+/// @param next Set to the sequence number to continue from: the one after
+/// the last change copied, or the one the next change will get if none was.
+/// @return 0 on success, 1 if the buffer could not be grown.
+int changelog_read(uint64_t from, size_t max_changes, char **buf, size_t *size,
+                   size_t *count, uint64_t *oldest, uint64_t *next);
+
+#endif // KVS_CHANGELOG_H
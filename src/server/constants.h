@@ -1,4 +1,15 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
-#define MAX_NUMBER_SESSIONS 2
+#define MAX_NUMBER_SESSIONS 2 // default for --max-sessions
+#define SESSION_CHUNK_SIZE 64 // sessions allocated at a time
+#define NUM_SESSION_WORKERS 4 // threads serving client sessions
+#define RING_FRAMES_PER_TURN 32 // requests of a shared memory session per turn
+#define NOTIFY_DEADLINE_MS 500     // longest a subscriber may block a delivery
+#define RESPONSE_DEADLINE_MS 500   // longest a client may block a response
+#define PIPE_OPEN_DEADLINE_MS 1000 // how long a client has to open its FIFOs
+#define PIPE_OPEN_RETRY_MS 1       // how often its FIFOs are tried meanwhile
+#define CHANGES_BUFFER_SIZE (512 * 1024) // change log bytes per CHANGES response
+#define MAX_CHANGE_SIZE (MAX_FRAME_PAYLOAD - 64) // key and value bytes of a WRITE
+                                                 // pair, so it fits a CHANGES
+                                                 // response
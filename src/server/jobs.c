@@ -0,0 +1,511 @@
+#include "jobs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/common/hash.h"
+#include "vclock.h"
+
+#define SEEN_INITIAL_BUCKETS 64
+#define TIMERS_INITIAL_CAPACITY 16
+
+typedef struct SeenName {
+  char *name;
+  struct SeenName *next;
+} SeenName;
+
+// Names of every job already submitted, so a file reported both by the
+// initial scan and by inotify (or closed twice) only runs once.
+typedef struct SeenSet {
+  SeenName **buckets;
+  size_t num_buckets;
+  size_t count;
+} SeenSet;
+
+static struct {
+  char directory[MAX_JOB_FILE_NAME_SIZE];
+  Job *head;
+  Job *tail;
+  int closed;
+  size_t running; // jobs popped by a worker and not yet parked or finished
+  SeenSet seen;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+
+  int inotify_fd;
+  int watching;
+  pthread_t watcher;
+
+  // Parked jobs, as a binary min-heap on (wake_at, seq)
+  Job **timers;
+  size_t num_timers;
+  size_t timers_capacity;
+  uint64_t next_seq;
+  pthread_cond_t timers_changed;
+  int timer_running;
+  pthread_t timer;
+} queue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+           .not_empty = PTHREAD_COND_INITIALIZER,
+           .inotify_fd = -1};
+
+static int seen_grow(SeenSet *set) {
+  size_t num_buckets = set->num_buckets * 2;
+  SeenName **buckets = calloc(num_buckets, sizeof(SeenName *));
+  if (buckets == NULL) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < set->num_buckets; i++) {
+    SeenName *entry = set->buckets[i];
+    while (entry != NULL) {
+      SeenName *next = entry->next;
+      size_t index = hash_string(entry->name) % num_buckets;
+      entry->next = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+
+  free(set->buckets);
+  set->buckets = buckets;
+  set->num_buckets = num_buckets;
+  return 0;
+}
+
+// Inserts the name in the set.
+// @return 0 if the name was inserted, 1 if it was already there or on failure.
+static int seen_insert(SeenSet *set, const char *name) {
+  size_t index = hash_string(name) % set->num_buckets;
+  for (SeenName *entry = set->buckets[index]; entry != NULL;
+       entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      return 1;
+    }
+  }
+
+  if (set->count >= set->num_buckets && seen_grow(set) == 0) {
+    index = hash_string(name) % set->num_buckets;
+  }
+
+  SeenName *entry = malloc(sizeof(SeenName));
+  if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+    free(entry);
+    return 1;
+  }
+  entry->next = set->buckets[index];
+  set->buckets[index] = entry;
+  set->count++;
+  return 0;
+}
+
+static void seen_free(SeenSet *set) {
+  for (size_t i = 0; i < set->num_buckets; i++) {
+    SeenName *entry = set->buckets[i];
+    while (entry != NULL) {
+      SeenName *next = entry->next;
+      free(entry->name);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(set->buckets);
+  set->buckets = NULL;
+  set->num_buckets = 0;
+  set->count = 0;
+}
+
+// Checks the .job extension and builds the input and output paths.
+// @return 0 if the name is a valid job file, 1 otherwise.
+static int build_job(const char *name, Job *job) {
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name || strcmp(dot, ".job") != 0) {
+    return 1;
+  }
+
+  if (strlen(name) + strlen(queue.directory) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", queue.directory, name);
+    return 1;
+  }
+
+  strcpy(job->name, name);
+  strcpy(job->in_path, queue.directory);
+  strcat(job->in_path, "/");
+  strcat(job->in_path, name);
+  strcpy(job->out_path, job->in_path);
+  strcpy(strrchr(job->out_path, '.'), ".out");
+  job->in_fd = -1;
+  job->out_fd = -1;
+  job->file_backups = 0;
+  job->wait_ms = 0;
+  job->next = NULL;
+  return 0;
+}
+
+// Appends a job to the ready queue. Must hold queue.mutex.
+static void enqueue_locked(Job *job) {
+  job->next = NULL;
+  if (queue.tail == NULL) {
+    queue.head = job;
+  } else {
+    queue.tail->next = job;
+  }
+  queue.tail = job;
+  pthread_cond_signal(&queue.not_empty);
+}
+
+static int timer_before(const Job *a, const Job *b) {
+  return a->wake_at < b->wake_at ||
+         (a->wake_at == b->wake_at && a->seq < b->seq);
+}
+
+// Must hold queue.mutex.
+static int timers_push(Job *job) {
+  if (queue.num_timers == queue.timers_capacity) {
+    size_t capacity = queue.timers_capacity ? queue.timers_capacity * 2
+                                            : TIMERS_INITIAL_CAPACITY;
+    Job **timers = realloc(queue.timers, capacity * sizeof(Job *));
+    if (timers == NULL) {
+      return 1;
+    }
+    queue.timers = timers;
+    queue.timers_capacity = capacity;
+  }
+
+  size_t i = queue.num_timers++;
+  while (i > 0 && timer_before(job, queue.timers[(i - 1) / 2])) {
+    queue.timers[i] = queue.timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  queue.timers[i] = job;
+  return 0;
+}
+
+// Must hold queue.mutex and have at least one timer.
+static Job *timers_pop() {
+  Job *top = queue.timers[0];
+  Job *last = queue.timers[--queue.num_timers];
+
+  size_t i = 0;
+  while (2 * i + 1 < queue.num_timers) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < queue.num_timers &&
+        timer_before(queue.timers[child + 1], queue.timers[child])) {
+      child++;
+    }
+    if (!timer_before(queue.timers[child], last)) {
+      break;
+    }
+    queue.timers[i] = queue.timers[child];
+    i = child;
+  }
+  if (queue.num_timers > 0) {
+    queue.timers[i] = last;
+  }
+  return top;
+}
+
+// With simulated time, the timer advances the clock when every worker is
+// idle, so it must be told when that happens. Must hold queue.mutex.
+static void signal_if_idle_locked() {
+  if (vclock_is_virtual() && queue.running == 0 && queue.head == NULL) {
+    pthread_cond_signal(&queue.timers_changed);
+  }
+}
+
+// Moves parked jobs back to the ready queue as their deadlines expire.
+static void *timer_thread(void *arg) {
+  (void)arg;
+
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.timer_running) {
+    if (queue.num_timers == 0) {
+      pthread_cond_wait(&queue.timers_changed, &queue.mutex);
+      continue;
+    }
+
+    if (vclock_is_virtual()) {
+      // Simulated time only moves when nothing can run: then it jumps
+      // straight to the next deadline, so parked jobs still wake up in the
+      // same order they would in real time
+      if (queue.head != NULL || queue.running > 0) {
+        pthread_cond_wait(&queue.timers_changed, &queue.mutex);
+        continue;
+      }
+      vclock_advance_to(queue.timers[0]->wake_at);
+    }
+
+    uint64_t now = vclock_now_ms();
+    if (queue.timers[0]->wake_at > now) {
+      uint64_t wake_at = queue.timers[0]->wake_at;
+      struct timespec deadline = {(time_t)(wake_at / 1000),
+                                  (long)(wake_at % 1000) * 1000000};
+      pthread_cond_timedwait(&queue.timers_changed, &queue.mutex, &deadline);
+      continue;
+    }
+
+    while (queue.num_timers > 0 && queue.timers[0]->wake_at <= now) {
+      enqueue_locked(timers_pop());
+    }
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return NULL;
+}
+
+int jobs_init(const char *directory) {
+  if (strlen(directory) + 1 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "Jobs directory path too long: %s\n", directory);
+    return 1;
+  }
+  strcpy(queue.directory, directory);
+
+  queue.seen.buckets = calloc(SEEN_INITIAL_BUCKETS, sizeof(SeenName *));
+  if (queue.seen.buckets == NULL) {
+    fprintf(stderr, "Failed to allocate job queue\n");
+    return 1;
+  }
+  queue.seen.num_buckets = SEEN_INITIAL_BUCKETS;
+  queue.seen.count = 0;
+  queue.head = queue.tail = NULL;
+  queue.closed = 0;
+
+  // Deadlines are taken from CLOCK_MONOTONIC, so the timer must wait on it
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queue.timers_changed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  queue.timer_running = 1;
+  if (pthread_create(&queue.timer, NULL, timer_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to create timer thread\n");
+    queue.timer_running = 0;
+    return 1;
+  }
+  return 0;
+}
+
+int jobs_submit(const char *name) {
+  Job *job = malloc(sizeof(Job));
+  if (job == NULL) {
+    fprintf(stderr, "Failed to allocate job\n");
+    return 1;
+  }
+
+  if (build_job(name, job)) {
+    free(job);
+    return 1;
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+  if (queue.closed || seen_insert(&queue.seen, name)) {
+    pthread_mutex_unlock(&queue.mutex);
+    free(job);
+    return 1;
+  }
+
+  enqueue_locked(job);
+  pthread_mutex_unlock(&queue.mutex);
+  return 0;
+}
+
+int jobs_scan_directory() {
+  DIR *dir = opendir(queue.directory);
+  if (dir == NULL) {
+    fprintf(stderr, "Failed to open directory: %s\n", queue.directory);
+    return 1;
+  }
+
+  // A single readdir pass; the extension check and the hashed duplicate
+  // lookup keep this linear even for directories with thousands of files.
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    jobs_submit(entry->d_name);
+  }
+
+  if (closedir(dir) == -1) {
+    fprintf(stderr, "Failed to close directory\n");
+    return 1;
+  }
+  return 0;
+}
+
+static void *watch_thread(void *arg) {
+  (void)arg;
+
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t len = read(queue.inotify_fd, buffer, sizeof(buffer));
+    if (len == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // The descriptor is closed by jobs_terminate
+      break;
+    }
+    if (len == 0) {
+      break;
+    }
+
+    for (char *ptr = buffer; ptr < buffer + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+        jobs_submit(event->name);
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  return NULL;
+}
+
+int jobs_watch_start() {
+  queue.inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (queue.inotify_fd == -1) {
+    perror("inotify_init1");
+    return 1;
+  }
+
+  // IN_CLOSE_WRITE instead of IN_CREATE so half-written files are not picked
+  // up; IN_MOVED_TO covers the usual write-then-rename submission.
+  if (inotify_add_watch(queue.inotify_fd, queue.directory,
+                        IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    perror("inotify_add_watch");
+    close(queue.inotify_fd);
+    queue.inotify_fd = -1;
+    return 1;
+  }
+
+  if (pthread_create(&queue.watcher, NULL, watch_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to create watcher thread\n");
+    close(queue.inotify_fd);
+    queue.inotify_fd = -1;
+    return 1;
+  }
+  queue.watching = 1;
+  return 0;
+}
+
+void jobs_close() {
+  pthread_mutex_lock(&queue.mutex);
+  queue.closed = 1;
+  pthread_cond_broadcast(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+Job *jobs_pop() {
+  pthread_mutex_lock(&queue.mutex);
+  // Parked jobs will come back, so a closed queue is only done once they
+  // have all run to completion
+  while (queue.head == NULL &&
+         (!queue.closed || queue.num_timers > 0 || queue.running > 0)) {
+    pthread_cond_wait(&queue.not_empty, &queue.mutex);
+  }
+
+  Job *job = queue.head;
+  if (job != NULL) {
+    queue.head = job->next;
+    if (queue.head == NULL) {
+      queue.tail = NULL;
+    }
+    queue.running++;
+  }
+  if (job == NULL) {
+    // wake the other workers so they also see the queue is done
+    pthread_cond_broadcast(&queue.not_empty);
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return job;
+}
+
+void jobs_finish(Job *job) {
+  if (job->in_fd != -1) {
+    close(job->in_fd);
+    close(job->out_fd);
+  }
+  free(job);
+
+  pthread_mutex_lock(&queue.mutex);
+  queue.running--;
+  if (queue.closed && queue.running == 0 && queue.num_timers == 0) {
+    pthread_cond_broadcast(&queue.not_empty);
+  }
+  signal_if_idle_locked();
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+void jobs_park(Job *job) {
+  pthread_mutex_lock(&queue.mutex);
+  queue.running--;
+  job->wake_at = vclock_now_ms() + job->wait_ms;
+  job->seq = queue.next_seq++;
+  if (timers_push(job) != 0) {
+    // Could not park it: keep it runnable rather than losing the job
+    fprintf(stderr, "Failed to park job %s\n", job->name);
+    enqueue_locked(job);
+  } else if (queue.timers[0] == job) {
+    pthread_cond_signal(&queue.timers_changed);
+  }
+  signal_if_idle_locked();
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+void jobs_terminate() {
+  jobs_close();
+
+  if (queue.watching) {
+    pthread_cancel(queue.watcher);
+    pthread_join(queue.watcher, NULL);
+    queue.watching = 0;
+  }
+  if (queue.inotify_fd != -1) {
+    close(queue.inotify_fd);
+    queue.inotify_fd = -1;
+  }
+
+  pthread_mutex_lock(&queue.mutex);
+  if (queue.timer_running) {
+    queue.timer_running = 0;
+    pthread_cond_signal(&queue.timers_changed);
+    pthread_mutex_unlock(&queue.mutex);
+    pthread_join(queue.timer, NULL);
+    pthread_mutex_lock(&queue.mutex);
+  }
+  while (queue.num_timers > 0) {
+    enqueue_locked(timers_pop());
+  }
+  free(queue.timers);
+  queue.timers = NULL;
+  queue.timers_capacity = 0;
+
+  while (queue.head != NULL) {
+    Job *next = queue.head->next;
+    if (queue.head->in_fd != -1) {
+      close(queue.head->in_fd);
+      close(queue.head->out_fd);
+    }
+    free(queue.head);
+    queue.head = next;
+  }
+  queue.tail = NULL;
+  seen_free(&queue.seen);
+  pthread_mutex_unlock(&queue.mutex);
+}
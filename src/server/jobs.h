@@ -0,0 +1,75 @@
+#ifndef KVS_JOBS_H
+#define KVS_JOBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+/// Outcome of running a job until it finishes or has to wait.
+enum JobStatus {
+  JOB_DONE = 0,   // reached the end of the job file
+  JOB_EXIT = 1,   // the process must exit (backup child)
+  JOB_WAITING = 2 // hit a WAIT, resume after job->wait_ms
+};
+
+/// A job is a resumable task: the parser state lives in the open input file
+/// descriptor, so a job parked on a WAIT continues from the next command when
+/// it is picked up again, possibly by another worker.
+typedef struct Job {
+  char name[MAX_JOB_FILE_NAME_SIZE];     // file name inside the jobs directory
+  char in_path[MAX_JOB_FILE_NAME_SIZE];  // <dir>/<name>.job
+  char out_path[MAX_JOB_FILE_NAME_SIZE]; // <dir>/<name>.out
+  int in_fd;                             // -1 until the job first runs
+  int out_fd;
+  size_t file_backups;  // backups done so far by this job
+  unsigned int wait_ms; // delay requested by the last WAIT
+  uint64_t wake_at;     // deadline while parked, in milliseconds
+  uint64_t seq;         // keeps parked jobs with the same deadline in order
+  struct Job *next;
+} Job;
+
+/// Initializes the job queue for the given jobs directory.
+/// @param directory Directory holding the .job files.
+/// @return 0 if the queue was initialized successfully, 1 otherwise.
+int jobs_init(const char *directory);
+
+/// Frees the job queue and stops the watcher thread, if any.
+void jobs_terminate();
+
+/// Starts watching the jobs directory with inotify. Every .job file that is
+/// created (closed after writing) or moved into the directory is enqueued.
+/// Must be called before jobs_scan_directory so no file slips in between.
+/// @return 0 if the watch was started successfully, 1 otherwise.
+int jobs_watch_start();
+
+/// Enqueues every .job file currently in the jobs directory.
+/// @return 0 if the directory was read successfully, 1 otherwise.
+int jobs_scan_directory();
+
+/// Enqueues a job file, unless a job with the same name was already
+/// submitted.
+/// @param name File name, relative to the jobs directory.
+/// @return 0 if the job was enqueued, 1 if it was a duplicate or invalid.
+int jobs_submit(const char *name);
+
+/// Marks the queue as closed: no more jobs will be submitted and workers
+/// return once the queue is drained.
+void jobs_close();
+
+/// Blocks until a job is available.
+/// @return The next job, to be handed back with jobs_finish or jobs_park, or
+/// NULL if the queue is closed and every job has finished.
+Job *jobs_pop();
+
+/// Closes the job files and frees a job returned by jobs_pop.
+/// @param job Job that finished running.
+void jobs_finish(Job *job);
+
+/// Parks a job on the timer queue for job->wait_ms milliseconds, after which
+/// it is put back in the queue. The calling worker is free to run other jobs
+/// in the meantime.
+/// @param job Job returned by jobs_pop that stopped with JOB_WAITING.
+void jobs_park(Job *job);
+
+#endif // KVS_JOBS_H
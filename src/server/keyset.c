@@ -0,0 +1,109 @@
+#include "keyset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/common/hash.h"
+
+static int keyset_grow(KeySet *set) {
+  size_t num_buckets =
+      set->num_buckets > 0 ? set->num_buckets * 2 : KEYSET_INITIAL_BUCKETS;
+  KeySetEntry **buckets = calloc(num_buckets, sizeof(KeySetEntry *));
+  if (buckets == NULL) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < set->num_buckets; i++) {
+    KeySetEntry *entry = set->buckets[i];
+    while (entry != NULL) {
+      KeySetEntry *next = entry->next;
+      size_t bucket = hash_string(entry->key) % num_buckets;
+      entry->next = buckets[bucket];
+      buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+
+  free(set->buckets);
+  set->buckets = buckets;
+  set->num_buckets = num_buckets;
+  return 0;
+}
+
+// Finds the link to the entry of a key, or to the end of its bucket
+static KeySetEntry **find_entry(const KeySet *set, const char *key) {
+  KeySetEntry **entry = &set->buckets[hash_string(key) % set->num_buckets];
+  while (*entry != NULL && strcmp((*entry)->key, key) != 0) {
+    entry = &(*entry)->next;
+  }
+  return entry;
+}
+
+int keyset_add(KeySet *set, const char *key) {
+  if (set->num_buckets > 0 && *find_entry(set, key) != NULL) {
+    return 1;
+  }
+
+  // Keep about one key per bucket
+  if (set->count >= set->num_buckets && keyset_grow(set) != 0) {
+    return -1;
+  }
+
+  KeySetEntry *entry = malloc(sizeof(KeySetEntry));
+  if (entry == NULL || (entry->key = strdup(key)) == NULL) {
+    free(entry);
+    return -1;
+  }
+  KeySetEntry **bucket = &set->buckets[hash_string(key) % set->num_buckets];
+  entry->next = *bucket;
+  *bucket = entry;
+  set->count++;
+  return 0;
+}
+
+int keyset_remove(KeySet *set, const char *key) {
+  if (set->num_buckets == 0) {
+    return 1;
+  }
+
+  KeySetEntry **link = find_entry(set, key);
+  KeySetEntry *entry = *link;
+  if (entry == NULL) {
+    return 1;
+  }
+  *link = entry->next;
+  free(entry->key);
+  free(entry);
+  set->count--;
+  return 0;
+}
+
+int keyset_contains(const KeySet *set, const char *key) {
+  return set->num_buckets > 0 && *find_entry(set, key) != NULL;
+}
+
+void keyset_for_each(const KeySet *set, void (*fn)(const char *, void *),
+                     void *arg) {
+  for (size_t i = 0; i < set->num_buckets; i++) {
+    for (KeySetEntry *entry = set->buckets[i]; entry != NULL;
+         entry = entry->next) {
+      fn(entry->key, arg);
+    }
+  }
+}
+
+void keyset_clear(KeySet *set) {
+  for (size_t i = 0; i < set->num_buckets; i++) {
+    KeySetEntry *entry = set->buckets[i];
+    while (entry != NULL) {
+      KeySetEntry *next = entry->next;
+      free(entry->key);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(set->buckets);
+  set->buckets = NULL;
+  set->num_buckets = 0;
+  set->count = 0;
+}
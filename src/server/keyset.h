@@ -0,0 +1,42 @@
+#ifndef KVS_KEYSET_H
+#define KVS_KEYSET_H
+
+#include <stddef.h>
+
+#define KEYSET_INITIAL_BUCKETS 16
+
+typedef struct KeySetEntry {
+  char *key;
+  struct KeySetEntry *next;
+} KeySetEntry;
+
+/// Set of strings, with chained buckets that double as it grows, so adding,
+/// removing and looking up a key take constant time on average and memory
+/// grows with the number of keys. A zeroed KeySet is an empty set.
+typedef struct {
+  KeySetEntry **buckets;
+  size_t num_buckets;
+  size_t count;
+} KeySet;
+
+/// Adds a copy of a key to the set.
+/// @return 0 if the key was added, 1 if it was already in the set, -1 if it
+/// could not be allocated.
+int keyset_add(KeySet *set, const char *key);
+
+/// Removes a key from the set.
+/// @return 0 if the key was removed, 1 if it was not in the set.
+int keyset_remove(KeySet *set, const char *key);
+
+/// @return 1 if the key is in the set, 0 otherwise.
+int keyset_contains(const KeySet *set, const char *key);
+
+/// Calls fn for every key in the set, in no particular order. fn must not
+/// change the set.
+void keyset_for_each(const KeySet *set, void (*fn)(const char *, void *),
+                     void *arg);
+
+/// Removes every key and frees the set's memory, leaving an empty set.
+void keyset_clear(KeySet *set);
+
+#endif // KVS_KEYSET_H
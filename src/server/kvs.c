@@ -1,10 +1,15 @@
 #include "kvs.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "reclaim.h"
 #include "string.h"
 
+// Number of lookups read_pairs keeps in flight
+#define READ_GROUP_SIZE 8
+
 // Hash function based on key initial.
 // @param key Lowercase alphabetical string.
 // @return hash.
@@ -26,6 +31,9 @@ struct HashTable *create_hash_table() {
     return NULL;
   for (int i = 0; i < TABLE_SIZE; i++) {
     ht->table[i] = NULL;
+    for (int l = 0; l < SKIP_LEVELS; l++) {
+      ht->skip[i][l] = NULL;
+    }
   }
   pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
@@ -33,108 +41,300 @@ struct HashTable *create_hash_table() {
 
 int write_pair(HashTable *ht, const char *key, const char *value) {
   int index = hash(key);
+  if (index < 0) {
+    return 1;
+  }
 
-  // Search for the key node
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
-
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // overwrite value
-      free(keyNode->value);
-      keyNode->value = strdup(value);
-      return 0;
-    }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
-  }
-  // Key not found, create a new key node
-  keyNode = malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);       // Allocate memory for the key
-  keyNode->value = strdup(value);   // Allocate memory for the value
-  keyNode->next = ht->table[index]; // Link to existing nodes
-  ht->table[index] = keyNode; // Place new key node at the start of the list
+  KeyNode *keyNode = create_pair_node(key, value);
+  if (keyNode == NULL) {
+    return 1;
+  }
+  // On overwrite the old value comes back in keyNode
+  reclaim_retire(link_pair_node(ht, index, keyNode));
   return 0;
 }
 
+// Number of skip links of a new node: each one with probability 1/4
+static int random_levels(void) {
+  static _Thread_local unsigned int seed = 0;
+  if (seed == 0) {
+    seed = (unsigned int)(uintptr_t)&seed | 1;
+  }
+  int levels = 0;
+  while (levels < SKIP_LEVELS && (rand_r(&seed) & 3) == 0) {
+    levels++;
+  }
+  return levels;
+}
+
+// Finds where a key is, or would be, in its bucket: links[l] is the skip
+// link at level l that points to the first node not before the key, and the
+// return value the link of the chain that does
+static KeyNode **find_links(HashTable *ht, int index, const char *key,
+                            KeyNode **links[SKIP_LEVELS]) {
+  KeyNode *node = NULL; // last node before the key, NULL for the bucket head
+  for (int l = SKIP_LEVELS - 1; l >= 0; l--) {
+    KeyNode **link = node != NULL ? &node->skip[l] : &ht->skip[index][l];
+    while (*link != NULL && strcmp((*link)->key, key) < 0) {
+      node = *link;
+      link = &node->skip[l];
+    }
+    if (links != NULL) {
+      links[l] = link;
+    }
+  }
+
+  KeyNode **link = node != NULL ? &node->next : &ht->table[index];
+  while (*link != NULL && strcmp((*link)->key, key) < 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Finds the node of a key in its bucket
+static KeyNode *find_node(HashTable *ht, int index, const char *key) {
+  KeyNode *node = *find_links(ht, index, key, NULL);
+  return node != NULL && strcmp(node->key, key) == 0 ? node : NULL;
+}
+
+KeyNode *create_pair_node(const char *key, const char *value) {
+  int levels = random_levels();
+  KeyNode *keyNode =
+      malloc(sizeof(KeyNode) + (size_t)levels * sizeof(KeyNode *));
+  if (keyNode == NULL) {
+    return NULL;
+  }
+  keyNode->key = strdup(key);
+  keyNode->value = strdup(value);
+  keyNode->next = NULL;
+  keyNode->levels = levels;
+  if (keyNode->key == NULL || keyNode->value == NULL) {
+    free_pair_node(keyNode);
+    return NULL;
+  }
+  return keyNode;
+}
+
+KeyNode *link_pair_node(HashTable *ht, int index, KeyNode *node) {
+  KeyNode **links[SKIP_LEVELS];
+  KeyNode **link = find_links(ht, index, node->key, links);
+  KeyNode *keyNode = *link;
+  if (keyNode != NULL && strcmp(keyNode->key, node->key) == 0) {
+    // overwrite value, the old one goes back with the unused node
+    char *value = keyNode->value;
+    keyNode->value = node->value;
+    node->value = value;
+    return node;
+  }
+
+  // In key order, on the chain and on each of the node's skip levels
+  node->next = *link;
+  *link = node;
+  for (int l = 0; l < node->levels; l++) {
+    node->skip[l] = *links[l];
+    *links[l] = node;
+  }
+  return NULL;
+}
+
+void free_pair_node(KeyNode *node) {
+  if (node == NULL) {
+    return;
+  }
+  free(node->key);
+  free(node->value);
+  free(node);
+}
+
 char *read_pair(HashTable *ht, const char *key) {
   int index = hash(key);
+  if (index < 0) {
+    return NULL;
+  }
 
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
-  char *value;
+  KeyNode *keyNode = find_node(ht, index, key);
+  return keyNode != NULL ? strdup(keyNode->value) : NULL;
+}
+
+void read_pairs(HashTable *ht, size_t num_keys, const char *const keys[],
+                char *values[]) {
+  for (size_t base = 0; base < num_keys; base += READ_GROUP_SIZE) {
+    size_t group = num_keys - base < READ_GROUP_SIZE ? num_keys - base
+                                                     : READ_GROUP_SIZE;
+    const char *const *group_keys = keys + base;
+    int index[READ_GROUP_SIZE];
+    int level[READ_GROUP_SIZE];       // skip level, -1 for the chain itself
+    KeyNode *before[READ_GROUP_SIZE]; // last node before the key, or NULL
+    KeyNode *ahead[READ_GROUP_SIZE];  // node the lookup compares next
+
+    // Hash every key of the group and start each lookup at the highest skip
+    // level its bucket uses, as find_links does
+    size_t active = 0;
+    for (size_t i = 0; i < group; i++) {
+      index[i] = hash(group_keys[i]);
+      values[base + i] = NULL;
+      level[i] = SKIP_LEVELS - 1;
+      before[i] = NULL;
+      if (index[i] < 0) {
+        continue;
+      }
+      while (level[i] >= 0 && ht->skip[index[i]][level[i]] == NULL) {
+        level[i]--;
+      }
+      active++;
+    }
+
+    // Move every lookup one link at a time, side by side: first load and
+    // prefetch the node each one compares next, then its key, then compare
+    // and either step forward or go down a level
+    while (active > 0) {
+      for (size_t i = 0; i < group; i++) {
+        if (index[i] < 0) {
+          continue;
+        }
+        KeyNode *node = before[i];
+        if (level[i] >= 0) {
+          ahead[i] = node != NULL ? node->skip[level[i]]
+                                  : ht->skip[index[i]][level[i]];
+        } else {
+          ahead[i] = node != NULL ? node->next : ht->table[index[i]];
+        }
+        if (ahead[i] != NULL) {
+          __builtin_prefetch(ahead[i]);
+        }
+      }
+      for (size_t i = 0; i < group; i++) {
+        if (index[i] >= 0 && ahead[i] != NULL) {
+          __builtin_prefetch(ahead[i]->key);
+        }
+      }
+
+      active = 0;
+      for (size_t i = 0; i < group; i++) {
+        if (index[i] < 0) {
+          continue;
+        }
+        int order = ahead[i] != NULL ? strcmp(ahead[i]->key, group_keys[i]) : 1;
+        if (order < 0) {
+          before[i] = ahead[i];
+        } else if (level[i] >= 0) {
+          level[i]--;
+        } else {
+          // Chains are sorted, so a lookup ends at the first key not before
+          if (order == 0) {
+            values[base + i] = strdup(ahead[i]->value);
+          }
+          index[i] = -1;
+          continue;
+        }
+        active++;
+      }
+    }
+  }
+}
+
+int scan_pairs(HashTable *ht, ScanCursor *cursor, size_t max_pairs,
+               char *keys[], char *values[], size_t *count) {
+  // The cursor only moves once the whole chunk is copied, so a chunk that
+  // runs out of memory is dropped and can be tried again
+  int bucket = cursor->bucket;
+  const char *after = cursor->key; // NULL at the start of a bucket
+  KeyNode *last = NULL;            // last node copied in the current bucket
+  size_t copied = 0;
+  int failed = 0;
+  while (!failed && copied < max_pairs && bucket < TABLE_SIZE) {
+    // Resume at the first key after the last one returned
+    KeyNode *keyNode = ht->table[bucket];
+    if (after != NULL) {
+      keyNode = *find_links(ht, bucket, after, NULL);
+      if (keyNode != NULL && strcmp(keyNode->key, after) == 0) {
+        keyNode = keyNode->next;
+      }
+    }
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      value = strdup(keyNode->value);
-      return value; // Return the value if found
+    for (; keyNode != NULL && copied < max_pairs; keyNode = keyNode->next) {
+      keys[copied] = strdup(keyNode->key);
+      values[copied] = strdup(keyNode->value);
+      failed = keys[copied] == NULL || values[copied] == NULL;
+      copied++;
+      if (failed) {
+        break;
+      }
+      last = keyNode;
+    }
+
+    if (!failed && keyNode == NULL) {
+      bucket++;
+      after = NULL;
+      last = NULL;
     }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
   }
 
-  return NULL; // Key not found
+  char *key = bucket == cursor->bucket ? cursor->key : NULL;
+  if (!failed && last != NULL) {
+    key = strdup(last->key);
+    failed = key == NULL;
+  }
+  if (failed) {
+    for (size_t i = 0; i < copied; i++) {
+      free(keys[i]);
+      free(values[i]);
+    }
+    return 1;
+  }
+
+  if (key != cursor->key) {
+    free(cursor->key);
+  }
+  cursor->bucket = bucket;
+  cursor->key = key;
+  *count = copied;
+  return 0;
 }
 
 int check_pair(HashTable *ht, const char *key) {
   int index = hash(key);
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
-  char *value;
-
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      return 0;
-    }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
+  if (index < 0) {
+    return 1;
   }
-  return 1;  // Key not found
+  return find_node(ht, index, key) != NULL ? 0 : 1;
 }
 
 int delete_pair(HashTable *ht, const char *key) {
   int index = hash(key);
+  if (index < 0) {
+    return 1;
+  }
 
   // Search for the key node
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *prevNode = NULL;
-
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // Key found; delete this node
-      if (prevNode == NULL) {
-        // Node to delete is the first node in the list
-        ht->table[index] =
-            keyNode->next; // Update the table to point to the next node
-      } else {
-        // Node to delete is not the first; bypass it
-        prevNode->next =
-            keyNode->next; // Link the previous node to the next node
-      }
-      // Free the memory allocated for the key and value
-      free(keyNode->key);
-      free(keyNode->value);
-      free(keyNode); // Free the key node itself
-      return 0;      // Exit the function
-    }
-    prevNode = keyNode;      // Move prevNode to current node
-    keyNode = keyNode->next; // Move to the next node
+  KeyNode **links[SKIP_LEVELS];
+  KeyNode **link = find_links(ht, index, key, links);
+  KeyNode *keyNode = *link;
+  if (keyNode == NULL || strcmp(keyNode->key, key) != 0) {
+    return 1;
   }
 
-  return 1;
+  // Bypass it on the chain and on each of its skip levels, where the links
+  // found point to it
+  *link = keyNode->next;
+  for (int l = 0; l < keyNode->levels; l++) {
+    *links[l] = keyNode->skip[l];
+  }
+  // The node is freed by the reclaimer once the lock is released
+  reclaim_retire(keyNode);
+  return 0;
 }
 
 void free_table(HashTable *ht) {
+  // Whole buckets are handed to the reclaimer instead of freed node by node
   for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i];
-    while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+    reclaim_retire_chain(ht->table[i]);
+    ht->table[i] = NULL;
+    for (int l = 0; l < SKIP_LEVELS; l++) {
+      ht->skip[i][l] = NULL;
     }
   }
+  reclaim_flush();
   pthread_rwlock_destroy(&ht->tablelock);
   free(ht);
 }
@@ -1,18 +1,36 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 #define TABLE_SIZE 26
+#define SKIP_LEVELS 16 // skip links over a bucket's chain, for 4^16 keys
 
 #include <pthread.h>
 #include <stddef.h>
 
+/// Pair in a bucket's chain, which is sorted by key. Besides next, a node has
+/// a random number of skip links (a quarter of the nodes one or more, a
+/// sixteenth two or more...), so a key is found in O(log n) by going down
+/// the levels of a skip list whose bottom level is the chain itself.
 typedef struct KeyNode {
   char *key;
   char *value;
   struct KeyNode *next;
+  int levels;             // number of skip links
+  struct KeyNode *skip[]; // skip[l]: next node with more than l links
 } KeyNode;
 
+/// Position of a scan over the table: a bucket and the last key returned in
+/// it. Scans are not snapshots, but since chains are sorted, a scan resumes
+/// right after that key wherever inserts and deletes moved it: pairs present
+/// for the whole scan are returned exactly once, and each chunk costs
+/// O(log n) to resume.
+typedef struct ScanCursor {
+  int bucket;
+  char *key; // NULL to start at the bucket's first pair
+} ScanCursor;
+
 typedef struct HashTable {
   KeyNode *table[TABLE_SIZE];
+  KeyNode *skip[TABLE_SIZE][SKIP_LEVELS]; // first node of each skip level
   pthread_rwlock_t tablelock;
 } HashTable;
 
@@ -29,19 +47,70 @@ int hash(const char *key);
 // @return 0 if successful.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
+/// Allocates a node for a key value pair, so that it can be linked into the
+/// table later without allocating while holding the table lock.
+/// @param key The key.
+/// @param value The value.
+/// @return The new node, NULL on failure.
+KeyNode *create_pair_node(const char *key, const char *value);
+
+/// Links a node created by create_pair_node into the table. If the key
+/// already exists, only the values are swapped: the table keeps the new value
+/// and the given node is left with the old one.
+/// @param ht The hash table.
+/// @param index Bucket of the key, as returned by hash.
+/// @param node Node to link.
+/// @return NULL if the node was inserted, otherwise the node holding the
+/// displaced value, to be freed with free_pair_node.
+KeyNode *link_pair_node(HashTable *ht, int index, KeyNode *node);
+
+/// Frees a node that is not linked in any table.
+/// @param node Node to be freed (may be NULL).
+void free_pair_node(KeyNode *node);
+
 // Reads the value of a given key.
 // @param ht The hash table.
 // @param key The key.
 // return the value if found, NULL otherwise.
 char *read_pair(HashTable *ht, const char *key);
 
+/// Reads the values of several keys at once. All keys are hashed first and
+/// the lookups go down the skip levels of their buckets in interleaved
+/// groups, prefetching the next node and key of every lookup, so their cache
+/// misses overlap instead of being paid one after the other.
+/// @param ht The hash table.
+/// @param num_keys Number of keys to read.
+/// @param keys Keys to read.
+/// @param values Filled with a copy of each value (to be freed by the
+/// caller), or NULL for keys that were not found.
+void read_pairs(HashTable *ht, size_t num_keys, const char *const keys[],
+                char *values[]);
+
+/// Copies up to max_pairs pairs starting at the cursor and moves the cursor
+/// past them. Meant to be called in chunks, so the table lock can be
+/// released between calls.
+/// @param ht The hash table.
+/// @param cursor Position to start from, {0, NULL} for the first chunk; its
+/// bucket is TABLE_SIZE once the whole table was scanned. Its key is
+/// allocated by scan_pairs, and freed once the scan is over (free it if the
+/// scan is abandoned).
+/// @param max_pairs Maximum number of pairs to copy.
+/// @param keys Filled with copies of the keys (to be freed by the caller).
+/// @param values Filled with copies of the values (to be freed by the caller).
+/// @param count Set to the number of pairs copied.
+/// @return 0 on success, 1 if out of memory, in which case nothing is copied
+/// and the cursor does not move.
+int scan_pairs(HashTable *ht, ScanCursor *cursor, size_t max_pairs,
+               char *keys[], char *values[], size_t *count);
+
 // Checks if a key exists in the table.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be checked.
 /// @return 0 if the key exists, 1 otherwise.
 int check_pair(HashTable *ht, const char *key);
 
-/// Deletes a pair from the table.
+/// Deletes a pair from the table. The node is retired, not freed: call
+/// reclaim_flush after releasing the table lock.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
@@ -1,9 +1,19 @@
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -11,153 +21,371 @@
 
 #include "constants.h"
 #include "../common/constants.h"
+#include "../common/io.h"
 #include "../common/protocol.h"
+#include "../common/ring.h"
+#include "batch.h"
+#include "changelog.h"
 #include "io.h"
+#include "jobs.h"
+#include "keyset.h"
+#include "notifier.h"
 #include "operations.h"
 #include "parser.h"
 #include "pthread.h"
-
-struct SharedData
-{
-  DIR *dir;
-  char *dir_name;
-  pthread_mutex_t directory_mutex;
-};
+#include "subscriptions.h"
+#include "vclock.h"
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t client_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-volatile sig_atomic_t sigusr1_received = 0;
+int epoll_fd = -1;              // session events, shared by the session workers
+int signal_fd = -1;             // SIGUSR1
+int server_pipe_fd = -1;        // CONNECT requests
+int server_pipe_writer_fd = -1; // keeps the server pipe from reporting EOF
+int listen_fd = -1;             // socket CONNECTs, with --socket
+int evict_fd = -1;              // counts evictions waiting for a worker
+int open_timer_fd = -1;         // ticks while CONNECTs wait for their FIFOs
+
+// epoll event ids other than session ids
+#define SERVER_PIPE_EVENT UINT32_MAX
+#define SIGNAL_EVENT (UINT32_MAX - 1)
+#define LISTEN_EVENT (UINT32_MAX - 2)
+#define EVICT_EVENT (UINT32_MAX - 3)
+#define OPEN_EVENT (UINT32_MAX - 4)
+
+// Sources of CONNECTs that are left unarmed while every session is in use
+#define PAUSED_SERVER_PIPE 1
+#define PAUSED_LISTEN 2
 
 size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
 size_t max_threads;        // Maximum allowed simultaneous threads
+int watch_jobs = 0;        // Keep watching jobs_directory for new .job files
+int combine_writes = 0;    // Merge consecutive WRITE/DELETE of a job
+NotifyOverflow notify_overflow = NOTIFY_COALESCE; // --notify-overflow
+
+static _Thread_local WriteBatch *worker_batch = NULL;
+static _Thread_local Frame notification_frame; // reused by deliver_notifications
 char *jobs_directory = NULL;
 char server_pipe_path[256] = "/tmp/server_";
+char server_socket_path[256] = ""; // <server_pipe_path>.sock, with --socket
 
+// The session's FIFOs stay open while it lives; req_fd is closed once the
+// client is gone, which also removes it from epoll. A session connected over
+// the socket has no FIFOs: its three fds are dups of the connection. Over
+// shared memory, frames go through rings and the socket only wakes the server
+// and tells it when the client is gone
 struct client_t
 {
   int id;
   char *req_pipe_path;
   char *resp_pipe_path;
   char *notif_pipe_path;
-  char *subscriptions[MAX_NUMBER_SUB][MAX_STRING_SIZE]
+  int req_fd;
+  int resp_fd;
+  int notif_fd;
+  pthread_mutex_t lock;      // held while one of its requests is handled
+  pthread_mutex_t send_lock; // keeps responses and notifications whole
+  pthread_cond_t sent;       // signaled when a frame is no longer being sent
+  int sending;               // a frame is being written, guarded by send_lock
+  int socket;                // connected over the socket
+  RingSession *shm;          // shared memory rings, if the client asked for them
+  KeySet subscriptions;      // keys and patterns, guarded by lock
+  int next_free;                       // next id in the free list
+  NotifyQueue notifications;           // waiting for a dispatcher thread
+  _Atomic uint64_t last_change; // last change queued, see notify_client
+  int evicted;              // dead or too slow, waiting to be ended
+  unsigned int generation;  // bumped by every session that uses the slot
+  Frame request;            // request being received, guarded by lock
+  size_t received;          // bytes of it received so far
+  Frame parked_response;    // waiting for room in the response ring
+  int parked;               // its requests wait until the response is sent
+};
+
+// A session to end because its client stopped taking notifications
+struct eviction
+{
+  int id;
+  unsigned int generation; // the slot may have been reused meanwhile
+  struct eviction *next;
 };
 
-struct client_t clients[MAX_NUMBER_SESSIONS];
+struct eviction *evictions = NULL;
+pthread_mutex_t evictions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sessions are allocated in chunks as their number grows, up to
+// max_sessions, and never move, so a session can be used without holding
+// client_thread_mutex. Ids of ended sessions are reused from a free list
+struct client_t **session_chunks = NULL;
+size_t max_sessions = MAX_NUMBER_SESSIONS; // --max-sessions
+int num_sessions = 0;   // ids handed out so far, every id in use is below it
+int free_sessions = -1; // head of the free list
+int paused_connects = 0; // PAUSED_* sources to re-arm once a session is freed
+
+// A FIFO CONNECT whose client has not opened its ends of the pipes yet. The
+// paths are copies, as the request they came in is reused
+struct pending_connect
+{
+  char *paths[3];
+  int fds[3]; // -1 until opened
+  uint32_t request_id;
+  long long deadline_ms;
+  int opened; // result of the last open_client_pipes
+  struct pending_connect *next;
+};
+
+struct pending_connect *pending_connects = NULL; // oldest first
+pthread_mutex_t pending_connects_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int current_client = 0;
 int client_id = 0;
 
-struct client_threads
+static struct client_t *session(int id)
 {
-  pthread_t thread;
-  int id;
-  int free;
-};
-
-struct client_threads client_threads[MAX_NUMBER_SESSIONS];
+  return &session_chunks[id / SESSION_CHUNK_SIZE][id % SESSION_CHUNK_SIZE];
+}
 
-void handle_sigusr1(int sig)
+// Puts a frame in one of the session's rings and wakes the client if it sleeps
+// on it. While the ring is full, the client is given up to timeout_ms to
+// catch up, sleeping until it takes a frame out, unless its socket shows it
+// is gone
+static int send_to_ring(int id, Ring *ring, Frame *frame, int timeout_ms)
 {
-  printf("Received SIGUSR1 in Handle\n");
-  sigusr1_received = 1;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int result;
+  while ((result = ring_put_or_wait(ring, frame)) == 1)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    struct pollfd peer = {session(id)->req_fd, 0, 0};
+    if (waited >= timeout_ms || poll(&peer, 1, 0) != 0)
+    {
+      return 1;
+    }
+    ring_wait_room(ring, (int)(timeout_ms - waited));
+  }
+
+  if (result == 0 && ring_wake_needed(ring))
+  {
+    ring_wake(ring);
+  }
+  return result == 0 ? 0 : 1;
 }
 
-int filter_job_files(const struct dirent *entry)
+// Sends a frame on the session's notification ring or pipe, or its response
+// pipe, with send_lock held. The session is marked as sending and send_lock
+// let go while the frame is written, so a client that stops reading only
+// holds up its own frames, for at most timeout_ms, and never end_session or
+// the evictions
+// @return 0 on success, 1 on timeout, -1 if the session is closed or broken
+static int send_frame(int id, Frame *frame, int notification, int timeout_ms)
 {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot != NULL && strcmp(dot, ".job") == 0)
+  while (session(id)->sending)
   {
-    return 1; // Keep this file (it has the .job extension)
+    pthread_cond_wait(&session(id)->sent, &session(id)->send_lock);
   }
-  return 0;
+  int fd = notification ? session(id)->notif_fd : session(id)->resp_fd;
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  session(id)->sending = 1;
+  pthread_mutex_unlock(&session(id)->send_lock);
+  int result = notification && session(id)->shm != NULL
+                   ? send_to_ring(id, &session(id)->shm->notifications, frame, timeout_ms)
+                   : frame_send_within(fd, frame, timeout_ms);
+  pthread_mutex_lock(&session(id)->send_lock);
+  session(id)->sending = 0;
+  pthread_cond_broadcast(&session(id)->sent);
+  return result;
+}
+
+// Bytes a notification takes in a NOTIFY payload: its delete flag, and each
+// string has its length and a '\0' on top of its bytes
+static size_t notification_size(const Notification *notification)
+{
+  size_t value_len = notification->value == NULL ? 0 : strlen(notification->value);
+  return sizeof(uint64_t) + 2 * (sizeof(uint32_t) + 1) + strlen(notification->key) + value_len;
 }
 
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,
-                       char *out_path)
+// Hands a session over to the session workers to be ended, with send_lock
+// held. Its client died or stopped taking notifications, and may never send
+// another request that would let its own handler notice
+static void request_eviction(int id, const char *reason)
 {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
-      strcmp(dot, ".job"))
+  if (session(id)->evicted)
   {
-    return 1;
+    return;
   }
+  session(id)->evicted = 1;
+  printf("Evicting client %d: %s\n", id, reason);
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE)
+  struct eviction *eviction = malloc(sizeof(struct eviction));
+  if (eviction == NULL)
   {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
-    return 1;
+    perror("Failed to allocate eviction");
+    return;
   }
+  eviction->id = id;
+  eviction->generation = session(id)->generation;
+
+  pthread_mutex_lock(&evictions_lock);
+  eviction->next = evictions;
+  evictions = eviction;
+  pthread_mutex_unlock(&evictions_lock);
 
-  strcpy(in_path, dir);
-  strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+  uint64_t one = 1;
+  if (write(evict_fd, &one, sizeof(one)) != sizeof(one))
+  {
+    perror("Failed to signal eviction");
+  }
+}
 
-  strcpy(out_path, in_path);
-  strcpy(strrchr(out_path, '.'), ".out");
+// Sends the pending notifications of a subscriber, from a dispatcher thread,
+// batched in as few NOTIFY frames as fit them. A subscriber that takes longer than
+// NOTIFY_DEADLINE_MS to make room for a frame, or whose pipe or connection
+// broke, is evicted, so it never holds a dispatcher for longer than that
+static int deliver_notifications(int id, Notification *notifications, size_t count)
+{
+  int result = 0;
+  pthread_mutex_lock(&session(id)->send_lock);
+  for (size_t first = 0; first < count && session(id)->notif_fd != -1 && !session(id)->evicted;)
+  {
+    size_t last = first + 1;
+    size_t payload = sizeof(uint64_t) + notification_size(&notifications[first]);
+    while (last < count && payload + notification_size(&notifications[last]) <= MAX_FRAME_PAYLOAD)
+    {
+      payload += notification_size(&notifications[last++]);
+    }
 
-  return 0;
+    int encoded = frame_init(&notification_frame, OP_CODE_NOTIFY, 0) == 0 &&
+                  frame_put_u64(&notification_frame, last - first) == 0;
+    for (size_t i = first; i < last && encoded; i++)
+    {
+      printf("Notifying client %d about key %s\n", id, notifications[i].key);
+      const char *value = notifications[i].value == NULL ? "" : notifications[i].value;
+      encoded = frame_put_u64(&notification_frame, notifications[i].value == NULL) == 0 &&
+                frame_put_string(&notification_frame, notifications[i].key, strlen(notifications[i].key)) == 0 &&
+                frame_put_string(&notification_frame, value, strlen(value)) == 0;
+    }
+    first = last;
+
+    if (!encoded)
+    {
+      fprintf(stderr, "Failed to encode notification\n");
+      result = 1;
+      continue;
+    }
+
+    int sent = send_frame(id, &notification_frame, 1, NOTIFY_DEADLINE_MS);
+    if (sent != 0)
+    {
+      fprintf(stderr, "Failed to write to notification pipe\n");
+      request_eviction(id, sent == 1 ? "notification deadline missed" : "notification pipe broken");
+      result = 1;
+    }
+  }
+  pthread_mutex_unlock(&session(id)->send_lock);
+  return result;
 }
 
-// Notify client about changes in subscribed keys
-void format_message(const char *key, const char *value, char *formatted_msg)
+// Evicts a subscriber whose queue overflowed, with --notify-overflow disconnect
+static void evict_subscriber(int id)
 {
-  // Cria buffers de tamanho fixo para key e value com padding.
-  char padded_key[MAX_STRING_SIZE] = {0};
-  char padded_value[MAX_STRING_SIZE + 1] = {0};
+  pthread_mutex_lock(&session(id)->send_lock);
+  request_eviction(id, "too many pending notifications");
+  pthread_mutex_unlock(&session(id)->send_lock);
+}
+
+// A change being fanned out to the subscribers of its key
+struct change
+{
+  const char *key;
+  const char *value; // NULL for a delete
+  uint64_t id; // tells a session it already got this change
+};
 
-  // Copia a key e adiciona padding.
-  snprintf(padded_key, MAX_STRING_SIZE + 1, "%-40s", key);
+// Queues a notification for one subscriber. The index keeps the session from
+// ending meanwhile
+static void notify_subscriber(int id, void *arg)
+{
+  struct change *change = arg;
 
-  // Copia o value e adiciona padding.
-  snprintf(padded_value, MAX_STRING_SIZE + 1, "%-40s", value);
+  // Subscribed to the key through more than one pattern. Another write to the
+  // session in between can only cause a duplicate, never a lost notification
+  if (atomic_exchange(&session(id)->last_change, change->id) == change->id)
+  {
+    return;
+  }
 
-  // Concatena key e value no formato correto.
-  snprintf(formatted_msg, 2 * (MAX_STRING_SIZE + 1), "%s%s", padded_key, padded_value);
+  int result = notifier_push(&session(id)->notifications, change->key, change->value);
+  if (result == 1)
+  {
+    printf("Notification queue of client %d overflowed\n", id);
+  }
+  else if (result == -1)
+  {
+    fprintf(stderr, "Failed to queue notification\n");
+  }
 }
 
+// Notify client about changes in subscribed keys. Only the subscribers of the
+// key are looked at, so a write nobody subscribes to costs one index probe,
+// and the notifications are delivered by the dispatcher threads, so a slow
+// subscriber never holds up the write. value is NULL for a delete
 int notify_client(const char *key, const char *value)
 {
-  char formatted_msg[2 * (MAX_STRING_SIZE + 1)] = {0};
-  format_message(key, value, formatted_msg);
+  static _Atomic uint64_t changes = 0;
+  struct change change = {key, value, atomic_fetch_add(&changes, 1) + 1};
+  subscriptions_for_each(key, notify_subscriber, &change);
+  return 0;
+}
 
-  for (int i = 0; i < MAX_NUMBER_SESSIONS; i++)
+// Applies the combined mutations of a job and notifies the final value of
+// each key
+static void flush_batch(WriteBatch *batch, int out_fd)
+{
+  if (batch->num_commands == 0)
   {
-    if (clients[i].id != -1 && clients[i].subscriptions[0][0] != '\0')
-    {
-      for (int j = 0; j < MAX_NUMBER_SUB; j++)
-      {
-        if (clients[i].subscriptions[j][0] != '\0' &&
-            strcmp(clients[i].subscriptions[j], key) == 0)
-        {
-          printf("Notifying client %d about key %s\n", i, key);
-
-          int notif_pipe_fd = open(clients[i].notif_pipe_path, O_WRONLY);
-          if (notif_pipe_fd == -1)
-          {
-            perror("Failed to open notification pipe");
-            return 1;
-          }
-          // Escreve a mensagem formatada no pipe.
-          if (write(notif_pipe_fd, formatted_msg, sizeof(formatted_msg)) == -1)
-          {
-            perror("Failed to write to notification pipe");
-            close(notif_pipe_fd);
-            return 1;
-          }
-          close(notif_pipe_fd);
-        }
-      }
-    }
+    return;
   }
-  return 0;
+
+  if (kvs_apply_batch(batch, out_fd))
+  {
+    write_str(STDERR_FILENO, "Failed to apply batch\n");
+  }
+
+  for (size_t i = 0; i < batch->num_entries; i++)
+  {
+    notify_client(batch->entries[i].key, batch->entries[i].deleted ? NULL : batch->entries[i].value);
+  }
+
+  batch_clear(batch);
 }
 
-static int run_job(int in_fd, int out_fd, char *filename)
+// Runs a job until it ends or reaches a WAIT. A waiting job is handed back
+// to the caller instead of sleeping, so it can be parked and resumed later
+static enum JobStatus run_job(Job *job)
 {
-  size_t file_backups = 0;
+  int in_fd = job->in_fd;
+  int out_fd = job->out_fd;
+
+  // Each worker keeps one batch; it is always flushed before run_job returns
+  WriteBatch *batch = NULL;
+  if (combine_writes)
+  {
+    if (worker_batch == NULL && (worker_batch = malloc(sizeof(WriteBatch))) != NULL)
+    {
+      batch_clear(worker_batch);
+    }
+    batch = worker_batch;
+  }
+
   while (1)
   {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
@@ -165,7 +393,17 @@ static int run_job(int in_fd, int out_fd, char *filename)
     unsigned int delay;
     size_t num_pairs;
 
-    switch (get_next(in_fd))
+    enum Command cmd = get_next(in_fd);
+
+    // Runs of WRITE/DELETE are combined; anything that can observe the table
+    // (or end the job) applies them first, so the output stays the same
+    if (batch != NULL && cmd != CMD_WRITE && cmd != CMD_DELETE &&
+        cmd != CMD_EMPTY && cmd != CMD_INVALID)
+    {
+      flush_batch(batch, out_fd);
+    }
+
+    switch (cmd)
     {
     case CMD_WRITE:
       num_pairs =
@@ -176,6 +414,16 @@ static int run_job(int in_fd, int out_fd, char *filename)
         continue;
       }
 
+      if (batch != NULL)
+      {
+        if (!batch_has_room(batch, num_pairs))
+        {
+          flush_batch(batch, out_fd);
+        }
+        batch_add_write(batch, num_pairs, keys, values);
+        break;
+      }
+
       if (kvs_write(num_pairs, keys, values))
       {
         write_str(STDERR_FILENO, "Failed to write pair\n");
@@ -215,6 +463,16 @@ static int run_job(int in_fd, int out_fd, char *filename)
         continue;
       }
 
+      if (batch != NULL)
+      {
+        if (!batch_has_room(batch, num_pairs))
+        {
+          flush_batch(batch, out_fd);
+        }
+        batch_add_delete(batch, num_pairs, keys);
+        break;
+      }
+
       if (kvs_delete(num_pairs, keys, out_fd))
       {
         write_str(STDERR_FILENO, "Failed to delete pair\n");
@@ -223,7 +481,7 @@ static int run_job(int in_fd, int out_fd, char *filename)
       // Notify clients about delete in subscribed keys
       for (size_t i = 0; i < num_pairs; i++)
       {
-        notify_client(keys[i], "DELETED");
+        notify_client(keys[i], NULL);
       }
 
       break;
@@ -232,6 +490,10 @@ static int run_job(int in_fd, int out_fd, char *filename)
       kvs_show(out_fd);
       break;
 
+    case CMD_SHOW_SORTED:
+      kvs_show_sorted(out_fd);
+      break;
+
     case CMD_WAIT:
       if (parse_wait(in_fd, &delay, NULL) == -1)
       {
@@ -242,7 +504,8 @@ static int run_job(int in_fd, int out_fd, char *filename)
       if (delay > 0)
       {
         printf("Waiting %d seconds\n", delay / 1000);
-        kvs_wait(delay);
+        job->wait_ms = delay;
+        return JOB_WAITING;
       }
       break;
 
@@ -257,7 +520,7 @@ static int run_job(int in_fd, int out_fd, char *filename)
         active_backups++;
       }
       pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
+      int aux = kvs_backup(++job->file_backups, job->name, jobs_directory);
 
       if (aux < 0)
       {
@@ -265,7 +528,7 @@ static int run_job(int in_fd, int out_fd, char *filename)
       }
       else if (aux == 1)
       {
-        return 1;
+        return JOB_EXIT;
       }
       break;
 
@@ -279,7 +542,7 @@ static int run_job(int in_fd, int out_fd, char *filename)
                 "  WRITE [(key,value)(key2,value2),...]\n"
                 "  READ [key,key2,...]\n"
                 "  DELETE [key,key2,...]\n"
-                "  SHOW\n"
+                "  SHOW [SORTED]\n"
                 "  WAIT <delay_ms>\n"
                 "  BACKUP\n" // Not implemented
                 "  HELP\n");
@@ -291,537 +554,1597 @@ static int run_job(int in_fd, int out_fd, char *filename)
 
     case EOC:
       printf("EOF\n");
-      return 0;
+      return JOB_DONE;
     }
   }
 }
 
-// frees arguments
+// Worker thread: runs jobs from the job queue until it is closed and drained
 static void *get_file(void *arguments)
 {
+  (void)arguments;
   block_sigusr1();
-  struct SharedData *thread_data = (struct SharedData *)arguments;
-  DIR *dir = thread_data->dir;
-  char *dir_name = thread_data->dir_name;
 
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0)
+  Job *job;
+  while ((job = jobs_pop()) != NULL)
   {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
-    return NULL;
-  }
-
-  struct dirent *entry;
-  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL)
-  {
-    if (entry_files(dir_name, entry, in_path, out_path))
-    {
-      continue;
-    }
-
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0)
+    // First run of this job: open its files. Resumed jobs keep theirs
+    if (job->in_fd == -1)
     {
-      fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-      return NULL;
-    }
-
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1)
-    {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
+      job->in_fd = open(job->in_path, O_RDONLY);
+      if (job->in_fd == -1)
+      {
+        write_str(STDERR_FILENO, "Failed to open input file: ");
+        write_str(STDERR_FILENO, job->in_path);
+        write_str(STDERR_FILENO, "\n");
+        jobs_finish(job);
+        continue;
+      }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1)
-    {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
+      job->out_fd = open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (job->out_fd == -1)
+      {
+        write_str(STDERR_FILENO, "Failed to open output file: ");
+        write_str(STDERR_FILENO, job->out_path);
+        write_str(STDERR_FILENO, "\n");
+        close(job->in_fd);
+        job->in_fd = -1;
+        jobs_finish(job);
+        continue;
+      }
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
-
-    if (out)
+    switch (run_job(job))
     {
-      if (closedir(dir) == -1)
-      {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
-      }
+    case JOB_WAITING:
+      jobs_park(job);
+      break;
 
+    case JOB_EXIT:
       exit(0);
-    }
 
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0)
-    {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
+    case JOB_DONE:
+      jobs_finish(job);
+      break;
     }
   }
 
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0)
+  free(worker_batch);
+  worker_batch = NULL;
+  frame_free(&notification_frame);
+
+  pthread_exit(NULL);
+}
+
+// Watches fd for a single readable event: EPOLLONESHOT hands each event to
+// one worker, and the fd is re-armed with EPOLL_CTL_MOD once it is handled, so
+// a session's requests are never handled by two workers at once. The low half
+// of event_id is the event, the high half the generation of a session
+static int watch_fd(int op, int fd, uint64_t event_id)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.u64 = event_id;
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1)
   {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-    return NULL;
+    perror("Failed to watch fd");
+    return 1;
   }
+  return 0;
+}
 
-  pthread_exit(NULL);
+// Re-arms a shared memory session whose request ring still holds requests
+// after its turn. The client does not ring its socket, but the socket is
+// writable, so the event is reported again at once, after those of the
+// sessions already waiting
+static int requeue_fd(int fd, uint64_t event_id)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLONESHOT;
+  event.data.u64 = event_id;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+  {
+    perror("Failed to watch fd");
+    return 1;
+  }
+  return 0;
 }
 
-// Register client
-int register_client(char *client_req_pipe_path, char *client_resp_pipe_path, char *client_notif_pipe_path)
+// Event of a session's request fd, which tells a late event of an evicted
+// session from one of the session that reused its slot
+static uint64_t session_event(int id)
 {
-  pthread_mutex_lock(&client_thread_mutex);
-  int allocated_thread = -1;
+  return (uint64_t)session(id)->generation << 32 | (uint32_t)id;
+}
 
-  // Find a free thread
-  while (allocated_thread == -1)
+static void close_client_pipes(int fds[3])
+{
+  for (int i = 0; i < 3; i++)
   {
-    for (int i = 0; i < MAX_NUMBER_SESSIONS; i++)
+    if (fds[i] != -1)
     {
-      if (client_threads[i].free)
-      {
-        client_threads[i].free = 0; // Mark thread as allocated
-        allocated_thread = i;
-        break;
-      }
+      close(fds[i]);
+      fds[i] = -1;
     }
+  }
+}
 
-    if (allocated_thread == -1)
+// Opens the client's FIFOs that are still closed (-1), once for the whole
+// session. The client opens its ends in the same order right after sending
+// CONNECT, so the opens rendezvous once per session instead of once per
+// message. A FIFO opens for writing without blocking only once its reader
+// has opened it, so the opens are retried by retry_connects instead of
+// waited on. The pipes stay non-blocking, so a worker only takes what has
+// arrived of a request, and a response or delivery can give up on a client
+// that stopped reading
+// @return 0 once all are open, 2 while the client has not opened its end of
+// one, 1 on error, with the pipes closed
+int open_client_pipes(const char *req_pipe_path, const char *resp_pipe_path,
+                      const char *notif_pipe_path, int fds[3])
+{
+  const char *paths[3] = {req_pipe_path, resp_pipe_path, notif_pipe_path};
+  for (int i = 0; i < 3; i++)
+  {
+    if (fds[i] != -1)
     {
-      pthread_mutex_unlock(&client_thread_mutex);
-      // printf("No free threads available. Waiting...\n");
-      sleep(1);
-      pthread_mutex_lock(&client_thread_mutex);
+      continue;
+    }
+    fds[i] = open(paths[i], (i == 0 ? O_RDONLY : O_WRONLY) | O_NONBLOCK);
+    if (fds[i] == -1)
+    {
+      if (i != 0 && errno == ENXIO)
+      {
+        return 2;
+      }
+      perror("Failed to open client pipe");
+      close_client_pipes(fds);
+      return 1;
     }
   }
+  return 0;
+}
 
-  // Register the client
-  clients[allocated_thread].id = allocated_thread;
-  clients[allocated_thread].req_pipe_path = strdup(client_req_pipe_path);
-  clients[allocated_thread].resp_pipe_path = strdup(client_resp_pipe_path);
-  clients[allocated_thread].notif_pipe_path = strdup(client_notif_pipe_path);
-  if (!clients[allocated_thread].req_pipe_path ||
-      !clients[allocated_thread].resp_pipe_path ||
-      !clients[allocated_thread].notif_pipe_path)
-  {
-    printf("Memory allocation failed for pipe paths.\n");
-    pthread_mutex_unlock(&client_thread_mutex);
-    return 1;
+// Allocates the chunk holding the next new session id
+static int grow_sessions(void)
+{
+  size_t chunk = (size_t)num_sessions / SESSION_CHUNK_SIZE;
+  if (session_chunks[chunk] != NULL)
+  {
+    return 0;
   }
 
-  printf("Client registered successfully on thread %d.\n", allocated_thread);
-  printf("Request pipe path: %s\n", clients[allocated_thread].req_pipe_path);
-  printf("Response pipe path: %s\n", clients[allocated_thread].resp_pipe_path);
-  printf("Notification pipe path: %s\n", clients[allocated_thread].notif_pipe_path);
-
-  if (!clients[allocated_thread].req_pipe_path || !clients[allocated_thread].resp_pipe_path || !clients[allocated_thread].notif_pipe_path)
+  struct client_t *sessions = calloc(SESSION_CHUNK_SIZE, sizeof(struct client_t));
+  if (sessions == NULL)
   {
-    printf("Memory allocation failed for pipe paths.\n");
-    pthread_mutex_unlock(&client_thread_mutex);
     return 1;
   }
-
-  pthread_mutex_unlock(&client_thread_mutex);
-  printf("Client registered successfully on thread %d.\n", allocated_thread);
-  return 0; // Success
+  for (int i = 0; i < SESSION_CHUNK_SIZE; i++)
+  {
+    sessions[i].id = -1;
+    sessions[i].req_fd = -1;
+    sessions[i].resp_fd = -1;
+    sessions[i].notif_fd = -1;
+    sessions[i].next_free = -1;
+    pthread_mutex_init(&sessions[i].lock, NULL);
+    pthread_mutex_init(&sessions[i].send_lock, NULL);
+    pthread_cond_init(&sessions[i].sent, NULL);
+    notify_queue_init(&sessions[i].notifications, (int)chunk * SESSION_CHUNK_SIZE + i);
+  }
+  session_chunks[chunk] = sessions;
+  return 0;
 }
 
-int send_response(const char *pipe_path, char op_code, char status)
+// Takes an id from the free list, or a new one while below max_sessions.
+// Called with client_thread_mutex held
+// @return The id, -1 if every session is in use
+static int allocate_session(void)
 {
-  if (!pipe_path)
+  if (free_sessions != -1)
   {
-    return -1;
+    int id = free_sessions;
+    free_sessions = session(id)->next_free;
+    return id;
   }
 
-  int fd = open(pipe_path, O_WRONLY);
-  if (fd == -1)
+  if ((size_t)num_sessions < max_sessions)
   {
-    perror("Failed to open response pipe");
-    return -1;
+    return grow_sessions() == 0 ? num_sessions++ : -1;
   }
-
-  char response[2] = {op_code, status};
-  ssize_t bytes_written = write(fd, response, sizeof(response));
-  close(fd);
-
-  return (bytes_written == sizeof(response)) ? 0 : -1;
+  return -1;
 }
 
-static void free_thread(int thread_id)
+// Tells whether a CONNECT may be taken from the server pipe or the socket.
+// With every session in use it is left unarmed instead, so CONNECTs queue in
+// it without holding a worker, until free_thread re-arms it
+// @return 1 if a session is available, 0 otherwise
+static int accepting_connects(int source)
 {
   pthread_mutex_lock(&client_thread_mutex);
-  client_threads[thread_id].free = 1; // Mark thread as free
+  int available = free_sessions != -1 || (size_t)num_sessions < max_sessions;
+  if (!available)
+  {
+    paused_connects |= source;
+  }
   pthread_mutex_unlock(&client_thread_mutex);
+  return available;
 }
 
-void clean_pipes(int thread_id)
+static void free_thread(int thread_id)
 {
   pthread_mutex_lock(&client_thread_mutex);
-
-  // Clean pipe paths
-  if (clients[thread_id].req_pipe_path)
+  session(thread_id)->next_free = free_sessions;
+  free_sessions = thread_id;
+  if (paused_connects & PAUSED_SERVER_PIPE)
+  {
+    watch_fd(EPOLL_CTL_MOD, server_pipe_fd, SERVER_PIPE_EVENT);
+  }
+  if (paused_connects & PAUSED_LISTEN)
   {
-    unlink(clients[thread_id].req_pipe_path);
-    free(clients[thread_id].req_pipe_path);
-    clients[thread_id].req_pipe_path = NULL;
+    watch_fd(EPOLL_CTL_MOD, listen_fd, LISTEN_EVENT);
   }
+  paused_connects = 0;
+  pthread_mutex_unlock(&client_thread_mutex);
+}
 
-  if (clients[thread_id].resp_pipe_path)
+// Register client; the paths are NULL for a client connected over the socket
+int register_client(const char *client_req_pipe_path, const char *client_resp_pipe_path, const char *client_notif_pipe_path, int fds[3], int *session_id)
+{
+  pthread_mutex_lock(&client_thread_mutex);
+  int allocated_thread = allocate_session();
+  if (allocated_thread == -1)
   {
-    unlink(clients[thread_id].resp_pipe_path);
-    free(clients[thread_id].resp_pipe_path);
-    clients[thread_id].resp_pipe_path = NULL;
+    printf("No session available.\n");
+    pthread_mutex_unlock(&client_thread_mutex);
+    return 1;
   }
 
-  if (clients[thread_id].notif_pipe_path)
+  // Register the client
+  session(allocated_thread)->evicted = 0;
+  session(allocated_thread)->generation++;
+  session(allocated_thread)->socket = client_req_pipe_path == NULL;
+  if (!session(allocated_thread)->socket)
   {
-    unlink(clients[thread_id].notif_pipe_path);
-    free(clients[thread_id].notif_pipe_path);
-    clients[thread_id].notif_pipe_path = NULL;
+    session(allocated_thread)->req_pipe_path = strdup(client_req_pipe_path);
+    session(allocated_thread)->resp_pipe_path = strdup(client_resp_pipe_path);
+    session(allocated_thread)->notif_pipe_path = strdup(client_notif_pipe_path);
+    if (!session(allocated_thread)->req_pipe_path ||
+        !session(allocated_thread)->resp_pipe_path ||
+        !session(allocated_thread)->notif_pipe_path)
+    {
+      printf("Memory allocation failed for pipe paths.\n");
+      free(session(allocated_thread)->req_pipe_path);
+      free(session(allocated_thread)->resp_pipe_path);
+      free(session(allocated_thread)->notif_pipe_path);
+      session(allocated_thread)->req_pipe_path = NULL;
+      session(allocated_thread)->resp_pipe_path = NULL;
+      session(allocated_thread)->notif_pipe_path = NULL;
+      pthread_mutex_unlock(&client_thread_mutex);
+      free_thread(allocated_thread);
+      return 1;
+    }
+
+    printf("Request pipe path: %s\n", session(allocated_thread)->req_pipe_path);
+    printf("Response pipe path: %s\n", session(allocated_thread)->resp_pipe_path);
+    printf("Notification pipe path: %s\n", session(allocated_thread)->notif_pipe_path);
   }
 
+  session(allocated_thread)->id = allocated_thread;
+  session(allocated_thread)->received = 0;
+  session(allocated_thread)->req_fd = fds[0];
+  session(allocated_thread)->resp_fd = fds[1];
+  session(allocated_thread)->notif_fd = fds[2];
+  *session_id = allocated_thread;
+
   pthread_mutex_unlock(&client_thread_mutex);
+  printf("Client registered successfully on thread %d.\n", allocated_thread);
+  return 0; // Success
 }
 
-void trim_char(char *str)
+// Sends a response frame, already holding its payload, if any, giving the
+// client up to RESPONSE_DEADLINE_MS to make room for it
+int send_response(int fd, Frame *response, int status)
 {
-  size_t str_value = strlen(str);
-  while (str_value > 0 && str[str_value - 1] == ' ')
+  if (fd == -1)
   {
-    str_value--;
-    str[str_value] = '\0';
+    return -1;
   }
+
+  frame_header(response)->status = (uint8_t)status;
+  return frame_send_within(fd, response, RESPONSE_DEADLINE_MS) == 0 ? 0 : -1;
 }
 
-int receive_request(const char *pipe_path, int client_id)
+// On a socket, responses and notifications share one stream, so a frame is
+// written whole by send_frame. A client that takes longer than
+// RESPONSE_DEADLINE_MS to make room for a response is evicted, so it never
+// holds a session worker for longer than that. Over shared memory, a
+// response that finds the ring full is kept in the session, which is parked:
+// the worker moves on, and the session's requests wait until the client makes
+// room and rings its socket
+static int send_session_response(int id, Frame *response, int status)
 {
-  if (!pipe_path)
+  pthread_mutex_lock(&session(id)->send_lock);
+  int result;
+  if (session(id)->shm != NULL)
   {
-    fprintf(stderr, "Invalid response pipe path\n");
-    return -1;
+    Ring *responses = &session(id)->shm->responses;
+    frame_header(response)->status = (uint8_t)status;
+    result = ring_put_or_wait(responses, response);
+    if (result == 0 && ring_wake_needed(responses))
+    {
+      ring_wake(responses);
+    }
+    else if (result == 1)
+    {
+      // The buffers are swapped rather than copied
+      Frame parked = session(id)->parked_response;
+      session(id)->parked_response = *response;
+      *response = parked;
+      session(id)->parked = 1;
+      printf("Client %d parked until its response ring has room\n", id);
+      result = 0;
+    }
+  }
+  else
+  {
+    frame_header(response)->status = (uint8_t)status;
+    result = send_frame(id, response, 0, RESPONSE_DEADLINE_MS);
+    if (result == 1)
+    {
+      request_eviction(id, "response deadline missed");
+      result = -1;
+    }
   }
+  pthread_mutex_unlock(&session(id)->send_lock);
+  return result;
+}
 
-  // Open the pipe for reading
-  int pipe_fd = open(pipe_path, O_RDONLY);
-  if (pipe_fd == -1)
+// Sends a page of SCAN results: the next cursor, the key to resume after and
+// the number of pairs, then each key and value
+int send_scan_response(int session_id, Frame *response, uint64_t cursor,
+                       const char *key, size_t count, char *keys[],
+                       char *values[])
+{
+  int status = frame_put_u64(response, cursor) ||
+               frame_put_string(response, key, strlen(key)) ||
+               frame_put_u64(response, count);
+  for (size_t i = 0; i < count && status == 0; i++)
   {
-    perror("Failed to open pipe");
-    return -1;
+    status = frame_put_string(response, keys[i], strlen(keys[i])) ||
+             frame_put_string(response, values[i], strlen(values[i]));
   }
 
-  char buffer[MAX_STRING_SIZE * 3 + 2] = {0};
+  if (status != 0)
+  {
+    // Too large to send: answer with an empty, failed page
+    fprintf(stderr, "Failed to encode scan response\n");
+    frame_init(response, OP_CODE_SCAN, frame_header(response)->request_id);
+  }
+  return send_session_response(session_id, response, status);
+}
 
-  // Read response from the pipe
-  ssize_t bytes_read = read(pipe_fd, buffer, sizeof(buffer) - 1);
-  if (bytes_read < 0)
+// Sends a batch of the change log starting at sequence number from: the
+// oldest and next sequence numbers and the number of changes, then each change
+int send_changes_response(int session_id, Frame *response, uint64_t from,
+                          size_t max_changes)
+{
+  // Reused by every CHANGES request of the calling thread, and grown to fit
+  // a change larger than it
+  static _Thread_local char *changes = NULL;
+  static _Thread_local size_t changes_size = 0;
+  if (changes == NULL && (changes = malloc(CHANGES_BUFFER_SIZE)) != NULL)
   {
-    perror("Failed to read response from pipe");
-    close(pipe_fd);
-    return -1;
+    changes_size = CHANGES_BUFFER_SIZE;
   }
-  close(pipe_fd);
 
-  buffer[bytes_read] = '\0'; // Null-terminate the buffer
-  printf("Raw response: '%s'\n", buffer);
+  uint64_t oldest;
+  uint64_t next;
+  size_t count;
+  if (changes == NULL ||
+      changelog_read(from, max_changes, &changes, &changes_size, &count, &oldest, &next) != 0)
+  {
+    fprintf(stderr, "Failed to allocate change log buffer\n");
+    return send_session_response(session_id, response, 1);
+  }
+  int status = frame_put_u64(response, oldest) || frame_put_u64(response, next) ||
+               frame_put_u64(response, count);
 
-  // Decode and handle the response
-  char req_op_code = buffer[0]; // Extract OP_CODE
-  int req_op_code_int = req_op_code - '0';
+  char *change = changes;
+  for (size_t i = 0; i < count && status == 0; i++)
+  {
+    ChangeHeader header;
+    memcpy(&header, change, sizeof(header));
+    const char *key = change + sizeof(header);
+    int deleted = header.value_len == CHANGE_DELETED;
+    const char *value = deleted ? "" : key + header.key_len + 1;
+    size_t value_len = deleted ? 0 : header.value_len;
+
+    status = frame_put_u64(response, header.seq) || frame_put_u64(response, (uint64_t)deleted) ||
+             frame_put_string(response, key, header.key_len) ||
+             frame_put_string(response, value, value_len);
+    change += sizeof(header) + header.key_len + 1 + (deleted ? 0 : value_len + 1);
+  }
 
-  char args[41] = {0};
+  if (status != 0)
+  {
+    fprintf(stderr, "Failed to encode changes response\n");
+    frame_init(response, OP_CODE_CHANGES, frame_header(response)->request_id);
+  }
+  return send_session_response(session_id, response, status);
+}
 
-  int status = 0;
-  char response_status = {0};
+// Closes the response and notification pipes, which the client sees as EOF,
+// and removes the FIFOs. The request pipe is left to end_session
+void clean_pipes(int thread_id)
+{
+  pthread_mutex_lock(&client_thread_mutex);
 
-  if (client_id == -1) // Hostess request
+  // Clean pipe paths first: once the client sees EOF it may create them anew
+  if (session(thread_id)->req_pipe_path)
   {
-    req_op_code_int = OP_CODE_CONNECT;
-
-    printf("Request Client: NULL\n");
+    unlink(session(thread_id)->req_pipe_path);
+    free(session(thread_id)->req_pipe_path);
+    session(thread_id)->req_pipe_path = NULL;
   }
-  else
+
+  if (session(thread_id)->resp_pipe_path)
   {
-    printf("Request Client: %d\n", client_id);
+    unlink(session(thread_id)->resp_pipe_path);
+    free(session(thread_id)->resp_pipe_path);
+    session(thread_id)->resp_pipe_path = NULL;
   }
 
-  printf("Request OP_CODE: %d\n", req_op_code_int);
-  ;
+  if (session(thread_id)->notif_pipe_path)
+  {
+    unlink(session(thread_id)->notif_pipe_path);
+    free(session(thread_id)->notif_pipe_path);
+    session(thread_id)->notif_pipe_path = NULL;
+  }
+
+  // Nothing is being sent to the session while its fds are closed
+  pthread_mutex_lock(&session(thread_id)->send_lock);
+  while (session(thread_id)->sending)
+  {
+    pthread_cond_wait(&session(thread_id)->sent, &session(thread_id)->send_lock);
+  }
+
+  if (session(thread_id)->shm != NULL)
+  {
+    atomic_store(&session(thread_id)->shm->closed, 1);
+    ring_wake(&session(thread_id)->shm->responses);
+    ring_wake(&session(thread_id)->shm->notifications);
+    munmap(session(thread_id)->shm, sizeof(RingSession));
+    session(thread_id)->shm = NULL;
+  }
+
+  // The request fd keeps the connection open until the session ends
+  if (session(thread_id)->socket && session(thread_id)->resp_fd != -1)
+  {
+    shutdown(session(thread_id)->resp_fd, SHUT_RDWR);
+  }
+
+  if (session(thread_id)->resp_fd != -1)
+  {
+    close(session(thread_id)->resp_fd);
+    session(thread_id)->resp_fd = -1;
+  }
+
+  if (session(thread_id)->notif_fd != -1)
+  {
+    close(session(thread_id)->notif_fd);
+    session(thread_id)->notif_fd = -1;
+  }
+
+  pthread_mutex_unlock(&session(thread_id)->send_lock);
+  pthread_mutex_unlock(&client_thread_mutex);
+}
+
+// Subscribes a session to a key or pattern, with the session lock held
+// @return 0 on success, 1 if it could not be allocated
+static int subscribe_key(int session_id, const char *key)
+{
+  int added = keyset_add(&session(session_id)->subscriptions, key);
+  if (added == 1)
+  {
+    printf("Client already subscribed to key %s.\n", key);
+    return 0;
+  }
+  if (added == -1 || subscriptions_add(key, session_id) == -1)
+  {
+    perror("Failed to allocate subscription");
+    if (added == 0)
+    {
+      keyset_remove(&session(session_id)->subscriptions, key);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Unsubscribes a session from a key or pattern, with the session lock held
+// @return 0 on success, 1 if the session was not subscribed
+static int unsubscribe_key(int session_id, const char *key)
+{
+  if (keyset_remove(&session(session_id)->subscriptions, key) != 0)
+  {
+    printf("Key %s not found in client subscriptions.\n", key);
+    return 1;
+  }
+  printf("Unsubscribing from key: %s\n", key);
+  subscriptions_remove(key, session_id);
+  return 0;
+}
+
+static void unindex_subscription(const char *key, void *arg)
+{
+  subscriptions_remove(key, *(int *)arg);
+}
+
+// Frees the subscriptions of a client and takes them out of the index, then
+// drops its pending notifications once a delivery in progress is over. Called
+// with the session lock held
+static void clear_subscriptions(int thread_id)
+{
+  keyset_for_each(&session(thread_id)->subscriptions, unindex_subscription, &thread_id);
+  keyset_clear(&session(thread_id)->subscriptions);
+  notifier_clear(&session(thread_id)->notifications);
+}
+
+// Ends a session whose client disconnected or went away: drops its
+// subscriptions, closes its pipes and frees its id
+static void end_session(int thread_id)
+{
+  clear_subscriptions(thread_id);
+  clean_pipes(thread_id);
+
+  pthread_mutex_lock(&client_thread_mutex);
+  close(session(thread_id)->req_fd);
+  session(thread_id)->req_fd = -1;
+  session(thread_id)->id = -1;
+  frame_free(&session(thread_id)->request);
+  session(thread_id)->received = 0;
+  frame_free(&session(thread_id)->parked_response);
+  session(thread_id)->parked = 0;
+  pthread_mutex_unlock(&client_thread_mutex);
+
+  free_thread(thread_id);
+}
+
+// Maps the shared memory region a socket client created for its session. The
+// socket then only carries wake-ups
+static RingSession *map_ring_session(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1)
+  {
+    perror("Failed to open shared memory");
+    return NULL;
+  }
+
+  struct stat st;
+  void *region = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(RingSession))
+  {
+    region = mmap(NULL, sizeof(RingSession), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (region == MAP_FAILED)
+  {
+    fprintf(stderr, "Failed to map shared memory %s\n", name);
+    return NULL;
+  }
+  printf("Shared memory session: %s\n", name);
+  return region;
+}
+
+// Decodes the n keys, or n pairs if values is not NULL, of a READ, WRITE,
+// DELETE or batch subscription request. The strings point into the request frame
+static int get_keys(Frame *request, const char *keys[], const char *values[],
+                    size_t *count)
+{
+  uint64_t n;
+  if (frame_get_u64(request, &n) != 0 || n > MAX_SESSION_KEYS)
+  {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++)
+  {
+    if (frame_get_string(request, &keys[i], NULL) != 0 ||
+        (values != NULL && frame_get_string(request, &values[i], NULL) != 0))
+    {
+      return 1;
+    }
+  }
+
+  *count = (size_t)n;
+  return 0;
+}
+
+// Registers a FIFO client once its pipes are open and sends its CONNECT
+// response. Requests are only read once the client has it
+// @return 0 on success, 1 otherwise, with the pipes closed
+static int finish_connect(const char *req_pipe_path, const char *resp_pipe_path,
+                          const char *notif_pipe_path, int fds[3], Frame *response)
+{
+  int session_id;
+  int status = register_client(req_pipe_path, resp_pipe_path, notif_pipe_path, fds, &session_id);
+  printf("Register client status: %d\n", status);
 
-  switch (req_op_code_int)
+  // Send a response to the client
+  if (send_response(fds[1], response, status) == -1)
+  {
+    printf("Failed to send response to client.\n");
+  }
+  if (status != 0)
+  {
+    close_client_pipes(fds);
+    return 1;
+  }
+
+  if (watch_fd(EPOLL_CTL_ADD, fds[0], session_event(session_id)) != 0)
+  {
+    end_session(session_id);
+    return 1;
+  }
+  return 0;
+}
+
+static long long monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Makes open_timer_fd tick every PIPE_OPEN_RETRY_MS, or stops it
+static void set_open_timer(int ticking)
+{
+  struct itimerspec timer = {0};
+  if (ticking)
+  {
+    timer.it_value.tv_nsec = PIPE_OPEN_RETRY_MS * 1000000L;
+    timer.it_interval = timer.it_value;
+  }
+  if (timerfd_settime(open_timer_fd, 0, &timer, NULL) == -1)
+  {
+    perror("Failed to set open timer");
+  }
+}
+
+// Keeps a FIFO CONNECT whose client has not opened its ends of the pipes yet,
+// for retry_connects to finish
+// @return 0 on success, 1 if it could not be allocated, with the pipes closed
+static int queue_connect(const char *req_pipe_path, const char *resp_pipe_path,
+                         const char *notif_pipe_path, int fds[3], uint32_t request_id)
+{
+  struct pending_connect *connect = calloc(1, sizeof(struct pending_connect));
+  const char *paths[3] = {req_pipe_path, resp_pipe_path, notif_pipe_path};
+  for (int i = 0; i < 3 && connect != NULL; i++)
+  {
+    connect->paths[i] = strdup(paths[i]);
+    connect->fds[i] = fds[i];
+  }
+  if (connect == NULL || !connect->paths[0] || !connect->paths[1] || !connect->paths[2])
+  {
+    printf("Memory allocation failed for pending CONNECT.\n");
+    if (connect != NULL)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        free(connect->paths[i]);
+      }
+    }
+    free(connect);
+    close_client_pipes(fds);
+    return 1;
+  }
+  connect->request_id = request_id;
+  connect->deadline_ms = monotonic_ms() + PIPE_OPEN_DEADLINE_MS;
+
+  pthread_mutex_lock(&pending_connects_lock);
+  struct pending_connect **last = &pending_connects;
+  while (*last != NULL)
+  {
+    last = &(*last)->next;
+  }
+  *last = connect;
+  if (connect == pending_connects)
+  {
+    set_open_timer(1);
+  }
+  pthread_mutex_unlock(&pending_connects_lock);
+  return 0;
+}
+
+// Retries the pipes of the pending CONNECTs on a tick of open_timer_fd, and
+// finishes those whose client opened its ends. A client that has not after
+// PIPE_OPEN_DEADLINE_MS is given up on: it may have died before opening them
+static void retry_connects(void)
+{
+  uint64_t ticks;
+  if (read(open_timer_fd, &ticks, sizeof(ticks)) == -1 && errno != EAGAIN)
+  {
+    perror("Failed to read open timer");
+  }
+
+  // Those done are taken out first, so no response is sent with the lock held
+  long long now = monotonic_ms();
+  struct pending_connect *done = NULL;
+  struct pending_connect **done_last = &done;
+  pthread_mutex_lock(&pending_connects_lock);
+  struct pending_connect **link = &pending_connects;
+  while (*link != NULL)
+  {
+    struct pending_connect *connect = *link;
+    connect->opened = open_client_pipes(connect->paths[0], connect->paths[1], connect->paths[2],
+                                        connect->fds);
+    if (connect->opened == 2 && now < connect->deadline_ms)
+    {
+      link = &connect->next;
+      continue;
+    }
+    *link = connect->next;
+    connect->next = NULL;
+    *done_last = connect;
+    done_last = &connect->next;
+  }
+  if (pending_connects == NULL)
+  {
+    set_open_timer(0);
+  }
+  pthread_mutex_unlock(&pending_connects_lock);
+
+  while (done != NULL)
+  {
+    struct pending_connect *connect = done;
+    done = connect->next;
+
+    Frame response = {0};
+    if (connect->opened != 0)
+    {
+      printf("Failed to open client pipes.\n");
+      close_client_pipes(connect->fds);
+    }
+    else if (frame_init(&response, OP_CODE_CONNECT, connect->request_id) != 0)
+    {
+      fprintf(stderr, "Failed to allocate response\n");
+      close_client_pipes(connect->fds);
+    }
+    else
+    {
+      finish_connect(connect->paths[0], connect->paths[1], connect->paths[2], connect->fds,
+                     &response);
+    }
+    frame_free(&response);
+
+    for (int i = 0; i < 3; i++)
+    {
+      free(connect->paths[i]);
+    }
+    free(connect);
+  }
+}
+
+// Reads and handles one request frame from an open pipe
+// @return 0 if it was handled, 1 if it could not be answered, -1 on EOF or if
+// the stream is no longer usable
+int receive_request(int pipe_fd, int client_id)
+{
+  // Reused by every request of the calling thread
+  static _Thread_local Frame request;
+  static _Thread_local Frame response;
+
+  // A session's fd is non-blocking: what has arrived of a request is kept
+  // with the session until the rest does, instead of holding the worker
+  RingSession *rings = client_id != -1 ? session(client_id)->shm : NULL;
+  int result;
+  if (rings != NULL)
+  {
+    result = ring_get(&rings->requests, &request);
+  }
+  else if (client_id != -1)
+  {
+    struct client_t *client = session(client_id);
+    result = frame_recv_some(pipe_fd, &client->request, &client->received);
+    if (result == 2)
+    {
+      return 0;
+    }
+    if (result == 1)
+    {
+      // The buffers are swapped rather than copied
+      Frame received = client->request;
+      client->request = request;
+      request = received;
+    }
+  }
+  else
+  {
+    result = frame_recv(pipe_fd, &request, NULL);
+  }
+  if (result != 1)
+  {
+    if (result == 0 && client_id != -1)
+    {
+      printf("Pipe closed by client %d\n", client_id);
+    }
+    else if (result == -1)
+    {
+      fprintf(stderr, "Invalid request frame\n");
+    }
+    return -1;
+  }
+
+  int req_op_code = frame_header(&request)->op_code;
+  int status = 0;
+
+  if (client_id == -1) // Hostess request
+  {
+    printf("Request Client: NULL\n");
+    if (req_op_code != OP_CODE_CONNECT)
+    {
+      fprintf(stderr, "Unsupported op_code on server pipe: %d\n", req_op_code);
+      return -1;
+    }
+  }
+  else
+  {
+    printf("Request Client: %d\n", client_id);
+  }
+
+  printf("Request OP_CODE: %d\n", req_op_code);
+
+  if (frame_init(&response, (uint8_t)req_op_code, frame_header(&request)->request_id) != 0)
+  {
+    fprintf(stderr, "Failed to allocate response\n");
+    return -1;
+  }
+
+  const char *key;
+
+  switch (req_op_code)
   {
   case OP_CODE_CONNECT:
     printf("OP_CODE_CONNECT\n");
 
-    char req_pipe_path[PIPE_BUF] = {0};
-    char resp_client_pipe_path[PIPE_BUF] = {0};
-    char notif_pipe_path[PIPE_BUF] = {0};
+    // Over the socket the session starts when the connection is accepted. A
+    // client that names a shared memory region moves its frames to the rings
+    // in it once it has this response
+    if (client_id != -1)
+    {
+      const char *shm_name;
+      RingSession *shm = NULL;
+      if (session(client_id)->socket && session(client_id)->shm == NULL &&
+          frame_get_string(&request, &shm_name, NULL) == 0)
+      {
+        shm = map_ring_session(shm_name);
+        status = shm == NULL;
+      }
+
+      if (send_session_response(client_id, &response, status) == -1)
+      {
+        printf("Failed to send response to client.\n");
+      }
 
-    sscanf(buffer, "%*c%40s%40s%40s", req_pipe_path, resp_client_pipe_path, notif_pipe_path);
+      pthread_mutex_lock(&session(client_id)->send_lock);
+      session(client_id)->shm = shm;
+      pthread_mutex_unlock(&session(client_id)->send_lock);
+      break;
+    }
 
-    // Trim trailing whitespaces
-    trim_char(req_pipe_path);
-    trim_char(resp_client_pipe_path);
-    trim_char(notif_pipe_path);
+    const char *req_pipe_path;
+    const char *resp_client_pipe_path;
+    const char *notif_pipe_path;
+    if (frame_get_string(&request, &req_pipe_path, NULL) != 0 ||
+        frame_get_string(&request, &resp_client_pipe_path, NULL) != 0 ||
+        frame_get_string(&request, &notif_pipe_path, NULL) != 0)
+    {
+      fprintf(stderr, "Malformed CONNECT request\n");
+      return -1;
+    }
 
     printf("Request pipe: %s\n", req_pipe_path);
     printf("Response pipe1: %s\n", resp_client_pipe_path);
     printf("Notification pipe: %s\n", notif_pipe_path);
 
-    // Register the client
-    status = register_client(req_pipe_path, resp_client_pipe_path, notif_pipe_path);
-    printf("Register client status: %d\n", status);
+    int fds[3] = {-1, -1, -1};
+    int opened = open_client_pipes(req_pipe_path, resp_client_pipe_path, notif_pipe_path, fds);
+    if (opened == 2)
+    {
+      // Finished by retry_connects once the client opens its ends
+      return queue_connect(req_pipe_path, resp_client_pipe_path, notif_pipe_path, fds,
+                           frame_header(&request)->request_id);
+    }
+    if (opened != 0)
+    {
+      printf("Failed to open client pipes.\n");
+      return 1;
+    }
+    return finish_connect(req_pipe_path, resp_client_pipe_path, notif_pipe_path, fds, &response);
+
+  case OP_CODE_SUBSCRIBE:
+    if (frame_get_string(&request, &key, NULL) != 0)
+    {
+      fprintf(stderr, "Malformed SUBSCRIBE request\n");
+      return -1;
+    }
+    // A key may be watched before it is written, and a prefix pattern
+    // ("order:*") watches every key starting with it
+    printf("Subscribing to key: '%s'\n", key);
+    if (!subscription_is_pattern(key) && kvs_check((char *)key) != 0)
+    {
+      printf("Key %s does not exist yet.\n", key);
+    }
+
+    // The session lock, held while a request is handled, guards its
+    // subscriptions
+    status = subscribe_key(client_id, key);
+    printf("Current subscriptions: %zu\n", session(client_id)->subscriptions.count);
 
     // Send a response to the client
-    response_status = status == 0 ? '0' : '1';
-    if (send_response(resp_client_pipe_path, req_op_code, response_status) == -1)
+    printf("Thread ID: %d\n", client_id);
+    printf("Response status: %d\n", status);
+    if (send_session_response(client_id, &response, status) == -1)
     {
       printf("Failed to send response to client.\n");
       return 1;
     }
     break;
 
-  case OP_CODE_SUBSCRIBE:
-    sscanf(buffer, "%*c%40s", args);
-    printf("Key: %s\n", args);
-    trim_char(args);
-    printf("Subscribing to key: '%s'\n", args);
-    if (kvs_check(args) != 0)
+  case OP_CODE_UNSUBSCRIBE:
+    if (frame_get_string(&request, &key, NULL) != 0)
     {
-      printf("Key %s not exists in KVS table.\n", args);
-      status = 1;
+      fprintf(stderr, "Malformed UNSUBSCRIBE request\n");
+      return -1;
     }
 
-    // Check if client subscriptions is full
-    int sub_count = 0;
-    for (int i = 0; i < MAX_NUMBER_SUB; i++)
+    status = unsubscribe_key(client_id, key);
+    printf("Updated subscriptions: %zu\n", session(client_id)->subscriptions.count);
+
+    // Send a response to the client
+    if (send_session_response(client_id, &response, status) == -1)
+    {
+      printf("Failed to send response to client.\n");
+      return 1;
+    }
+    break;
+
+  case OP_CODE_SUBSCRIBE_MANY:
+  case OP_CODE_UNSUBSCRIBE_MANY:
+  {
+    // A key list in one round trip, answered with the outcome of each key
+    const char *keys[MAX_SESSION_KEYS];
+    size_t num_keys;
+    if (get_keys(&request, keys, NULL, &num_keys) != 0)
+    {
+      fprintf(stderr, "Malformed batch subscription request\n");
+      return -1;
+    }
+
+    status = frame_put_u64(&response, num_keys);
+    for (size_t i = 0; i < num_keys && status == 0; i++)
+    {
+      int failed = req_op_code == OP_CODE_SUBSCRIBE_MANY ? subscribe_key(client_id, keys[i])
+                                                         : unsubscribe_key(client_id, keys[i]);
+      status = frame_put_u64(&response, (uint64_t)failed);
+    }
+    printf("Current subscriptions: %zu\n", session(client_id)->subscriptions.count);
+
+    if (send_session_response(client_id, &response, status) == -1)
+    {
+      printf("Failed to send response to client.\n");
+    }
+    break;
+  }
+
+  case OP_CODE_SCAN:
+  {
+    // Paged, SHOW-like listing: cursor 0 starts a scan and a returned cursor
+    // of 0 means it is complete. Pages resume after the last key returned,
+    // an empty key being the start of the cursor's bucket
+    uint64_t cursor;
+    const char *last_key;
+    size_t last_len;
+    uint64_t count;
+    if (frame_get_u64(&request, &cursor) != 0 ||
+        frame_get_string(&request, &last_key, &last_len) != 0 ||
+        frame_get_u64(&request, &count) != 0)
+    {
+      fprintf(stderr, "Malformed SCAN request\n");
+      return -1;
+    }
+    if (count == 0 || count > MAX_SCAN_COUNT)
+    {
+      count = MAX_SCAN_COUNT;
+    }
+
+    char *keys[MAX_SCAN_COUNT];
+    char *values[MAX_SCAN_COUNT];
+    // kvs_scan frees the key it is given on every path, and hands back the
+    // one to resume after
+    char *resume_key = last_len > 0 ? strdup(last_key) : NULL;
+    size_t found;
+    int sent;
+    if (kvs_scan(&cursor, &resume_key, (size_t)count, keys, values, &found) != 0)
+    {
+      sent = send_session_response(client_id, &response, 1);
+    }
+    else
+    {
+      sent = send_scan_response(client_id, &response, cursor,
+                                resume_key != NULL ? resume_key : "", found,
+                                keys, values);
+    }
+    free(resume_key);
+    for (size_t i = 0; i < found; i++)
+    {
+      free(keys[i]);
+      free(values[i]);
+    }
+    if (sent == -1)
+    {
+      printf("Failed to send response to client.\n");
+      return 1;
+    }
+    break;
+  }
+
+  case OP_CODE_CHANGES:
+  {
+    // Tails the change log: unlike notifications, changes made while the
+    // consumer was away are still there, up to the log's capacity
+    uint64_t from;
+    uint64_t count;
+    if (frame_get_u64(&request, &from) != 0 || frame_get_u64(&request, &count) != 0)
+    {
+      fprintf(stderr, "Malformed CHANGES request\n");
+      return -1;
+    }
+    if (count == 0 || count > MAX_CHANGES_COUNT)
+    {
+      count = MAX_CHANGES_COUNT;
+    }
+
+    if (send_changes_response(client_id, &response, from, (size_t)count) == -1)
+    {
+      printf("Failed to send response to client.\n");
+      return 1;
+    }
+    break;
+  }
+
+  case OP_CODE_READ:
+  {
+    const char *keys[MAX_SESSION_KEYS];
+    char *values[MAX_SESSION_KEYS];
+    size_t num_keys;
+    if (get_keys(&request, keys, NULL, &num_keys) != 0)
     {
-      if (clients[client_id].subscriptions[i][0] != '\0')
+      fprintf(stderr, "Malformed READ request\n");
+      return -1;
+    }
+
+    status = kvs_read_values(num_keys, keys, values);
+    if (status == 0)
+    {
+      status = frame_put_u64(&response, num_keys);
+      for (size_t i = 0; i < num_keys; i++)
+      {
+        const char *value = values[i] != NULL ? values[i] : "";
+        if (status == 0)
+        {
+          status = frame_put_u64(&response, values[i] != NULL) ||
+                   frame_put_string(&response, value, strlen(value));
+        }
+        free(values[i]);
+      }
+      if (status != 0)
       {
-        sub_count++;
+        // Too large to send: answer with an empty, failed response
+        frame_init(&response, OP_CODE_READ, frame_header(&request)->request_id);
       }
     }
 
-    if (sub_count >= MAX_NUMBER_SUB)
+    if (send_session_response(client_id, &response, status) == -1)
+    {
+      printf("Failed to send response to client.\n");
+      return 1;
+    }
+    break;
+  }
+
+  case OP_CODE_WRITE:
+  {
+    const char *keys[MAX_SESSION_KEYS];
+    const char *values[MAX_SESSION_KEYS];
+    size_t num_pairs;
+    if (get_keys(&request, keys, values, &num_pairs) != 0)
     {
-      printf("Client subscriptions is full.\n");
-      status = 1;
+      fprintf(stderr, "Malformed WRITE request\n");
+      return -1;
     }
 
-    // Subscribe to a key
-    if (status != 1)
+    // Each change must fit in a CHANGES response, so it can be read back
+    status = 0;
+    for (size_t i = 0; i < num_pairs && status == 0; i++)
     {
-      printf("Subscribing to key: %s\n", args);
-      for (int i = 0; i < MAX_NUMBER_SUB; i++)
+      if (strlen(keys[i]) + strlen(values[i]) > MAX_CHANGE_SIZE)
       {
-        if (clients[client_id].subscriptions[i][0] == '\0')
-        {
-          strcpy(clients[client_id].subscriptions[i], args);
-          break;
-        }
+        fprintf(stderr, "WRITE of key %s too large\n", keys[i]);
+        status = 1;
       }
     }
-
-    // Print the current subscriptions
-    printf("Current subscriptions: ");
-    for (int i = 0; i < MAX_NUMBER_SUB; i++)
+    if (status == 0)
     {
-      if (clients[client_id].subscriptions[i][0] != '\0')
-      {
-        printf("%s ", clients[client_id].subscriptions[i]);
-      }
+      status = kvs_write_pairs(num_pairs, keys, values);
     }
-    printf("\n");
-
-    // Send a response to the client
-    response_status = status == 0 ? '0' : '1';
-    printf("Thread ID: %d\n", client_id);
-    printf("Response status: %c\n", response_status);
-    printf("Response pipe2: %s\n", clients[client_id].resp_pipe_path);
-    if (send_response(clients[client_id].resp_pipe_path, req_op_code, response_status) == -1)
+    if (send_session_response(client_id, &response, status) == -1)
     {
       printf("Failed to send response to client.\n");
-      return 1;
     }
-    break;
 
-  case OP_CODE_UNSUBSCRIBE:
-    // Check if client subscriptions contain the key
-    sscanf(buffer, "%*c%40s", args);
-    printf("Key: %s\n", args);
-    trim_char(args);
-
-    int unsubscribed = 0;
-    for (int i = 0; i < MAX_NUMBER_SUB; i++)
+    // Notify subscribers after answering the writer
+    for (size_t i = 0; i < num_pairs && status == 0; i++)
     {
-      if (strcmp(clients[client_id].subscriptions[i], args) == 0)
-      {
-        printf("Unsubscribing from key: %s\n", args);
-        clients[client_id].subscriptions[i][0] = '\0'; // Clear the subscription
-        unsubscribed = 1;
-        break;
-      }
+      notify_client(keys[i], values[i]);
     }
+    break;
+  }
 
-    if (!unsubscribed)
+  case OP_CODE_DELETE:
+  {
+    const char *keys[MAX_SESSION_KEYS];
+    int deleted[MAX_SESSION_KEYS];
+    size_t num_keys;
+    if (get_keys(&request, keys, NULL, &num_keys) != 0)
     {
-      printf("Key %s not found in client subscriptions.\n", args);
-      status = 1;
+      fprintf(stderr, "Malformed DELETE request\n");
+      return -1;
     }
 
-    // Print the updated subscriptions
-    printf("Updated subscriptions: ");
-    for (int i = 0; i < MAX_NUMBER_SUB; i++)
+    status = kvs_delete_keys(num_keys, keys, deleted);
+    if (status == 0)
     {
-      if (clients[client_id].subscriptions[i][0] != '\0')
+      status = frame_put_u64(&response, num_keys);
+      for (size_t i = 0; i < num_keys && status == 0; i++)
       {
-        printf("%s ", clients[client_id].subscriptions[i]);
+        status = frame_put_u64(&response, (uint64_t)deleted[i]);
       }
     }
-    printf("\n");
-
-    // Send a response to the client
-    response_status = status == 0 ? '0' : '1';
-    if (send_response(clients[client_id].resp_pipe_path, req_op_code, response_status) == -1)
+    if (send_session_response(client_id, &response, status) == -1)
     {
       printf("Failed to send response to client.\n");
-      return 1;
     }
-    break;
 
-  case OP_CODE_DISCONNECT:
-    // Clean subscriptions
-    for (int i = 0; i < MAX_NUMBER_SUB; i++)
+    for (size_t i = 0; i < num_keys && status == 0; i++)
     {
-      clients[client_id].subscriptions[i][0] = '\0';
+      if (deleted[i])
+      {
+        notify_client(keys[i], NULL);
+      }
     }
+    break;
+  }
 
+  case OP_CODE_DISCONNECT:
     // Send a response to the client
-    response_status = '0';
-    if (send_response(clients[client_id].resp_pipe_path, req_op_code, response_status) == -1)
+    if (send_session_response(client_id, &response, 0) == -1)
     {
       printf("Failed to send response to client.\n");
-      return 1;
     }
 
     // Clean pipes and subscriptions
     printf("Cleaning pipes for client %d\n", client_id);
-    printf("Pipes: %s\n", clients[client_id].req_pipe_path);
-    clean_pipes(client_id);
-    printf("Cleaning pipes successfully for client %d\n", client_id);
-    printf("Pipes: %s\n", clients[client_id].req_pipe_path);
-
-    printf("Free manager client %d\n", client_id);
-    printf("Free Status: %s\n", client_threads[client_id].free);
-    free_thread(client_id);
+    end_session(client_id);
     printf("Thread manager client %d unregistered\n", client_id);
 
     break;
 
   default:
-    fprintf(stderr, "Unsupported op_code: %c\n", req_op_code);
+    fprintf(stderr, "Unsupported op_code: %d\n", req_op_code);
     return -1;
   }
 
   return 0;
 }
 
-static void *client_manager_thread(void *arg)
+void block_sigusr1(void)
 {
-  block_sigusr1();
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+  {
+    perror("pthread_sigmask block");
+  }
+}
 
-  int thread_id = *(int *)arg;
+// Opens the server pipe for reading without blocking. The server keeps a
+// writer open as well, so the pipe never reports EOF between clients
+static int open_server_pipe(void)
+{
+  server_pipe_fd = open(server_pipe_path, O_RDONLY | O_NONBLOCK);
+  server_pipe_writer_fd = server_pipe_fd == -1 ? -1 : open(server_pipe_path, O_WRONLY);
+  if (server_pipe_writer_fd == -1 || fcntl(server_pipe_fd, F_SETFL, 0) == -1)
+  {
+    perror("Failed to open server pipe");
+    return 1;
+  }
+  return watch_fd(EPOLL_CTL_ADD, server_pipe_fd, SERVER_PIPE_EVENT);
+}
 
-  while (1)
+// CONNECT requests are written atomically, so a readable server pipe holds at
+// least one whole request. A malformed one leaves the stream unusable, so the
+// pipe is reopened
+static void handle_server_pipe(void)
+{
+  if (receive_request(server_pipe_fd, -1) != -1)
+  {
+    watch_fd(EPOLL_CTL_MOD, server_pipe_fd, SERVER_PIPE_EVENT);
+    return;
+  }
+
+  close(server_pipe_fd);
+  close(server_pipe_writer_fd);
+  open_server_pipe();
+}
+
+// Listens on server_socket_path for clients connecting with the socket
+// transport instead of FIFOs
+static int open_server_socket(void)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(server_socket_path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", server_socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, server_socket_path);
+
+  if (unlink(server_socket_path) != 0 && errno != ENOENT)
+  {
+    perror("Failed to delete existing socket");
+    return 1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, SOMAXCONN) == -1 ||
+      fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1)
   {
-    // Wait for a client to connect
-    while (clients[thread_id].req_pipe_path == NULL)
+    perror("Failed to listen on server socket");
+    return 1;
+  }
+  return watch_fd(EPOLL_CTL_ADD, listen_fd, LISTEN_EVENT);
+}
+
+// Every connection is a session: requests, responses and notifications all go
+// through it, and the client's death is seen as EOF on the next read. A
+// connection that gets no session is closed. Like a request pipe, it is read
+// and written without blocking
+static void accept_client(void)
+{
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd != -1 && fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+  {
+    close(fd);
+    fd = -1;
+  }
+  if (fd == -1)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
     {
-      sleep(1);
+      perror("Failed to accept client");
     }
+    return;
+  }
 
-    printf("Thread manager client %d registered\n", thread_id);
-
-    while (clients[thread_id].req_pipe_path)
+  int fds[3] = {fd, dup(fd), dup(fd)};
+  int session_id;
+  if (fds[1] == -1 || fds[2] == -1 ||
+      register_client(NULL, NULL, NULL, fds, &session_id) != 0)
+  {
+    printf("Failed to register socket client.\n");
+    for (int i = 0; i < 3; i++)
     {
-      printf("Waiting for client request on pipe %s\n", clients[thread_id].req_pipe_path);
-      receive_request(clients[thread_id].req_pipe_path, thread_id);
+      if (fds[i] != -1)
+      {
+        close(fds[i]);
+      }
     }
+    return;
   }
 
-  return NULL;
+  if (watch_fd(EPOLL_CTL_ADD, fd, session_event(session_id)) != 0)
+  {
+    end_session(session_id);
+  }
 }
 
-void block_sigusr1(void)
+// SIGUSR1 ends every session: subscriptions are dropped and the response and
+// notification pipes closed, which the clients see as EOF. A slot is freed
+// once its client closes the request pipe
+static void handle_sigusr1(void)
 {
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGUSR1);
-  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+  struct signalfd_siginfo info;
+  if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
   {
-    perror("pthread_sigmask block");
+    perror("Failed to read signal");
+    return;
+  }
+
+  printf("SIGUSR1 received\n");
+  pthread_mutex_lock(&client_thread_mutex);
+  int count = num_sessions; // sessions created later are not affected
+  pthread_mutex_unlock(&client_thread_mutex);
+
+  for (int i = 0; i < count; i++)
+  {
+    pthread_mutex_lock(&session(i)->lock);
+    if (session(i)->req_fd != -1)
+    {
+      clear_subscriptions(i);
+      clean_pipes(i);
+    }
+    pthread_mutex_unlock(&session(i)->lock);
   }
+  printf("All clients terminated\n");
 }
 
-static void *hostess_thread(void *arg)
+// Ends the sessions whose clients stopped taking notifications, as if they
+// had gone away, unless they already ended
+static void handle_evictions(void)
 {
+  uint64_t count;
+  if (read(evict_fd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN)
+  {
+    perror("Failed to read evictions");
+  }
 
-  sigset_t mask;
-  sigemptyset(&mask);
+  pthread_mutex_lock(&evictions_lock);
+  struct eviction *eviction = evictions;
+  evictions = NULL;
+  pthread_mutex_unlock(&evictions_lock);
 
-  printf("Thread hostess pipe started\n");
-  printf("Waiting for client connection...\n");
-  while (1)
+  while (eviction != NULL)
   {
-    sigaddset(&mask, SIGUSR1);
-    if (pthread_sigmask(SIG_UNBLOCK, &mask, NULL) != 0)
+    int id = eviction->id;
+    pthread_mutex_lock(&session(id)->lock);
+    if (session(id)->generation == eviction->generation && session(id)->req_fd != -1)
     {
-      perror("pthread_sigmask hostess");
-      return NULL;
+      printf("Client %d evicted\n", id);
+      end_session(id);
     }
+    pthread_mutex_unlock(&session(id)->lock);
+
+    struct eviction *next = eviction->next;
+    free(eviction);
+    eviction = next;
+  }
+}
+
+// Sends the response a parked session waits on, once its client rang its
+// socket to say it made room
+// @return 0 once it is sent, 1 if the ring is still full
+static int unpark_session(int session_id)
+{
+  pthread_mutex_lock(&session(session_id)->send_lock);
+  Ring *responses = &session(session_id)->shm->responses;
+  int result = ring_put_or_wait(responses, &session(session_id)->parked_response);
+  if (result == 0 && ring_wake_needed(responses))
+  {
+    ring_wake(responses);
+  }
+  pthread_mutex_unlock(&session(session_id)->send_lock);
+
+  if (result == 1)
+  {
+    return 1;
+  }
+  session(session_id)->parked = 0;
+  return 0;
+}
+
+// The client rings its socket only once the server sleeps on the request ring,
+// or waits for room in the response ring. Requests are then taken from the
+// ring until it stays empty for a while, so a busy client is served without
+// any system call, but at most RING_FRAMES_PER_TURN of them before the other
+// sessions get their turn
+// @return 1 if requests are left for another turn, 0 otherwise
+static int handle_ring_session(int session_id)
+{
+  char doorbell[64];
+  ssize_t n = read(session(session_id)->req_fd, doorbell, sizeof(doorbell));
+  if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    printf("Client %d went away\n", session_id);
+    end_session(session_id);
+    return 0;
+  }
+
+  if (session(session_id)->parked && unpark_session(session_id) != 0)
+  {
+    return 0;
+  }
 
-    printf("Waiting for client connection...\n");
-    sleep(1);
+  for (int handled = 0; session(session_id)->shm != NULL && !session(session_id)->parked; handled++)
+  {
+    Ring *requests = &session(session_id)->shm->requests;
+    if (ring_empty(requests) && !ring_spin(requests) && ring_prepare_sleep(requests))
+    {
+      return 0;
+    }
+    if (handled == RING_FRAMES_PER_TURN)
+    {
+      return 1;
+    }
 
-    printf("sigusr1_received: %d\n", sigusr1_received);
-    // Handle SIGUSR1
-    if (sigusr1_received)
+    if (receive_request(session(session_id)->req_fd, session_id) == -1 &&
+        session(session_id)->req_fd != -1)
     {
-      printf("SIGUSR1 received in hostess thread\n");
+      printf("Client %d sent an invalid request\n", session_id);
+      end_session(session_id);
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void handle_session(int session_id, unsigned int generation)
+{
+  pthread_mutex_lock(&session(session_id)->lock);
+
+  // The session was evicted after the event was reported
+  if (session(session_id)->generation != generation)
+  {
+    pthread_mutex_unlock(&session(session_id)->lock);
+    return;
+  }
+
+  int req_fd = session(session_id)->req_fd;
+  int more = 0;
+  if (req_fd != -1 && session(session_id)->shm != NULL)
+  {
+    more = handle_ring_session(session_id);
+  }
+  else if (req_fd != -1 && receive_request(req_fd, session_id) == -1 &&
+           session(session_id)->req_fd != -1)
+  {
+    // The client closed its request pipe without DISCONNECT
+    printf("Client %d went away\n", session_id);
+    end_session(session_id);
+  }
+
+  // Closing the request pipe (DISCONNECT) also removed it from epoll
+  if (session(session_id)->req_fd != -1 && more)
+  {
+    requeue_fd(session(session_id)->req_fd, session_event(session_id));
+  }
+  else if (session(session_id)->req_fd != -1)
+  {
+    watch_fd(EPOLL_CTL_MOD, session(session_id)->req_fd, session_event(session_id));
+  }
+
+  pthread_mutex_unlock(&session(session_id)->lock);
+}
+
+// Session worker: the workers share one epoll instance that multiplexes the
+// server pipe and socket, SIGUSR1, evictions, the CONNECTs waiting for their
+// FIFOs and the request pipe of every session, and each one handles a ready
+// fd at a time
+static void *session_worker(void *arg)
+{
+  (void)arg;
 
-      // Elimina todas as subscrições e encerra os FIFOs
-      for (int i = 0; i < MAX_NUMBER_SESSIONS; i++)
+  while (1)
+  {
+    struct epoll_event event;
+    int ready = epoll_wait(epoll_fd, &event, 1, -1);
+    if (ready == -1)
+    {
+      if (errno != EINTR)
       {
-        if (client_threads[i].free == 0)
-        {
-          clean_pipes(i);
-          free_thread(i);
-        }
+        perror("epoll_wait");
+        return NULL;
       }
-      sigusr1_received = 0;
-      printf("All clients terminated\n");
+      continue;
     }
 
-    // Receive Request - Register client - Send Response
-    receive_request(server_pipe_path, -1);
+    switch ((uint32_t)event.data.u64)
+    {
+    case SERVER_PIPE_EVENT:
+      if (accepting_connects(PAUSED_SERVER_PIPE))
+      {
+        handle_server_pipe();
+      }
+      break;
+
+    case SIGNAL_EVENT:
+      handle_sigusr1();
+      watch_fd(EPOLL_CTL_MOD, signal_fd, SIGNAL_EVENT);
+      break;
+
+    case LISTEN_EVENT:
+      if (accepting_connects(PAUSED_LISTEN))
+      {
+        accept_client();
+        watch_fd(EPOLL_CTL_MOD, listen_fd, LISTEN_EVENT);
+      }
+      break;
+
+    case OPEN_EVENT:
+      retry_connects();
+      watch_fd(EPOLL_CTL_MOD, open_timer_fd, OPEN_EVENT);
+      break;
+
+    case EVICT_EVENT:
+      handle_evictions();
+      watch_fd(EPOLL_CTL_MOD, evict_fd, EVICT_EVENT);
+      break;
 
-    printf("Response sent to client\n");
-    printf("\n-----------------------\n");
+    default:
+      handle_session((int)(uint32_t)event.data.u64, (unsigned int)(event.data.u64 >> 32));
+      break;
+    }
   }
 
   return NULL;
 }
 
-static void dispatch_threads(DIR *dir)
+// Sets up the epoll instance with the server pipe and socket and SIGUSR1,
+// which is blocked in every thread and read from a signalfd instead, and
+// starts the notification dispatchers
+static int init_sessions(void)
+{
+  size_t num_chunks = (max_sessions + SESSION_CHUNK_SIZE - 1) / SESSION_CHUNK_SIZE;
+  session_chunks = calloc(num_chunks, sizeof(struct client_t *));
+  if (session_chunks == NULL)
+  {
+    fprintf(stderr, "Failed to allocate sessions\n");
+    return 1;
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+
+  epoll_fd = epoll_create1(0);
+  signal_fd = signalfd(-1, &mask, 0);
+  evict_fd = eventfd(0, EFD_NONBLOCK);
+  open_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (epoll_fd == -1 || signal_fd == -1 || evict_fd == -1 || open_timer_fd == -1)
+  {
+    perror("Failed to set up session events");
+    return 1;
+  }
+
+  if (notifier_init(notify_overflow, deliver_notifications, evict_subscriber) != 0)
+  {
+    fprintf(stderr, "Failed to start notification dispatchers\n");
+    return 1;
+  }
+
+  if (watch_fd(EPOLL_CTL_ADD, signal_fd, SIGNAL_EVENT) != 0 ||
+      watch_fd(EPOLL_CTL_ADD, evict_fd, EVICT_EVENT) != 0 ||
+      watch_fd(EPOLL_CTL_ADD, open_timer_fd, OPEN_EVENT) != 0 || open_server_pipe() != 0)
+  {
+    return 1;
+  }
+  if (server_socket_path[0] != '\0' && open_server_socket() != 0)
+  {
+    return 1;
+  }
+  return 0;
+}
+
+static void dispatch_threads(void)
 {
-  pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  // extra slots for the session workers
+  pthread_t *threads = malloc((max_threads + NUM_SESSION_WORKERS) * sizeof(pthread_t));
 
   if (threads == NULL)
   {
@@ -829,60 +2152,61 @@ static void dispatch_threads(DIR *dir)
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory,
-                                   PTHREAD_MUTEX_INITIALIZER};
+  // Every thread inherits the mask, so SIGUSR1 only reaches the signalfd
+  block_sigusr1();
 
   for (size_t i = 0; i < max_threads; i++)
   {
-    if (pthread_create(&threads[i], NULL, get_file, (void *)&thread_data) !=
-        0)
+    if (pthread_create(&threads[i], NULL, get_file, NULL) != 0)
     {
       fprintf(stderr, "Failed to create thread %zu\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
       return;
     }
   }
 
-  // thread para ler do FIFO de registo (server_pipe_path)
-  if (pthread_create(&threads[max_threads], NULL, hostess_thread, NULL) != 0)
+  if (init_sessions() != 0)
   {
-    fprintf(stderr, "Failed to create hostess thread\n");
-    pthread_mutex_destroy(&thread_data.directory_mutex);
+    fprintf(stderr, "Failed to initialize sessions\n");
     free(threads);
     return;
   }
 
-  // initiate client manager threads based in MAX_NUMBER_SESSIONS, and pass the to thread id
-  for (unsigned int i = 0; i < MAX_NUMBER_SESSIONS; i++)
+  for (size_t i = 0; i < NUM_SESSION_WORKERS; i++)
   {
-    client_threads[i].id = i;
-    client_threads[i].free = 1;
-    if (pthread_create(&client_threads[i].thread, NULL, client_manager_thread, &client_threads[i].id) != 0)
+    if (pthread_create(&threads[max_threads + i], NULL, session_worker, NULL) != 0)
     {
-      fprintf(stderr, "Failed to create client manager thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
+      fprintf(stderr, "Failed to create session worker %zu\n", i);
       free(threads);
       return;
     }
   }
 
+  // Feed the workers: in watch mode the directory is watched before it is
+  // scanned, so files created meanwhile are not missed (duplicates are
+  // dropped by the queue); otherwise the queue is closed after the scan and
+  // the workers exit once it drains
+  if (watch_jobs && jobs_watch_start() != 0)
+  {
+    fprintf(stderr, "Failed to watch directory, running existing jobs only\n");
+    watch_jobs = 0;
+  }
+  jobs_scan_directory();
+  if (!watch_jobs)
+  {
+    jobs_close();
+  }
+
   for (unsigned int i = 0; i < max_threads; i++)
   {
     if (pthread_join(threads[i], NULL) != 0)
     {
       fprintf(stderr, "Failed to join thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
       return;
     }
   }
 
-  if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0)
-  {
-    fprintf(stderr, "Failed to destroy directory_mutex\n");
-  }
-
   free(threads);
 }
 
@@ -911,11 +2235,8 @@ int init_server_pipe()
 
 int main(int argc, char **argv)
 {
-  struct sigaction sa;
-  sa.sa_handler = handle_sigusr1;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigaction(SIGUSR1, &sa, NULL);
+  // A client that dies makes writes to its pipes fail with EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
 
   if (argc < 5)
   {
@@ -924,10 +2245,71 @@ int main(int argc, char **argv)
     write_str(STDERR_FILENO, " <jobs_dir>");
     write_str(STDERR_FILENO, " <max_threads>");
     write_str(STDERR_FILENO, " <max_backups>");
-    write_str(STDERR_FILENO, " <nome_do_server_pipe>\n");
+    write_str(STDERR_FILENO, " <nome_do_server_pipe>");
+    write_str(STDERR_FILENO, " [--watch] [--virtual-time] [--combine-writes] [--socket] [--max-sessions <n>]");
+    write_str(STDERR_FILENO, " [--notify-overflow drop-oldest|coalesce|disconnect]\n");
     return 1;
   }
 
+  for (int i = 5; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--watch") == 0)
+    {
+      watch_jobs = 1;
+    }
+    else if (strcmp(argv[i], "--virtual-time") == 0)
+    {
+      // WAITs advance a simulated clock instead of sleeping (replay/benchmark)
+      vclock_use_virtual_time();
+    }
+    else if (strcmp(argv[i], "--combine-writes") == 0)
+    {
+      combine_writes = 1;
+    }
+    else if (strcmp(argv[i], "--socket") == 0)
+    {
+      // Also accept sessions over a Unix socket next to the server pipe
+      snprintf(server_socket_path, sizeof(server_socket_path), "/tmp/server_%s.sock", argv[4]);
+    }
+    else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc)
+    {
+      char *end;
+      max_sessions = strtoul(argv[++i], &end, 10);
+      if (*end != '\0' || max_sessions == 0 || max_sessions > INT_MAX)
+      {
+        fprintf(stderr, "Invalid max_sessions value\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--notify-overflow") == 0 && i + 1 < argc)
+    {
+      // What to do with a subscriber that has too many pending notifications
+      i++;
+      if (strcmp(argv[i], "drop-oldest") == 0)
+      {
+        notify_overflow = NOTIFY_DROP_OLDEST;
+      }
+      else if (strcmp(argv[i], "coalesce") == 0)
+      {
+        notify_overflow = NOTIFY_COALESCE;
+      }
+      else if (strcmp(argv[i], "disconnect") == 0)
+      {
+        notify_overflow = NOTIFY_DISCONNECT;
+      }
+      else
+      {
+        fprintf(stderr, "Invalid notify_overflow value\n");
+        return 1;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
   jobs_directory = argv[1];
 
   // Absolute path to pipe server: /tmp/server_[pipe]
@@ -968,27 +2350,35 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (subscriptions_init())
+  {
+    write_str(STDERR_FILENO, "Failed to initialize subscriptions\n");
+    return 1;
+  }
+
   if (init_server_pipe())
   {
     write_str(STDERR_FILENO, "Failed to initialize server pipe\n");
     return 1;
   }
 
-  DIR *dir = opendir(argv[1]);
-  if (dir == NULL)
+  if (jobs_init(jobs_directory))
   {
-    fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
-    return 0;
+    write_str(STDERR_FILENO, "Failed to initialize job queue\n");
+    return 1;
   }
 
-  dispatch_threads(dir);
+  uint64_t start_ms = vclock_now_ms();
+  dispatch_threads();
 
-  if (closedir(dir) == -1)
+  if (vclock_is_virtual())
   {
-    fprintf(stderr, "Failed to close directory\n");
-    return 0;
+    printf("Jobs finished after %lu ms of simulated time\n",
+           (unsigned long)(vclock_now_ms() - start_ms));
   }
 
+  jobs_terminate();
+
   while (active_backups > 0)
   {
     wait(NULL);
@@ -1001,10 +2391,17 @@ int main(int argc, char **argv)
     perror("Failed to delete server pipe");
     return 1;
   }
+  if (server_socket_path[0] != '\0' && unlink(server_socket_path) != 0)
+  {
+    perror("Failed to delete server socket");
+    return 1;
+  }
 
-  // wait for hostess thread to finish
+  // wait for the session workers to finish
   pthread_exit(NULL);
 
+  notifier_terminate();
+  subscriptions_terminate();
   kvs_terminate();
 
   return 0;
@@ -0,0 +1,251 @@
+#include "notifier.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/common/hash.h"
+
+static struct {
+  NotifyOverflow policy;
+  NotifyDeliver deliver;
+  NotifyEvict evict;
+
+  // Queues with notifications to deliver, in the order they became ready
+  NotifyQueue *head;
+  NotifyQueue *tail;
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+
+  pthread_t workers[NUM_NOTIFY_WORKERS];
+  size_t num_workers;
+} dispatcher = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                .not_empty = PTHREAD_COND_INITIALIZER};
+
+static size_t hash_key(const char *key) {
+  return hash_string(key) % NOTIFY_QUEUE_BUCKETS;
+}
+
+// Finds the link to the pending entry of a key, or to the end of its chain
+static int *find_pending(NotifyQueue *queue, size_t bucket, const char *key) {
+  int *link = &queue->buckets[bucket];
+  while (*link != 0 && strcmp(queue->entries[*link - 1].key, key) != 0) {
+    link = &queue->chain[*link - 1];
+  }
+  return link;
+}
+
+static void free_notification(Notification *notification) {
+  free(notification->key);
+  notification->key = NULL;
+  notification->value = NULL;
+}
+
+// Appends a queue to the ready list, with its lock held
+static void schedule(NotifyQueue *queue) {
+  queue->scheduled = 1;
+  queue->next = NULL;
+
+  pthread_mutex_lock(&dispatcher.mutex);
+  if (dispatcher.tail == NULL) {
+    dispatcher.head = queue;
+  } else {
+    dispatcher.tail->next = queue;
+  }
+  dispatcher.tail = queue;
+  pthread_cond_signal(&dispatcher.not_empty);
+  pthread_mutex_unlock(&dispatcher.mutex);
+}
+
+static NotifyQueue *next_ready(void) {
+  pthread_mutex_lock(&dispatcher.mutex);
+  while (dispatcher.head == NULL && !dispatcher.stopping) {
+    pthread_cond_wait(&dispatcher.not_empty, &dispatcher.mutex);
+  }
+
+  NotifyQueue *queue = dispatcher.head;
+  if (queue != NULL) {
+    dispatcher.head = queue->next;
+    if (dispatcher.head == NULL) {
+      dispatcher.tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&dispatcher.mutex);
+  return queue;
+}
+
+// Delivers every pending notification of a queue at a time. Writers keep
+// appending to the queue meanwhile; what they add is delivered next round
+static void dispatch(NotifyQueue *queue) {
+  Notification batch[NOTIFY_QUEUE_SIZE];
+
+  pthread_mutex_lock(&queue->lock);
+  size_t count = queue->count;
+  for (size_t i = 0; i < count; i++) {
+    batch[i] = queue->entries[(queue->head + i) % NOTIFY_QUEUE_SIZE];
+  }
+  queue->head = 0;
+  queue->count = 0;
+  if (dispatcher.policy == NOTIFY_COALESCE) {
+    memset(queue->buckets, 0, sizeof(queue->buckets));
+  }
+  queue->delivering = 1;
+  pthread_mutex_unlock(&queue->lock);
+
+  if (count > 0 && dispatcher.deliver(queue->session_id, batch, count) != 0) {
+    fprintf(stderr, "Failed to deliver notifications to client %d\n",
+            queue->session_id);
+  }
+  for (size_t i = 0; i < count; i++) {
+    free_notification(&batch[i]);
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  int evict = queue->overflowed;
+  queue->overflowed = 0;
+  pthread_mutex_unlock(&queue->lock);
+
+  // Still delivering, so the session cannot end and be reused meanwhile
+  if (evict) {
+    dispatcher.evict(queue->session_id);
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->delivering = 0;
+  if (queue->count > 0) {
+    schedule(queue);
+  } else {
+    queue->scheduled = 0;
+  }
+  pthread_cond_broadcast(&queue->idle);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void *notify_worker(void *arg) {
+  (void)arg;
+  NotifyQueue *queue;
+  while ((queue = next_ready()) != NULL) {
+    dispatch(queue);
+  }
+  return NULL;
+}
+
+int notifier_init(NotifyOverflow policy, NotifyDeliver deliver,
+                  NotifyEvict evict) {
+  dispatcher.policy = policy;
+  dispatcher.deliver = deliver;
+  dispatcher.evict = evict;
+  dispatcher.stopping = 0;
+
+  for (size_t i = 0; i < NUM_NOTIFY_WORKERS; i++) {
+    if (pthread_create(&dispatcher.workers[i], NULL, notify_worker, NULL) !=
+        0) {
+      notifier_terminate();
+      return 1;
+    }
+    dispatcher.num_workers++;
+  }
+  return 0;
+}
+
+void notifier_terminate() {
+  pthread_mutex_lock(&dispatcher.mutex);
+  dispatcher.stopping = 1;
+  dispatcher.head = NULL;
+  dispatcher.tail = NULL;
+  pthread_cond_broadcast(&dispatcher.not_empty);
+  pthread_mutex_unlock(&dispatcher.mutex);
+
+  for (size_t i = 0; i < dispatcher.num_workers; i++) {
+    pthread_join(dispatcher.workers[i], NULL);
+  }
+  dispatcher.num_workers = 0;
+}
+
+void notify_queue_init(NotifyQueue *queue, int session_id) {
+  memset(queue, 0, sizeof(NotifyQueue));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->idle, NULL);
+  queue->session_id = session_id;
+}
+
+int notifier_push(NotifyQueue *queue, const char *key, const char *value) {
+  size_t key_size = strlen(key) + 1;
+  size_t value_size = value == NULL ? 0 : strlen(value) + 1;
+  Notification notification = {malloc(key_size + value_size), NULL};
+  if (notification.key == NULL) {
+    return -1;
+  }
+  memcpy(notification.key, key, key_size);
+  if (value != NULL) {
+    notification.value = notification.key + key_size;
+    memcpy(notification.value, value, value_size);
+  }
+
+  int result = 0;
+  size_t bucket = hash_key(key);
+  pthread_mutex_lock(&queue->lock);
+  if (dispatcher.policy == NOTIFY_COALESCE) {
+    int *pending = find_pending(queue, bucket, key);
+    if (*pending != 0) {
+      // Only the newest value is delivered, in the place of the first one
+      free_notification(&queue->entries[*pending - 1]);
+      queue->entries[*pending - 1] = notification;
+      queue->coalesced++;
+      pthread_mutex_unlock(&queue->lock);
+      return 0;
+    }
+  }
+
+  if (queue->count == NOTIFY_QUEUE_SIZE) {
+    result = 1;
+    queue->dropped++;
+
+    if (dispatcher.policy == NOTIFY_DISCONNECT) {
+      queue->overflowed = 1;
+      free_notification(&notification);
+      pthread_mutex_unlock(&queue->lock);
+      return result;
+    }
+
+    Notification *oldest = &queue->entries[queue->head];
+    if (dispatcher.policy == NOTIFY_COALESCE) {
+      int *link = find_pending(queue, hash_key(oldest->key), oldest->key);
+      *link = queue->chain[queue->head];
+    }
+    free_notification(oldest);
+    queue->head = (queue->head + 1) % NOTIFY_QUEUE_SIZE;
+    queue->count--;
+  }
+
+  size_t slot = (queue->head + queue->count) % NOTIFY_QUEUE_SIZE;
+  queue->entries[slot] = notification;
+  queue->count++;
+  if (dispatcher.policy == NOTIFY_COALESCE) {
+    queue->chain[slot] = queue->buckets[bucket];
+    queue->buckets[bucket] = (int)slot + 1;
+  }
+  if (!queue->scheduled) {
+    schedule(queue);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return result;
+}
+
+void notifier_clear(NotifyQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->delivering) {
+    pthread_cond_wait(&queue->idle, &queue->lock);
+  }
+  for (size_t i = 0; i < queue->count; i++) {
+    free_notification(&queue->entries[(queue->head + i) % NOTIFY_QUEUE_SIZE]);
+  }
+  queue->head = 0;
+  queue->count = 0;
+  memset(queue->buckets, 0, sizeof(queue->buckets));
+  queue->coalesced = 0;
+  queue->dropped = 0;
+  queue->overflowed = 0;
+  pthread_mutex_unlock(&queue->lock);
+}
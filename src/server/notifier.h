@@ -0,0 +1,85 @@
+#ifndef KVS_NOTIFIER_H
+#define KVS_NOTIFIER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define NOTIFY_QUEUE_SIZE 256 // notifications pending per subscriber
+#define NOTIFY_QUEUE_BUCKETS (2 * NOTIFY_QUEUE_SIZE) // to find pending keys
+#define NUM_NOTIFY_WORKERS 2  // threads delivering notifications
+
+/// What a subscriber is sent, and what happens to a notification for a
+/// subscriber whose queue is full.
+typedef enum {
+  NOTIFY_DROP_OLDEST, // every change; the oldest pending one is dropped
+  NOTIFY_COALESCE,    // only the newest value of a key while it is pending;
+                      // the oldest pending key is dropped
+  NOTIFY_DISCONNECT   // every change; the subscriber is evicted
+} NotifyOverflow;
+
+/// A change of a key, as delivered to a subscriber. value points into the
+/// same allocation as key, and is NULL if the key was deleted.
+typedef struct {
+  char *key;
+  char *value;
+} Notification;
+
+/// Notifications waiting to be delivered to one subscriber. Writers append
+/// to it and a dispatcher thread takes every pending notification at once,
+/// so a slow subscriber only holds back its own queue. With NOTIFY_COALESCE,
+/// a write to a key already pending replaces its value in place, found
+/// through a hash table of the pending keys.
+typedef struct NotifyQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;           // signaled when a delivery ends
+  Notification entries[NOTIFY_QUEUE_SIZE]; // circular, oldest at head
+  size_t head;
+  size_t count;
+  int buckets[NOTIFY_QUEUE_BUCKETS]; // first entry of the bucket + 1, or 0
+  int chain[NOTIFY_QUEUE_SIZE];  // next entry of the same bucket + 1, or 0
+  size_t coalesced;              // notifications replaced by a newer value
+  size_t dropped;                // notifications lost to overflow
+  int session_id;
+  int scheduled;                 // on the ready list or being delivered
+  int delivering;
+  int overflowed;                // to be evicted, with NOTIFY_DISCONNECT
+  struct NotifyQueue *next;      // in the ready list
+} NotifyQueue;
+
+/// Sends notifications to a subscriber, from a dispatcher thread, oldest
+/// first.
+/// @return 0 if they were delivered, 1 otherwise.
+typedef int (*NotifyDeliver)(int session_id, Notification *notifications,
+                             size_t count);
+
+/// Evicts a subscriber whose queue overflowed with NOTIFY_DISCONNECT. Called
+/// from a dispatcher thread, which is still delivering to the subscriber so
+/// notifier_clear waits for it.
+typedef void (*NotifyEvict)(int session_id);
+
+/// Starts the dispatcher threads.
+/// @param policy What to do when a subscriber's queue is full.
+/// @return 0 if the threads were started successfully, 1 otherwise.
+int notifier_init(NotifyOverflow policy, NotifyDeliver deliver,
+                  NotifyEvict evict);
+
+/// Stops the dispatcher threads, dropping any pending notification.
+void notifier_terminate();
+
+/// Initializes the queue of a subscriber.
+void notify_queue_init(NotifyQueue *queue, int session_id);
+
+/// Queues a notification for a subscriber and schedules its delivery, or
+/// replaces the value of a pending notification of the same key. Never waits
+/// for the subscriber.
+/// @param value New value of the key, NULL if it was deleted.
+/// @return 0 if the notification was queued, 1 if the queue overflowed, -1
+/// if it could not be allocated.
+int notifier_push(NotifyQueue *queue, const char *key, const char *value);
+
+/// Drops the pending notifications of a subscriber and waits for a delivery
+/// in progress, so it can be closed or reused. Nothing may be pushed to the
+/// queue meanwhile.
+void notifier_clear(NotifyQueue *queue);
+
+#endif // KVS_NOTIFIER_H
@@ -8,17 +8,25 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "changelog.h"
 #include "constants.h"
 #include "io.h"
 #include "kvs.h"
+#include "reclaim.h"
+#include "vclock.h"
+
+// Pairs copied per read lock acquisition by SHOW
+#define SHOW_CHUNK_SIZE 256
 
 static struct HashTable *kvs_table = NULL;
 
-/// Calculates a timespec from a delay in milliseconds.
-/// @param delay_ms Delay in milliseconds.
-/// @return Timespec with the given delay.
-static struct timespec delay_to_timespec(unsigned int delay_ms) {
-  return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
+/// Writes the output entry of a key that could not be deleted.
+/// @param fd File descriptor to write the output.
+/// @param key Key that was missing.
+static void write_missing(int fd, const char *key) {
+  char str[MAX_STRING_SIZE];
+  snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", key);
+  write_str(fd, str);
 }
 
 int kvs_init() {
@@ -28,7 +36,10 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  if (kvs_table == NULL || changelog_init() != 0) {
+    return 1;
+  }
+  return reclaim_init();
 }
 
 int kvs_terminate() {
@@ -39,9 +50,74 @@ int kvs_terminate() {
 
   free_table(kvs_table);
   kvs_table = NULL;
+  reclaim_terminate();
+  changelog_terminate();
+  return 0;
+}
+
+/// A pair whose node is allocated before taking the table lock.
+typedef struct PreparedWrite {
+  int index;    // bucket of the key
+  size_t order; // position in the request, so later writes still win
+  KeyNode *node;
+} PreparedWrite;
+
+/// Hashes and allocates a pair outside the critical section.
+/// @return 0 if the pair was prepared, 1 otherwise (the error is reported).
+static int prepare_write(PreparedWrite *prepared, size_t order,
+                         const char *key, const char *value) {
+  prepared->index = hash(key);
+  prepared->order = order;
+  prepared->node = NULL;
+  if (prepared->index < 0 ||
+      (prepared->node = create_pair_node(key, value)) == NULL) {
+    fprintf(stderr, "Failed to write key pair (%s,%s)\n", key, value);
+    return 1;
+  }
   return 0;
 }
 
+static int compare_prepared(const void *a, const void *b) {
+  const PreparedWrite *pa = a;
+  const PreparedWrite *pb = b;
+  if (pa->index != pb->index) {
+    return pa->index < pb->index ? -1 : 1;
+  }
+  return pa->order < pb->order ? -1 : (pa->order > pb->order);
+}
+
+/// Links prepared pairs into the table and logs them. Must hold the table
+/// write lock. Each node that was not inserted is left in prepared[i].node,
+/// holding the displaced value, for release_prepared to free after the lock
+/// is released.
+static void link_prepared(PreparedWrite *prepared, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    changelog_append(prepared[i].node->key, prepared[i].node->value);
+    prepared[i].node =
+        link_pair_node(kvs_table, prepared[i].index, prepared[i].node);
+  }
+}
+
+static void release_prepared(PreparedWrite *prepared, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    reclaim_retire(prepared[i].node);
+  }
+  reclaim_flush();
+}
+
+/// Links prepared pairs in bucket order under a single write lock, then
+/// releases them and the array.
+static void apply_prepared(PreparedWrite *prepared, size_t count) {
+  qsort(prepared, count, sizeof(PreparedWrite), compare_prepared);
+
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  link_prepared(prepared, count);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  release_prepared(prepared, count);
+  free(prepared);
+}
+
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]) {
   if (kvs_table == NULL) {
@@ -49,29 +125,153 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  // Hash, allocate and group by bucket before locking, so the critical
+  // section only splices pointers
+  PreparedWrite *prepared = malloc(num_pairs * sizeof(PreparedWrite));
+  if (prepared == NULL && num_pairs > 0) {
+    fprintf(stderr, "Failed to allocate write batch\n");
+    return 1;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (prepare_write(&prepared[count], i, keys[i], values[i]) == 0) {
+      count++;
+    }
+  }
+  apply_prepared(prepared, count);
+  return 0;
+}
 
+int kvs_write_pairs(size_t num_pairs, const char *const keys[],
+                    const char *const values[]) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  PreparedWrite *prepared = malloc(num_pairs * sizeof(PreparedWrite));
+  if (prepared == NULL && num_pairs > 0) {
+    fprintf(stderr, "Failed to allocate write batch\n");
+    return 1;
+  }
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    if (prepare_write(&prepared[i], i, keys[i], values[i]) != 0) {
+      release_prepared(prepared, i);
+      free(prepared);
+      return 1;
+    }
+  }
+  apply_prepared(prepared, num_pairs);
+  return 0;
+}
+
+int kvs_apply_batch(WriteBatch *batch, int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // Keys are unique within a batch, so written pairs can be prepared and
+  // linked in bucket order regardless of the deletes
+  PreparedWrite *prepared = malloc(batch->num_entries * sizeof(PreparedWrite));
+  if (prepared == NULL && batch->num_entries > 0) {
+    fprintf(stderr, "Failed to allocate write batch\n");
+    return 1;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < batch->num_entries; i++) {
+    BatchEntry *entry = &batch->entries[i];
+    if (!entry->deleted &&
+        prepare_write(&prepared[count], i, entry->key, entry->value) == 0) {
+      count++;
     }
   }
+  qsort(prepared, count, sizeof(PreparedWrite), compare_prepared);
+
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+
+  // The first mutation of a key in the batch sees the table as it was before
+  // the batch, so resolve those before applying anything
+  for (size_t i = 0; i < batch->num_deletes; i++) {
+    BatchDelete *delete = &batch->deletes[i];
+    if (delete->state == BATCH_KEY_UNKNOWN) {
+      delete->state =
+          check_pair(kvs_table, batch->entries[delete->entry].key) == 0
+              ? BATCH_KEY_PRESENT
+              : BATCH_KEY_MISSING;
+    }
+  }
+
+  for (size_t i = 0; i < batch->num_entries; i++) {
+    if (batch->entries[i].deleted &&
+        delete_pair(kvs_table, batch->entries[i].key) == 0) {
+      changelog_append(batch->entries[i].key, NULL);
+    }
+  }
+  link_prepared(prepared, count);
 
   pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  release_prepared(prepared, count);
+  free(prepared);
+
+  // One output line per DELETE command that had missing keys
+  for (size_t i = 0; i < batch->num_deletes;) {
+    size_t command = batch->deletes[i].command;
+    int aux = 0;
+    for (; i < batch->num_deletes && batch->deletes[i].command == command;
+         i++) {
+      if (batch->deletes[i].state != BATCH_KEY_MISSING) {
+        continue;
+      }
+      if (!aux) {
+        write_str(fd, "[");
+        aux = 1;
+      }
+      write_missing(fd, batch->entries[batch->deletes[i].entry].key);
+    }
+    if (aux) {
+      write_str(fd, "]\n");
+    }
+  }
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_read_values(size_t num_pairs, const char *const keys[],
+                    char *values[]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
   pthread_rwlock_rdlock(&kvs_table->tablelock);
+  read_pairs(kvs_table, num_pairs, keys, values);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  const char **key_ptrs = malloc(num_pairs * sizeof(char *));
+  char **results = malloc(num_pairs * sizeof(char *));
+  if ((key_ptrs == NULL || results == NULL) && num_pairs > 0) {
+    fprintf(stderr, "Failed to allocate read batch\n");
+    free(key_ptrs);
+    free(results);
+    return 1;
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    key_ptrs[i] = keys[i];
+  }
+
+  if (kvs_read_values(num_pairs, key_ptrs, results) != 0) {
+    free(key_ptrs);
+    free(results);
+    return 1;
+  }
 
   write_str(fd, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
+    char *result = results[i];
     char aux[MAX_STRING_SIZE];
     if (result == NULL) {
       snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
@@ -83,7 +283,8 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   }
   write_str(fd, "]\n");
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  free(key_ptrs);
+  free(results);
   return 0;
 }
 
@@ -111,14 +312,14 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
 
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (delete_pair(kvs_table, keys[i]) == 0) {
+      changelog_append(keys[i], NULL);
+    } else {
       if (!aux) {
         write_str(fd, "[");
         aux = 1;
       }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      write_missing(fd, keys[i]);
     }
   }
   if (aux) {
@@ -126,29 +327,186 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   }
 
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  reclaim_flush();
   return 0;
 }
 
+int kvs_delete_keys(size_t num_keys, const char *const keys[], int deleted[]) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < num_keys; i++) {
+    deleted[i] = delete_pair(kvs_table, keys[i]) == 0;
+    if (deleted[i]) {
+      changelog_append(keys[i], NULL);
+    }
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  reclaim_flush();
+  return 0;
+}
+
+/// Writes pairs as "(key, value)" lines with a single write.
+static void write_pairs(int fd, size_t count, char *keys[], char *values[]) {
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    len += strlen(keys[i]) + strlen(values[i]) + 5; // "(", ", ", ")\n"
+  }
+
+  char *out = malloc(len + 1);
+  if (out == NULL) {
+    fprintf(stderr, "Failed to allocate SHOW output\n");
+    return;
+  }
+  char *ptr = out;
+  *ptr = '\0';
+  for (size_t i = 0; i < count; i++) {
+    ptr += sprintf(ptr, "(%s, %s)\n", keys[i], values[i]);
+  }
+  write_str(fd, out);
+  free(out);
+}
+
+static void free_pairs(size_t count, char *keys[], char *values[]) {
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i]);
+    free(values[i]);
+  }
+}
+
 void kvs_show(int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+  // The lock is only held while copying each chunk, so writers can get in
+  // between chunks of a large table
+  char *keys[SHOW_CHUNK_SIZE];
+  char *values[SHOW_CHUNK_SIZE];
+  ScanCursor cursor = {0, NULL};
+  while (cursor.bucket < TABLE_SIZE) {
+    size_t count;
+    pthread_rwlock_rdlock(&kvs_table->tablelock);
+    int failed =
+        scan_pairs(kvs_table, &cursor, SHOW_CHUNK_SIZE, keys, values, &count);
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    if (failed) {
+      fprintf(stderr, "Failed to allocate SHOW output\n");
+      break;
+    }
+
+    write_pairs(fd, count, keys, values);
+    free_pairs(count, keys, values);
+  }
+  free(cursor.key);
+}
+
+typedef struct SortedPair {
+  char *key;
+  char *value;
+} SortedPair;
+
+static int compare_sorted_pairs(const void *a, const void *b) {
+  return strcmp(((const SortedPair *)a)->key, ((const SortedPair *)b)->key);
+}
+
+void kvs_show_sorted(int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+  // Collected in chunks like kvs_show, sorted once the lock is released
+  SortedPair *pairs = NULL;
+  size_t num_pairs = 0, capacity = 0;
+  char *keys[SHOW_CHUNK_SIZE];
+  char *values[SHOW_CHUNK_SIZE];
+  ScanCursor cursor = {0, NULL};
+  while (cursor.bucket < TABLE_SIZE) {
+    size_t count;
+    pthread_rwlock_rdlock(&kvs_table->tablelock);
+    int failed =
+        scan_pairs(kvs_table, &cursor, SHOW_CHUNK_SIZE, keys, values, &count);
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    if (failed) {
+      fprintf(stderr, "Failed to allocate SHOW output\n");
+      break;
+    }
+
+    if (num_pairs + count > capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : SHOW_CHUNK_SIZE;
+      while (new_capacity < num_pairs + count) {
+        new_capacity *= 2;
+      }
+      SortedPair *resized = realloc(pairs, new_capacity * sizeof(SortedPair));
+      if (resized == NULL) {
+        fprintf(stderr, "Failed to allocate SHOW output\n");
+        free_pairs(count, keys, values);
+        break;
+      }
+      pairs = resized;
+      capacity = new_capacity;
+    }
+    for (size_t i = 0; i < count; i++) {
+      pairs[num_pairs].key = keys[i];
+      pairs[num_pairs++].value = values[i];
     }
   }
+  free(cursor.key);
 
+  if (num_pairs > 0) {
+    qsort(pairs, num_pairs, sizeof(SortedPair), compare_sorted_pairs);
+  }
+  for (size_t base = 0; base < num_pairs; base += SHOW_CHUNK_SIZE) {
+    size_t count = num_pairs - base < SHOW_CHUNK_SIZE ? num_pairs - base
+                                                      : SHOW_CHUNK_SIZE;
+    for (size_t i = 0; i < count; i++) {
+      keys[i] = pairs[base + i].key;
+      values[i] = pairs[base + i].value;
+    }
+    write_pairs(fd, count, keys, values);
+    free_pairs(count, keys, values);
+  }
+  free(pairs);
+}
+
+int kvs_scan(uint64_t *cursor, char **key, size_t count, char *keys[],
+             char *values[], size_t *found) {
+  *found = 0;
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  if (*cursor > TABLE_SIZE) {
+    // Not a cursor this server handed out: nothing is left to return
+    free(*key);
+    *key = NULL;
+    *cursor = 0;
+    return 0;
+  }
+
+  // Cursor 0 is the start of the table, otherwise its bucket plus one
+  ScanCursor position = {0, NULL};
+  if (*cursor != 0) {
+    position.bucket = (int)(*cursor - 1);
+    position.key = *key;
+  } else {
+    free(*key);
+  }
+  *key = NULL;
+
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  int failed = scan_pairs(kvs_table, &position, count, keys, values, found);
   pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  *cursor = position.bucket >= TABLE_SIZE ? 0 : (uint64_t)position.bucket + 1;
+  *key = position.key;
+  return failed;
 }
 
 int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
@@ -191,7 +549,4 @@ int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
   return 0;
 }
 
-void kvs_wait(unsigned int delay_ms) {
-  struct timespec delay = delay_to_timespec(delay_ms);
-  nanosleep(&delay, NULL);
-}
+void kvs_wait(unsigned int delay_ms) { vclock_sleep(delay_ms); }
@@ -2,7 +2,9 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include "batch.h"
 #include "constants.h"
 
 /// Initializes the KVS state.
@@ -21,6 +23,23 @@ int kvs_terminate();
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]);
 
+/// Writes key value pairs given as strings of any length (session WRITE).
+/// The pairs are applied under a single lock acquisition, in order.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys.
+/// @param values Array of values.
+/// @return 0 if the pairs were written successfully, 1 otherwise (nothing
+/// is written).
+int kvs_write_pairs(size_t num_pairs, const char *const keys[],
+                    const char *const values[]);
+
+/// Applies a batch of combined WRITE/DELETE commands under a single lock
+/// acquisition. DELETE commands report missing keys exactly as kvs_delete.
+/// @param batch Batch of mutations (left unchanged).
+/// @param fd File descriptor to write the KVSMISSING output.
+/// @return 0 if the batch was applied successfully, 1 otherwise.
+int kvs_apply_batch(WriteBatch *batch, int fd);
+
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
@@ -28,6 +47,15 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
 /// @return 0 if the key reading, 1 otherwise.
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
+/// Reads values from the KVS into copies (session READ).
+/// @param num_pairs Number of keys to read.
+/// @param keys Array of keys.
+/// @param values Filled with copies of the values, NULL for missing keys (to
+/// be freed by the caller).
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_read_values(size_t num_pairs, const char *const keys[],
+                    char *values[]);
+
 /// Checks if a key exists in the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param key The key to be checked.
@@ -40,10 +68,39 @@ int kvs_check(char *key);
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
-/// Writes the state of the KVS.
+/// Deletes keys given as strings of any length (session DELETE).
+/// @param num_keys Number of keys to delete.
+/// @param keys Array of keys.
+/// @param deleted Set to 1 for each key that existed, 0 otherwise.
+/// @return 0 if the keys were deleted successfully, 1 otherwise.
+int kvs_delete_keys(size_t num_keys, const char *const keys[], int deleted[]);
+
+/// Writes the state of the KVS. The table is read in chunks, releasing the
+/// lock between them, so a SHOW of a large table does not stall writers.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes the state of the KVS sorted by key.
+/// @param fd File descriptor to write the output.
+void kvs_show_sorted(int fd);
+
+/// Reads one page of pairs (SCAN). Pages are not a snapshot: pairs changed
+/// between calls may or may not be returned, but those present for the
+/// whole scan are returned exactly once.
+/// @param cursor Bucket to resume in, 0 for the first page. Updated to the
+/// bucket of the next page, or 0 once the whole table was read.
+/// @param key Last key returned in that bucket, NULL to start at its first
+/// pair. Always freed, and updated to a key allocated for the next page (or
+/// NULL).
+/// @param count Maximum number of pairs to return.
+/// @param keys Filled with copies of the keys (to be freed by the caller).
+/// @param values Filled with copies of the values (to be freed by the caller).
+/// @param found Set to the number of pairs returned.
+/// @return 0 on success, 1 if out of memory, in which case no pairs are
+/// returned and the cursor is left where it was.
+int kvs_scan(uint64_t *cursor, char **key, size_t count, char *keys[],
+             char *values[], size_t *found);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
 /// @return 0 if the backup was successful, 1 otherwise.
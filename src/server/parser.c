@@ -134,8 +134,18 @@ enum Command get_next(int fd) {
     }
 
     if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
-      return CMD_INVALID;
+      if (buf[4] != ' ' || read(fd, buf + 5, 6) != 6 ||
+          strncmp(buf + 5, "SORTED", 6) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (read(fd, buf + 11, 1) != 0 && buf[11] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_SHOW_SORTED;
     }
 
     return CMD_SHOW;
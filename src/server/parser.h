@@ -10,6 +10,7 @@ enum Command {
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SHOW_SORTED,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
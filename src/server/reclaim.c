@@ -0,0 +1,135 @@
+#include "reclaim.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PENDING_INITIAL_CAPACITY 64
+
+// Nodes retired by this thread since its last flush, linked through next
+static _Thread_local KeyNode *retired = NULL;
+
+static struct {
+  KeyNode **pending; // chains handed over by reclaim_flush
+  size_t num_pending;
+  size_t capacity;
+  int running;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t has_work;
+} reclaimer = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+               .has_work = PTHREAD_COND_INITIALIZER};
+
+static void free_chain(KeyNode *head) {
+  while (head != NULL) {
+    KeyNode *next = head->next;
+    free_pair_node(head);
+    head = next;
+  }
+}
+
+static void *reclaim_thread(void *arg) {
+  (void)arg;
+
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&reclaimer.mutex);
+  while (reclaimer.running || reclaimer.num_pending > 0) {
+    if (reclaimer.num_pending == 0) {
+      pthread_cond_wait(&reclaimer.has_work, &reclaimer.mutex);
+      continue;
+    }
+
+    KeyNode *head = reclaimer.pending[--reclaimer.num_pending];
+    pthread_mutex_unlock(&reclaimer.mutex);
+    free_chain(head);
+    pthread_mutex_lock(&reclaimer.mutex);
+  }
+  pthread_mutex_unlock(&reclaimer.mutex);
+  return NULL;
+}
+
+int reclaim_init() {
+  pthread_mutex_lock(&reclaimer.mutex);
+  reclaimer.running = 1;
+  if (pthread_create(&reclaimer.thread, NULL, reclaim_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to create reclaimer thread\n");
+    reclaimer.running = 0;
+    pthread_mutex_unlock(&reclaimer.mutex);
+    return 1;
+  }
+  pthread_mutex_unlock(&reclaimer.mutex);
+  return 0;
+}
+
+void reclaim_terminate() {
+  reclaim_flush();
+
+  pthread_mutex_lock(&reclaimer.mutex);
+  if (!reclaimer.running) {
+    pthread_mutex_unlock(&reclaimer.mutex);
+    return;
+  }
+  reclaimer.running = 0;
+  pthread_cond_signal(&reclaimer.has_work);
+  pthread_mutex_unlock(&reclaimer.mutex);
+
+  pthread_join(reclaimer.thread, NULL);
+  free(reclaimer.pending);
+  reclaimer.pending = NULL;
+  reclaimer.capacity = 0;
+}
+
+void reclaim_retire(KeyNode *node) {
+  if (node == NULL) {
+    return;
+  }
+  node->next = retired;
+  retired = node;
+}
+
+void reclaim_retire_chain(KeyNode *head) {
+  if (head == NULL) {
+    return;
+  }
+  if (retired == NULL) {
+    retired = head;
+    return;
+  }
+  // Keep one chain per flush: hand the current list over first
+  reclaim_flush();
+  retired = head;
+}
+
+void reclaim_flush() {
+  KeyNode *head = retired;
+  if (head == NULL) {
+    return;
+  }
+  retired = NULL;
+
+  pthread_mutex_lock(&reclaimer.mutex);
+  if (reclaimer.running && reclaimer.num_pending == reclaimer.capacity) {
+    size_t capacity =
+        reclaimer.capacity ? reclaimer.capacity * 2 : PENDING_INITIAL_CAPACITY;
+    KeyNode **pending = realloc(reclaimer.pending, capacity * sizeof(KeyNode *));
+    if (pending != NULL) {
+      reclaimer.pending = pending;
+      reclaimer.capacity = capacity;
+    }
+  }
+
+  if (!reclaimer.running || reclaimer.num_pending == reclaimer.capacity) {
+    // No reclaimer (or no memory to queue): free it here, still unlocked
+    pthread_mutex_unlock(&reclaimer.mutex);
+    free_chain(head);
+    return;
+  }
+
+  reclaimer.pending[reclaimer.num_pending++] = head;
+  pthread_cond_signal(&reclaimer.has_work);
+  pthread_mutex_unlock(&reclaimer.mutex);
+}
@@ -0,0 +1,27 @@
+#ifndef KVS_RECLAIM_H
+#define KVS_RECLAIM_H
+
+#include "kvs.h"
+
+/// Starts the background reclaimer thread.
+/// @return 0 if the reclaimer was started successfully, 1 otherwise.
+int reclaim_init();
+
+/// Frees everything still pending and stops the reclaimer thread.
+void reclaim_terminate();
+
+/// Adds a node that was unlinked from the table to the calling thread's
+/// retire list. Cheap enough to be called while holding the table lock: the
+/// node is only freed after reclaim_flush.
+/// @param node Node to be freed (may be NULL).
+void reclaim_retire(KeyNode *node);
+
+/// Retires a whole chain of nodes, linked through next.
+/// @param head First node of the chain (may be NULL).
+void reclaim_retire_chain(KeyNode *head);
+
+/// Hands the calling thread's retire list to the reclaimer thread. Must be
+/// called after releasing the table lock.
+void reclaim_flush();
+
+#endif // KVS_RECLAIM_H
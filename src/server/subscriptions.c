@@ -0,0 +1,290 @@
+#include "subscriptions.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/common/hash.h"
+
+// Sessions subscribed to a key or pattern, in no particular order
+typedef struct {
+  int *sessions;
+  size_t count;
+  size_t capacity;
+} Subscribers;
+
+typedef struct SubscriberSet {
+  char *key;
+  Subscribers subscribers;
+  struct SubscriberSet *next;
+} SubscriberSet;
+
+// Node of the trie of prefix patterns: the path from the root spells the
+// prefix, and subscribers holds the sessions subscribed to <prefix>*
+typedef struct TrieNode {
+  unsigned char c;
+  Subscribers subscribers;
+  struct TrieNode *children;
+  struct TrieNode *sibling;
+} TrieNode;
+
+static SubscriberSet *buckets[SUBSCRIPTION_BUCKETS];
+static pthread_rwlock_t stripes[SUBSCRIPTION_STRIPES];
+
+static TrieNode trie;
+static pthread_rwlock_t trie_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Exact and prefix subscriptions in the whole index: with none, notifications
+// take no lock
+static atomic_size_t total = 0;
+static atomic_size_t patterns = 0;
+
+static size_t hash_key(const char *key) {
+  return hash_string(key) % SUBSCRIPTION_BUCKETS;
+}
+
+static pthread_rwlock_t *stripe_of(size_t bucket) {
+  return &stripes[bucket % SUBSCRIPTION_STRIPES];
+}
+
+static int subscribers_add(Subscribers *subscribers, int session_id) {
+  for (size_t i = 0; i < subscribers->count; i++) {
+    if (subscribers->sessions[i] == session_id) {
+      return 1;
+    }
+  }
+
+  if (subscribers->count == subscribers->capacity) {
+    size_t capacity = subscribers->capacity > 0 ? 2 * subscribers->capacity : 4;
+    int *sessions = realloc(subscribers->sessions, capacity * sizeof(int));
+    if (sessions == NULL) {
+      return -1;
+    }
+    subscribers->sessions = sessions;
+    subscribers->capacity = capacity;
+  }
+  subscribers->sessions[subscribers->count++] = session_id;
+  return 0;
+}
+
+static int subscribers_remove(Subscribers *subscribers, int session_id) {
+  for (size_t i = 0; i < subscribers->count; i++) {
+    if (subscribers->sessions[i] == session_id) {
+      subscribers->sessions[i] = subscribers->sessions[--subscribers->count];
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static size_t subscribers_call(Subscribers *subscribers,
+                               void (*fn)(int, void *), void *arg) {
+  for (size_t i = 0; i < subscribers->count; i++) {
+    fn(subscribers->sessions[i], arg);
+  }
+  return subscribers->count;
+}
+
+// Finds the subscribers of a key in its bucket, with the stripe locked
+static SubscriberSet **find_set(size_t bucket, const char *key) {
+  SubscriberSet **set = &buckets[bucket];
+  while (*set != NULL && strcmp((*set)->key, key) != 0) {
+    set = &(*set)->next;
+  }
+  return set;
+}
+
+static TrieNode *trie_child(TrieNode *node, unsigned char c) {
+  TrieNode *child = node->children;
+  while (child != NULL && child->c != c) {
+    child = child->sibling;
+  }
+  return child;
+}
+
+static void trie_free(TrieNode *node) {
+  while (node != NULL) {
+    TrieNode *sibling = node->sibling;
+    trie_free(node->children);
+    free(node->subscribers.sessions);
+    free(node);
+    node = sibling;
+  }
+}
+
+// Removes a session from the pattern spelled by prefix below *link, pruning
+// the nodes left without subscribers or children
+static int trie_remove(TrieNode **link, const char *prefix, size_t len,
+                       int session_id) {
+  TrieNode *node = *link;
+  int result;
+  if (len == 0) {
+    result = subscribers_remove(&node->subscribers, session_id);
+  } else {
+    TrieNode **child = &node->children;
+    while (*child != NULL && (*child)->c != (unsigned char)*prefix) {
+      child = &(*child)->sibling;
+    }
+    result = *child == NULL
+                 ? 1
+                 : trie_remove(child, prefix + 1, len - 1, session_id);
+  }
+
+  if (node != &trie && node->subscribers.count == 0 &&
+      node->children == NULL) {
+    *link = node->sibling;
+    free(node->subscribers.sessions);
+    free(node);
+  }
+  return result;
+}
+
+int subscription_is_pattern(const char *key) {
+  size_t len = strlen(key);
+  return len > 0 && key[len - 1] == SUBSCRIPTION_WILDCARD;
+}
+
+int subscriptions_init() {
+  for (size_t i = 0; i < SUBSCRIPTION_STRIPES; i++) {
+    if (pthread_rwlock_init(&stripes[i], NULL) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void subscriptions_terminate() {
+  for (size_t i = 0; i < SUBSCRIPTION_BUCKETS; i++) {
+    while (buckets[i] != NULL) {
+      SubscriberSet *set = buckets[i];
+      buckets[i] = set->next;
+      free(set->key);
+      free(set->subscribers.sessions);
+      free(set);
+    }
+  }
+  trie_free(trie.children);
+  free(trie.subscribers.sessions);
+  memset(&trie, 0, sizeof(trie));
+  atomic_store(&total, 0);
+  atomic_store(&patterns, 0);
+}
+
+// Adds a session to the trie node of a prefix, creating the missing nodes
+static int add_pattern(const char *prefix, size_t len, int session_id) {
+  pthread_rwlock_wrlock(&trie_lock);
+  TrieNode *node = &trie;
+  for (size_t i = 0; i < len; i++) {
+    TrieNode *child = trie_child(node, (unsigned char)prefix[i]);
+    if (child == NULL) {
+      if ((child = calloc(1, sizeof(TrieNode))) == NULL) {
+        // Nodes created so far are left without subscribers until pruned
+        pthread_rwlock_unlock(&trie_lock);
+        return -1;
+      }
+      child->c = (unsigned char)prefix[i];
+      child->sibling = node->children;
+      node->children = child;
+    }
+    node = child;
+  }
+
+  int result = subscribers_add(&node->subscribers, session_id);
+  if (result == 0) {
+    atomic_fetch_add(&patterns, 1);
+  }
+  pthread_rwlock_unlock(&trie_lock);
+  return result;
+}
+
+int subscriptions_add(const char *key, int session_id) {
+  if (subscription_is_pattern(key)) {
+    return add_pattern(key, strlen(key) - 1, session_id);
+  }
+
+  size_t bucket = hash_key(key);
+  pthread_rwlock_wrlock(stripe_of(bucket));
+
+  SubscriberSet **slot = find_set(bucket, key);
+  SubscriberSet *set = *slot;
+  if (set == NULL) {
+    set = calloc(1, sizeof(SubscriberSet));
+    if (set == NULL || (set->key = strdup(key)) == NULL) {
+      free(set);
+      pthread_rwlock_unlock(stripe_of(bucket));
+      return -1;
+    }
+    *slot = set;
+  }
+
+  // A set that was just created and could not grow is left empty, which
+  // lookups tolerate
+  int result = subscribers_add(&set->subscribers, session_id);
+  if (result == 0) {
+    atomic_fetch_add(&total, 1);
+  }
+
+  pthread_rwlock_unlock(stripe_of(bucket));
+  return result;
+}
+
+int subscriptions_remove(const char *key, int session_id) {
+  if (subscription_is_pattern(key)) {
+    pthread_rwlock_wrlock(&trie_lock);
+    TrieNode *root = &trie;
+    int result = trie_remove(&root, key, strlen(key) - 1, session_id);
+    if (result == 0) {
+      atomic_fetch_sub(&patterns, 1);
+    }
+    pthread_rwlock_unlock(&trie_lock);
+    return result;
+  }
+
+  size_t bucket = hash_key(key);
+  pthread_rwlock_wrlock(stripe_of(bucket));
+
+  SubscriberSet **slot = find_set(bucket, key);
+  SubscriberSet *set = *slot;
+  int result = set == NULL ? 1 : subscribers_remove(&set->subscribers, session_id);
+  if (result == 0) {
+    atomic_fetch_sub(&total, 1);
+  }
+
+  // The last subscriber takes the key out of the index
+  if (set != NULL && set->subscribers.count == 0) {
+    *slot = set->next;
+    free(set->key);
+    free(set->subscribers.sessions);
+    free(set);
+  }
+
+  pthread_rwlock_unlock(stripe_of(bucket));
+  return result;
+}
+
+size_t subscriptions_for_each(const char *key, void (*fn)(int, void *),
+                              void *arg) {
+  size_t count = 0;
+  if (atomic_load_explicit(&total, memory_order_relaxed) > 0) {
+    size_t bucket = hash_key(key);
+    pthread_rwlock_rdlock(stripe_of(bucket));
+    SubscriberSet *set = *find_set(bucket, key);
+    if (set != NULL) {
+      count += subscribers_call(&set->subscribers, fn, arg);
+    }
+    pthread_rwlock_unlock(stripe_of(bucket));
+  }
+
+  // Every node on the key's path is a prefix of it
+  if (atomic_load_explicit(&patterns, memory_order_relaxed) > 0) {
+    pthread_rwlock_rdlock(&trie_lock);
+    TrieNode *node = &trie;
+    for (const char *c = key; node != NULL; c++) {
+      count += subscribers_call(&node->subscribers, fn, arg);
+      node = *c == '\0' ? NULL : trie_child(node, (unsigned char)*c);
+    }
+    pthread_rwlock_unlock(&trie_lock);
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+#ifndef KVS_SUBSCRIPTIONS_H
+#define KVS_SUBSCRIPTIONS_H
+
+#include <stddef.h>
+
+#define SUBSCRIPTION_BUCKETS 4096 // buckets of the key -> subscribers index
+#define SUBSCRIPTION_STRIPES 256  // read-write locks shared by the buckets
+#define SUBSCRIPTION_WILDCARD '*' // ends a prefix pattern, as in "order:*"
+
+/// Index from keys to the sessions subscribed to them, so a write notifies
+/// its subscribers without looking at every session. Each bucket is guarded
+/// by the read-write lock of its stripe: notifications of different keys, and
+/// of the same key, run concurrently. Prefix patterns live in a trie, under a
+/// read-write lock of its own, and a key is matched against all of them by
+/// walking its path, in O(key length).
+
+/// @return 1 if the subscription is a prefix pattern, 0 if it is a key.
+int subscription_is_pattern(const char *key);
+
+/// Initializes the index.
+/// @return 0 if the index was initialized successfully, 1 otherwise.
+int subscriptions_init();
+
+/// Frees the index.
+void subscriptions_terminate();
+
+/// Subscribes a session to a key, or to every key starting with a prefix if
+/// it ends with SUBSCRIPTION_WILDCARD. The key need not exist.
+/// @return 0 if the subscription was added, 1 if the session was already
+/// subscribed, -1 if it could not be allocated.
+int subscriptions_add(const char *key, int session_id);
+
+/// Unsubscribes a session from a key or prefix pattern.
+/// @return 0 if the subscription was removed, 1 if there was none.
+int subscriptions_remove(const char *key, int session_id);
+
+/// Calls fn for every session subscribed to a key, or to a prefix of it. The
+/// key's stripe, or the trie, is read locked meanwhile, so none of the
+/// sessions can unsubscribe, and hence end, until fn returns. A key nobody
+/// subscribes to costs one bucket probe, plus a walk down the trie while
+/// there are patterns.
+/// @param fn Called with the id of each subscriber and arg, once per matching
+/// subscription: a session may be called more than once.
+/// @return Number of matching subscriptions.
+size_t subscriptions_for_each(const char *key, void (*fn)(int, void *),
+                              void *arg);
+
+#endif // KVS_SUBSCRIPTIONS_H
@@ -0,0 +1,49 @@
+#include "vclock.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+static int virtual_time = 0;
+static _Atomic uint64_t virtual_now_ms = 0;
+
+/// Calculates a timespec from a delay in milliseconds.
+/// @param delay_ms Delay in milliseconds.
+/// @return Timespec with the given delay.
+static struct timespec delay_to_timespec(unsigned int delay_ms) {
+  return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
+}
+
+void vclock_use_virtual_time() { virtual_time = 1; }
+
+int vclock_is_virtual() { return virtual_time; }
+
+uint64_t vclock_now_ms() {
+  if (virtual_time) {
+    return atomic_load(&virtual_now_ms);
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+void vclock_advance_to(uint64_t time_ms) {
+  if (!virtual_time) {
+    return;
+  }
+
+  uint64_t now = atomic_load(&virtual_now_ms);
+  while (now < time_ms &&
+         !atomic_compare_exchange_weak(&virtual_now_ms, &now, time_ms)) {
+  }
+}
+
+void vclock_sleep(unsigned int delay_ms) {
+  if (virtual_time) {
+    atomic_fetch_add(&virtual_now_ms, delay_ms);
+    return;
+  }
+
+  struct timespec delay = delay_to_timespec(delay_ms);
+  nanosleep(&delay, NULL);
+}
@@ -0,0 +1,27 @@
+#ifndef KVS_VCLOCK_H
+#define KVS_VCLOCK_H
+
+#include <stdint.h>
+
+/// Switches the server clock to simulated time. Must be called before any
+/// thread reads the clock. In simulated time nothing sleeps: waits advance
+/// the clock instead, so job traces full of WAITs replay at processing speed.
+void vclock_use_virtual_time();
+
+/// @return 1 if the clock is simulated, 0 if it follows CLOCK_MONOTONIC.
+int vclock_is_virtual();
+
+/// @return Current time in milliseconds.
+uint64_t vclock_now_ms();
+
+/// Moves the simulated clock forward to the given time. Has no effect on the
+/// real clock or if the clock is already past that time.
+/// @param time_ms Time to advance to, in milliseconds.
+void vclock_advance_to(uint64_t time_ms);
+
+/// Waits for a given amount of time: sleeps on the real clock, advances the
+/// simulated one.
+/// @param delay_ms Delay in milliseconds.
+void vclock_sleep(unsigned int delay_ms);
+
+#endif // KVS_VCLOCK_H
@@ -0,0 +1,109 @@
+// Microbenchmark for the batched lookups of READ: compares one read_pair per
+// key against read_pairs on a table much larger than the last level cache.
+//
+// Usage: read_bench [num_keys] [num_batches]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/server/kvs.h"
+#include "src/server/reclaim.h"
+
+#define BATCH_SIZE 256 // same as MAX_WRITE_SIZE, the largest READ
+#define KEY_SIZE 24
+
+static double now_s() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void make_key(char *key, size_t i) {
+  snprintf(key, KEY_SIZE, "%c%zu", 'a' + (int)(i % 26), i / 26);
+}
+
+int main(int argc, char **argv) {
+  size_t num_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+  size_t num_batches = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+  if (num_keys == 0 || num_batches == 0) {
+    fprintf(stderr, "Usage: %s [num_keys] [num_batches]\n", argv[0]);
+    return 1;
+  }
+
+  HashTable *ht = create_hash_table();
+  if (ht == NULL) {
+    fprintf(stderr, "Failed to create table\n");
+    return 1;
+  }
+
+  // Keys are unique, so link_pair_node never hands back a displaced value
+  char key[KEY_SIZE];
+  for (size_t i = 0; i < num_keys; i++) {
+    make_key(key, i);
+    KeyNode *node = create_pair_node(key, key);
+    if (node == NULL) {
+      fprintf(stderr, "Failed to allocate node\n");
+      return 1;
+    }
+    link_pair_node(ht, hash(key), node);
+  }
+
+  char(*batch_keys)[KEY_SIZE] = malloc(BATCH_SIZE * KEY_SIZE);
+  const char *key_ptrs[BATCH_SIZE];
+  char *values[BATCH_SIZE];
+  if (batch_keys == NULL) {
+    fprintf(stderr, "Failed to allocate keys\n");
+    return 1;
+  }
+
+  double serial = 0, batched = 0;
+  size_t found_serial = 0, found_batched = 0;
+  srand(42);
+  for (size_t b = 0; b < num_batches; b++) {
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      make_key(batch_keys[i], (size_t)rand() % num_keys);
+      key_ptrs[i] = batch_keys[i];
+    }
+
+    double start = now_s();
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      values[i] = read_pair(ht, key_ptrs[i]);
+    }
+    serial += now_s() - start;
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      found_serial += values[i] != NULL;
+      free(values[i]);
+    }
+
+    start = now_s();
+    read_pairs(ht, BATCH_SIZE, key_ptrs, values);
+    batched += now_s() - start;
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      found_batched += values[i] != NULL;
+      free(values[i]);
+    }
+  }
+
+  size_t lookups = num_batches * BATCH_SIZE;
+  printf("%zu keys, %zu lookups in batches of %d\n", num_keys, lookups,
+         BATCH_SIZE);
+  printf("read_pair:  %10.1f us/lookup (%zu found)\n",
+         serial * 1e6 / (double)lookups, found_serial);
+  printf("read_pairs: %10.1f us/lookup (%zu found)\n",
+         batched * 1e6 / (double)lookups, found_batched);
+  printf("speedup:    %10.2fx\n", serial / batched);
+
+  // Every key looked up was inserted
+  int result = 0;
+  if (found_serial != lookups || found_batched != lookups) {
+    fprintf(stderr, "Expected %zu keys found\n", lookups);
+    result = 1;
+  }
+
+  free(batch_keys);
+  free_table(ht);
+  reclaim_flush();
+  return result;
+}